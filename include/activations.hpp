@@ -3,6 +3,9 @@
 #include <math.h>
 
 #include "settings.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
 
 #pragma warning( disable : 4244 ) // type casting warning
 
@@ -18,46 +21,145 @@ namespace nn
 		kTanh
 	};
 
-	using ActivationFunction = real(*)(real);
+	const real kLReluSlope = real(0.001);
 
-	template<ActivationType t> real activation(real in);
-	template<ActivationType t> real activation_derivative(real in);
+#if USE_EIGEN == 1
+#if defined(EIGEN_VECTORIZE_SSE)
+#define NN_ACTIVATION_SSE 1
+	// all bits set in the lanes where a > 0
+	Eigen::internal::Packet4f positiveMask(const Eigen::internal::Packet4f& a) { return _mm_cmpgt_ps(a, _mm_setzero_ps()); }
+	Eigen::internal::Packet2d positiveMask(const Eigen::internal::Packet2d& a) { return _mm_cmpgt_pd(a, _mm_setzero_pd()); }
+#else
+#define NN_ACTIVATION_SSE 0
+#endif
+
+	// activations as functors for Eigen expressions, packet versions let Eigen vectorize them.
+	// The derivatives take the activations a = f(z) instead of z, so nothing is computed twice
+	template<ActivationType t> struct activation;
+	template<ActivationType t> struct activation_derivative;
 
 	// sigmoid
 	template<>
-	real activation<ActivationType::kSigmoid>(real in) { return 1.0 / (1.0 + exp(-in)); }
+	struct activation<ActivationType::kSigmoid>
+	{
+		enum { kPacketAccess = Eigen::internal::packet_traits<real>::HasExp && Eigen::internal::packet_traits<real>::HasDiv };
+		real operator()(real z) const { return real(1.0) / (real(1.0) + exp(-z)); }
+		template<typename Packet>
+		Packet packetOp(const Packet& z) const
+		{
+			using namespace Eigen::internal;
+			const Packet one = pset1<Packet>(real(1.0));
+			return pdiv(one, padd(one, pexp(pnegate(z))));
+		}
+	};
 	template<>
-	real activation_derivative<ActivationType::kSigmoid>(real in)
+	struct activation_derivative<ActivationType::kSigmoid>
 	{
-		const real x = activation<ActivationType::kSigmoid>(in); 
-		return x * (1.0 - x);
-	}
+		enum { kPacketAccess = 1 };
+		real operator()(real a) const { return a * (real(1.0) - a); }
+		template<typename Packet>
+		Packet packetOp(const Packet& a) const { return Eigen::internal::pmul(a, Eigen::internal::psub(Eigen::internal::pset1<Packet>(real(1.0)), a)); }
+	};
 
-	// sigmoid
+	// linear
 	template<>
-	real activation<ActivationType::kLinear>(real in) { return in; }
+	struct activation<ActivationType::kLinear>
+	{
+		enum { kPacketAccess = 1 };
+		real operator()(real z) const { return z; }
+		template<typename Packet>
+		Packet packetOp(const Packet& z) const { return z; }
+	};
 	template<>
-	real activation_derivative<ActivationType::kLinear>(real in) { return 1.0; }
+	struct activation_derivative<ActivationType::kLinear>
+	{
+		enum { kPacketAccess = 1 };
+		real operator()(real) const { return real(1.0); }
+		template<typename Packet>
+		Packet packetOp(const Packet&) const { return Eigen::internal::pset1<Packet>(real(1.0)); }
+	};
 
 	// RELU
 	template<>
-	real activation<ActivationType::kRelu>(real in) { return std::max(in, real(0.0)); }
+	struct activation<ActivationType::kRelu>
+	{
+		enum { kPacketAccess = Eigen::internal::packet_traits<real>::HasMax };
+		real operator()(real z) const { return std::max(z, real(0.0)); }
+		template<typename Packet>
+		Packet packetOp(const Packet& z) const { return Eigen::internal::pmax(z, Eigen::internal::pset1<Packet>(real(0.0))); }
+	};
 	template<>
-	real activation_derivative<ActivationType::kRelu>(real in) { return in > 0.0 ? 1.0 : 0.0; }
+	struct activation_derivative<ActivationType::kRelu>
+	{
+		enum { kPacketAccess = NN_ACTIVATION_SSE };
+		real operator()(real a) const { return a > real(0.0) ? real(1.0) : real(0.0); }
+		template<typename Packet>
+		Packet packetOp(const Packet& a) const { return Eigen::internal::pand(positiveMask(a), Eigen::internal::pset1<Packet>(real(1.0))); }
+	};
 
 	// LRELU (Leaky RELU)
 	template<>
-	real activation<ActivationType::kLRelu>(real in) { return in > 0.0 ? in : 0.001 * in; }
+	struct activation<ActivationType::kLRelu>
+	{
+		enum { kPacketAccess = Eigen::internal::packet_traits<real>::HasMax };
+		real operator()(real z) const { return z > real(0.0) ? z : kLReluSlope * z; }
+		// the slope is below 1, so max picks the right branch
+		template<typename Packet>
+		Packet packetOp(const Packet& z) const { return Eigen::internal::pmax(z, Eigen::internal::pmul(z, Eigen::internal::pset1<Packet>(kLReluSlope))); }
+	};
 	template<>
-	real activation_derivative<ActivationType::kLRelu>(real in) { return in > 0.0 ? 1.0 : -0.001; }
+	struct activation_derivative<ActivationType::kLRelu>
+	{
+		enum { kPacketAccess = NN_ACTIVATION_SSE };
+		real operator()(real a) const { return a > real(0.0) ? real(1.0) : kLReluSlope; }
+		template<typename Packet>
+		Packet packetOp(const Packet& a) const
+		{
+			using namespace Eigen::internal;
+			return padd(pset1<Packet>(kLReluSlope), pand(positiveMask(a), pset1<Packet>(real(1.0) - kLReluSlope)));
+		}
+	};
 
-	// tanh
+	// tanh, as 2 * sigmoid(2z) - 1 which takes a single exp and saturates instead of overflowing
 	template<>
-	real activation<ActivationType::kTanh>(real in) { return (1.0 - exp(-2.0 * in)) / (1.0 + exp(-2.0 * in)); }
+	struct activation<ActivationType::kTanh>
+	{
+		enum { kPacketAccess = Eigen::internal::packet_traits<real>::HasExp && Eigen::internal::packet_traits<real>::HasDiv };
+		real operator()(real z) const { return real(2.0) / (real(1.0) + exp(real(-2.0) * z)) - real(1.0); }
+		template<typename Packet>
+		Packet packetOp(const Packet& z) const
+		{
+			using namespace Eigen::internal;
+			const Packet one = pset1<Packet>(real(1.0));
+			return psub(pdiv(pset1<Packet>(real(2.0)), padd(one, pexp(pmul(pset1<Packet>(real(-2.0)), z)))), one);
+		}
+	};
 	template<>
-	real activation_derivative<ActivationType::kTanh>(real in)
+	struct activation_derivative<ActivationType::kTanh>
+	{
+		enum { kPacketAccess = 1 };
+		real operator()(real a) const { return real(1.0) - a * a; }
+		template<typename Packet>
+		Packet packetOp(const Packet& a) const { return Eigen::internal::psub(Eigen::internal::pset1<Packet>(real(1.0)), Eigen::internal::pmul(a, a)); }
+	};
+#endif
+}
+
+#if USE_EIGEN == 1
+namespace Eigen
+{
+	namespace internal
 	{
-		const real x = activation<ActivationType::kTanh>(in);
-		return 1.0 - x * x;
+		template<nn::ActivationType t>
+		struct functor_traits<nn::activation<t>>
+		{
+			enum { Cost = 10 * NumTraits<nn::real>::MulCost, PacketAccess = nn::activation<t>::kPacketAccess };
+		};
+		template<nn::ActivationType t>
+		struct functor_traits<nn::activation_derivative<t>>
+		{
+			enum { Cost = 2 * NumTraits<nn::real>::MulCost, PacketAccess = nn::activation_derivative<t>::kPacketAccess };
+		};
 	}
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+#include <vector>
+#include "settings.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// bytes of a cache line
+	const size_t kCacheLineBytes = 64;
+
+	// a dynamic matrix of reals whose storage starts on a cache line and is padded to whole lines, so
+	// no two of them share one. Hogwild workers write the parameters of all layers at once, a line
+	// shared by the end of one matrix and the start of the next would bounce between the cores.
+	// It is a Map over storage of its own and works wherever a matrix expression does
+	class aligned_matrix : public Eigen::Map<Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>>
+	{
+	public:
+		using MatrixType = Eigen::Matrix<nn::real, Eigen::Dynamic, Eigen::Dynamic>;
+		using Base = Eigen::Map<MatrixType>;
+		using Index = MatrixType::Index;
+
+		aligned_matrix() : Base(nullptr, 0, 0) {}
+
+		aligned_matrix(const aligned_matrix& other) : Base(nullptr, 0, 0)
+		{
+			*this = other;
+		}
+
+		aligned_matrix& operator=(const aligned_matrix& other)
+		{
+			resize(other.rows(), other.cols());
+			Base::operator=(static_cast<const Base&>(other));
+			return *this;
+		}
+
+		// resizes to the shape of the expression first, as assigning to a matrix does
+		template <typename Derived>
+		aligned_matrix& operator=(const Eigen::DenseBase<Derived>& other)
+		{
+			resize(other.rows(), other.cols());
+			Base::operator=(other);
+			return *this;
+		}
+
+		// keeps the values when the shape doesn't change, zeroes them otherwise
+		void resize(Index rows, Index cols)
+		{
+			if (rows == this->rows() && cols == this->cols() && !m_storage.empty())
+				return;
+			const size_t lineReals = kCacheLineBytes / sizeof(Scalar);
+			const size_t padded = (size_t(rows * cols) + lineReals - 1) / lineReals * lineReals;
+			m_storage.assign(padded + lineReals, Scalar(0.0));
+			const uintptr_t address = reinterpret_cast<uintptr_t>(m_storage.data());
+			Scalar* aligned = reinterpret_cast<Scalar*>((address + kCacheLineBytes - 1) & ~uintptr_t(kCacheLineBytes - 1));
+			new (static_cast<Base*>(this)) Base(aligned, rows, cols);
+		}
+
+	private:
+		std::vector<Scalar> m_storage;
+	};
+#endif
+}
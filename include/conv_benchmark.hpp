@@ -0,0 +1,178 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include "settings.hpp"
+#include "im2col.hpp"
+#include "conv_engine.hpp"
+#include "convolution.hpp"
+#include "timing.hpp"
+#include "thread_pool.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// milliseconds per image of every convolution algorithm on the shapes of convolution layers, Winograd without
+	// the filter transform layers do once per batch. The one selectConvolutionAlgorithm() picks is marked by '*',
+	// then the largest difference to the direct loops. Then the same for conv() on single channel images, both
+	// padding modes and random or Gaussian kernels, against its reference loops, last a filter bank by conv()
+	// calls and by one convBatch()
+	void benchmarkConvolution(std::ostream& out,
+		const std::vector<conv_geometry>& shapes = {
+			conv_geometry(1, 28, 28, 8, 3, 1, 1), conv_geometry(8, 28, 28, 16, 3, 1, 1), conv_geometry(16, 14, 14, 32, 3, 1, 1),
+			conv_geometry(32, 7, 7, 64, 3, 1, 1), conv_geometry(64, 3, 3, 64, 3, 1, 1), conv_geometry(8, 28, 28, 16, 5, 1, 2),
+			conv_geometry(16, 28, 28, 16, 3, 2, 1), conv_geometry(4, 64, 64, 8, 7, 1, 3), conv_geometry(4, 64, 64, 8, 11, 1, 5),
+			conv_geometry(1, 256, 256, 1, 9, 1, 4), conv_geometry(1, 256, 256, 1, 15, 1, 7), conv_geometry(1, 256, 256, 1, 31, 1, 15) },
+		float secondsPerAlgorithm = 0.05f)
+	{
+		using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
+		struct algorithm_name
+		{
+			ConvolutionAlgorithm algorithm;
+			const char* name;
+		};
+		const algorithm_name algorithms[] = {
+			{ ConvolutionAlgorithm::kDirect, "direct" },
+			{ ConvolutionAlgorithm::kIm2col, "im2col" },
+			{ ConvolutionAlgorithm::kWinograd2x2, "winograd 2x2" },
+			{ ConvolutionAlgorithm::kWinograd4x4, "winograd 4x4" },
+			{ ConvolutionAlgorithm::kFft, "fft" } };
+
+		out << std::setw(28) << "shape";
+		for (const auto& a : algorithms)
+			out << std::setw(16) << a.name;
+		out << std::setw(12) << "max diff" << std::endl;
+
+		std::vector<real, Eigen::aligned_allocator<real>> scratch;
+		for (const auto& g : shapes)
+		{
+			const MatrixType weights = MatrixType::Random(g.filters, g.patchSize());
+			const MatrixType image = MatrixType::Random(g.inputSize(), 1);
+			const ConvolutionAlgorithm selected = selectConvolutionAlgorithm(g);
+			out << std::setw(28) << (std::to_string(g.channels) + "x" + std::to_string(g.height) + "x" + std::to_string(g.width) + " " +
+				std::to_string(g.filters) + "@" + std::to_string(g.kernelSize) + "x" + std::to_string(g.kernelSize) + "/" + std::to_string(g.stride));
+			MatrixType reference;
+			real maxDiff = real(0.0);
+			for (const auto& a : algorithms)
+			{
+				if ((winogradTile(a.algorithm) && (g.kernelSize != 3 || g.stride != 1)) || (a.algorithm == ConvolutionAlgorithm::kFft && g.stride != 1))
+				{
+					out << std::setw(16) << "-";
+					continue;
+				}
+				scratch.resize(convolutionScratchSize(g, a.algorithm));
+				MatrixType result = MatrixType::Zero(g.outputSize(), 1);
+				// timed as layers run them, with the filters transformed once for the batch
+				const size_t filterSize = convolutionFilterSize(g, a.algorithm);
+				const size_t offset = filterSize ? gemm_blocking::aligned(filterSize) : 0;
+				transformFilters(g, a.algorithm, weights.data(), size_t(weights.outerStride()), scratch.data());
+				auto run = [&]
+				{
+					convolveTransformed(g, a.algorithm, weights.data(), size_t(weights.outerStride()), scratch.data(), image.data(), result.data(),
+						scratch.data() + offset, scratch.size() - offset);
+				};
+				run();
+				if (reference.size() == 0)
+					reference = result;
+				else
+					maxDiff = std::max(maxDiff, (result - reference).cwiseAbs().maxCoeff());
+
+				size_t repetitions = 0;
+				timing timer;
+				do
+				{
+					result.setZero();
+					run();
+					++repetitions;
+				} while (timer.seconds() < secondsPerAlgorithm);
+				out << std::setw(15) << std::fixed << std::setprecision(3) << timer.seconds() * 1e3 / repetitions << (a.algorithm == selected ? "*" : " ");
+			}
+			out << std::setw(12) << std::scientific << std::setprecision(1) << maxDiff << std::endl;
+		}
+
+		// conv() as called on images, milliseconds and the largest difference to the reference loops. kAuto takes
+		// two 1D passes for the Gaussians, which have rank 1
+		std::vector<algorithm_name> convAlgorithms(std::begin(algorithms), std::end(algorithms));
+		convAlgorithms.push_back({ ConvolutionAlgorithm::kAuto, "auto" });
+		out << std::setw(28) << "conv()";
+		for (const auto& a : convAlgorithms)
+			out << std::setw(22) << a.name;
+		out << std::endl;
+		for (bool gaussian : { false, true })
+			for (uint32_t kernelSize : { 3, 5, 15, 31 })
+				for (bool zeroPad : { false, true })
+				{
+					const MatrixType input = MatrixType::Random(256, 256);
+					MatrixType kernel = MatrixType::Random(kernelSize, kernelSize).cwiseAbs();
+					if (gaussian)
+					{
+						const real sigma = real(kernelSize) / real(4.0), center = real(kernelSize / 2);
+						MatrixType g(kernelSize, 1);
+						for (uint32_t i = 0; i < kernelSize; ++i)
+							g(i) = std::exp(-(real(i) - center) * (real(i) - center) / (real(2.0) * sigma * sigma));
+						kernel = g * g.transpose();
+					}
+					const MatrixType reference = conv(input, kernel, 1, zeroPad, true, ConvolutionAlgorithm::kDirect);
+					const ConvolutionAlgorithm selected = kernelSize % 2 ? selectConvolutionAlgorithm(conv_geometry(1, 256, 256, 1, kernelSize)) : ConvolutionAlgorithm::kDirect;
+					out << std::setw(28) << (std::to_string(kernelSize) + "x" + std::to_string(kernelSize) + (gaussian ? " gaussian" : "") + (zeroPad ? " zero padded" : " valid"));
+					for (const auto& a : convAlgorithms)
+					{
+						if (winogradTile(a.algorithm) && kernelSize != 3)
+						{
+							out << std::setw(22) << "-";
+							continue;
+						}
+						MatrixType result;
+						size_t repetitions = 0;
+						timing timer;
+						do
+						{
+							result = conv(input, kernel, 1, zeroPad, true, a.algorithm);
+							++repetitions;
+						} while (timer.seconds() < secondsPerAlgorithm);
+						out << std::setw(9) << std::fixed << std::setprecision(3) << timer.seconds() * 1e3 / repetitions << (a.algorithm == selected ? "*" : " ") <<
+							" (" << std::scientific << std::setprecision(1) << (result - reference).cwiseAbs().maxCoeff() << ")";
+					}
+					out << std::endl;
+				}
+
+		// a filter bank on a batch of images, conv() per image and kernel against one convBatch() call
+		thread_pool pool;
+		const conv_geometry bank(1, 64, 64, 8, 5, 1, 2);
+		const size_t images = 64;
+		const MatrixType batch = MatrixType::Random(bank.inputSize(), images);
+		const MatrixType kernels = MatrixType::Random(bank.patchSize(), bank.filters).cwiseAbs();
+		MatrixType output(bank.outputSize(), images);
+		out << std::setw(28) << (std::to_string(images) + "x64x64 8@5x5 batch");
+		size_t repetitions = 0;
+		timing timer;
+		do
+		{
+			for (size_t i = 0; i < images; ++i)
+				for (uint32_t f = 0; f < bank.filters; ++f)
+					output.col(i).segment(f * bank.pixels(), bank.pixels()) = Eigen::Map<const MatrixType>(conv(Eigen::Map<const MatrixType>(batch.col(i).data(), 64, 64),
+						Eigen::Map<const MatrixType>(kernels.col(f).data(), 5, 5), 1, true, true).data(), bank.pixels(), 1);
+			++repetitions;
+		} while (timer.seconds() < secondsPerAlgorithm);
+		out << std::setw(14) << std::fixed << std::setprecision(3) << timer.seconds() * 1e3 / repetitions << " conv()";
+		const MatrixType reference = output;
+		repetitions = 0;
+		timer.start();
+		do
+		{
+			convBatch(bank, batch.data(), images, kernels.data(), output.data(), pool, true);
+			++repetitions;
+		} while (timer.seconds() < secondsPerAlgorithm);
+		out << std::setw(14) << std::fixed << std::setprecision(3) << timer.seconds() * 1e3 / repetitions << " convBatch()" <<
+			std::setw(12) << std::scientific << std::setprecision(1) << (output - reference).cwiseAbs().maxCoeff() << std::endl;
+	}
+#endif
+}
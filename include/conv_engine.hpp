@@ -0,0 +1,182 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "settings.hpp"
+#include "im2col.hpp"
+#include "winograd.hpp"
+#include "fft_convolution.hpp"
+#include "separable.hpp"
+#include "kernels.hpp"
+#include "gemm.hpp"
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	enum class ConvolutionAlgorithm
+	{
+		kAuto,        // selectConvolutionAlgorithm()
+		kDirect,      // kernel rows correlated with image rows, no scratch
+		kIm2col,      // im2col and one product with all filters
+		kWinograd2x2, // F(2x2, 3x3), 3x3 kernels with stride 1 only
+		kWinograd4x4, // F(4x4, 3x3), 3x3 kernels with stride 1 only
+		kFft          // products of spectra, stride 1 only
+	};
+
+	// kernels from these sizes on go through the FFT, where it beats the product, or the direct loops for
+	// a few filters and channels, see benchmarkConvolution()
+	const uint32_t kFftKernelSize = 11;
+	const uint32_t kFftDirectKernelSize = 13;
+
+	// the fastest algorithm for the shape, see benchmarkConvolution(): the FFT for large stride 1 kernels,
+	// Winograd for 3x3 stride 1 kernels once there are enough filters and channels for its products to
+	// outweigh the transforms, 4x4 tiles if the output is 3x3 at least. Otherwise the product, or the
+	// direct loops for a few filters and channels
+	ConvolutionAlgorithm selectConvolutionAlgorithm(const conv_geometry& g)
+	{
+		const size_t weights = size_t(g.filters) * g.channels;
+		if (g.stride == 1 && g.kernelSize >= (weights < 4 ? kFftDirectKernelSize : kFftKernelSize))
+			return ConvolutionAlgorithm::kFft;
+		if (g.kernelSize == 3 && g.stride == 1 && weights >= 128)
+		{
+			if (g.outputHeight() >= 3 && g.outputWidth() >= 3)
+				return ConvolutionAlgorithm::kWinograd4x4;
+			if (g.outputHeight() >= 2 && g.outputWidth() >= 2)
+				return ConvolutionAlgorithm::kWinograd2x2;
+		}
+		return weights < 4 ? ConvolutionAlgorithm::kDirect : ConvolutionAlgorithm::kIm2col;
+	}
+
+	// tile size of a Winograd algorithm, 0 for the others
+	uint32_t winogradTile(ConvolutionAlgorithm algorithm)
+	{
+		return algorithm == ConvolutionAlgorithm::kWinograd2x2 ? 2 : algorithm == ConvolutionAlgorithm::kWinograd4x4 ? 4 : 0;
+	}
+
+	namespace
+	{
+		void checkConvolution(const conv_geometry& g, ConvolutionAlgorithm algorithm)
+		{
+			if ((winogradTile(algorithm) && (g.kernelSize != 3 || g.stride != 1)) || (algorithm == ConvolutionAlgorithm::kFft && g.stride != 1))
+				throw std::logic_error("Convolution algorithm doesn't take the geometry");
+		}
+	}
+
+	// reals the filters of the algorithm take transformed, none for the ones taking the weights as they are
+	size_t convolutionFilterSize(const conv_geometry& g, ConvolutionAlgorithm algorithm)
+	{
+		if (algorithm == ConvolutionAlgorithm::kAuto)
+			algorithm = selectConvolutionAlgorithm(g);
+		if (const uint32_t m = winogradTile(algorithm))
+			return winogradFilterSize(g, m);
+		if (algorithm == ConvolutionAlgorithm::kFft)
+			return fftFilterSize(g);
+		return 0;
+	}
+
+	// reals of scratch convolveTransformed() takes per image
+	size_t convolutionImageScratchSize(const conv_geometry& g, ConvolutionAlgorithm algorithm)
+	{
+		if (algorithm == ConvolutionAlgorithm::kAuto)
+			algorithm = selectConvolutionAlgorithm(g);
+		if (const uint32_t m = winogradTile(algorithm))
+			return winogradScratchSize(g, m);
+		if (algorithm == ConvolutionAlgorithm::kFft)
+			return fftScratchSize(g);
+		if (algorithm == ConvolutionAlgorithm::kIm2col)
+			return gemm_blocking::aligned(g.pixels() * g.patchSize()) + gemmPackingSize(g.pixels(), g.filters, g.patchSize());
+		return 0;
+	}
+
+	// reals of scratch convolve() takes, the transformed filters followed by the scratch of an image
+	size_t convolutionScratchSize(const conv_geometry& g, ConvolutionAlgorithm algorithm)
+	{
+		const size_t filterSize = convolutionFilterSize(g, algorithm);
+		return (filterSize ? gemm_blocking::aligned(filterSize) : 0) + convolutionImageScratchSize(g, algorithm);
+	}
+
+	// transforms the filters x patchSize weights with leading dimension ldw into convolutionFilterSize() reals,
+	// once for any number of images convolved with them until they change
+	void transformFilters(const conv_geometry& g, ConvolutionAlgorithm algorithm, const real* weights, size_t ldw, real* transformed)
+	{
+		if (algorithm == ConvolutionAlgorithm::kAuto)
+			algorithm = selectConvolutionAlgorithm(g);
+		checkConvolution(g, algorithm);
+		if (const uint32_t m = winogradTile(algorithm))
+			winogradTransformFilters(g, m, weights, ldw, transformed);
+		else if (algorithm == ConvolutionAlgorithm::kFft)
+			fftTransformFilters(g, weights, ldw, transformed);
+	}
+
+	// output += the convolution of one image with the filters, output is filters x outputHeight x outputWidth.
+	// Direct loops and im2col take the weights, the others the filters transformFilters() made of them
+	void convolveTransformed(const conv_geometry& g, ConvolutionAlgorithm algorithm, const real* weights, size_t ldw, const real* transformed,
+		const real* image, real* output, real* scratch, size_t scratchSize)
+	{
+		if (algorithm == ConvolutionAlgorithm::kAuto)
+			algorithm = selectConvolutionAlgorithm(g);
+		checkConvolution(g, algorithm);
+		if (scratchSize < convolutionImageScratchSize(g, algorithm))
+			throw std::logic_error("Convolution scratch buffer is too small");
+		const size_t pixels = g.pixels();
+		if (const uint32_t m = winogradTile(algorithm))
+			winogradConvolve(g, m, transformed, image, output, scratch, scratchSize);
+		else if (algorithm == ConvolutionAlgorithm::kFft)
+			fftConvolve(g, transformed, image, output, scratch, scratchSize);
+		else if (algorithm == ConvolutionAlgorithm::kIm2col)
+		{
+			const size_t columnsSize = gemm_blocking::aligned(pixels * g.patchSize());
+			im2col(g, image, scratch);
+			backend().gemm(pixels, g.filters, g.patchSize(), real(1.0), scratch, pixels, false, weights, ldw, true, real(1.0), output, pixels, scratch + columnsSize, scratchSize - columnsSize);
+		}
+		else
+		{
+			// every output row takes all its taps while it is in the cache, with stride 1 a row of the kernel
+			// at a time as a 1D correlation
+			const size_t ow = g.outputWidth();
+			std::vector<real> taps(g.kernelSize);
+			for (uint32_t f = 0; f < g.filters; ++f)
+				for (size_t oy = 0; oy < g.outputHeight(); ++oy)
+				{
+					real* out = output + f * pixels + oy * ow;
+					for (uint32_t c = 0; c < g.channels; ++c)
+						for (uint32_t ky = 0; ky < g.kernelSize; ++ky)
+						{
+							const size_t y = oy * g.stride + ky;
+							if (y < g.padding || y - g.padding >= g.height)
+								continue;
+							const real* in = image + (size_t(c) * g.height + y - g.padding) * g.width;
+							const real* w = weights + f + (size_t(c) * g.kernelSize + ky) * g.kernelSize * ldw;
+							if (g.stride == 1)
+							{
+								for (uint32_t kx = 0; kx < g.kernelSize; ++kx)
+									taps[kx] = w[kx * ldw];
+								correlateRow(in, g.width, taps.data(), g.kernelSize, g.padding, out, ow);
+								continue;
+							}
+							for (uint32_t kx = 0; kx < g.kernelSize; ++kx)
+							{
+								size_t begin, end;
+								im2colRange(g, kx, begin, end);
+								for (size_t ox = begin; ox < end; ++ox)
+									out[ox] += w[kx * ldw] * in[ox * g.stride + kx - g.padding];
+							}
+						}
+				}
+		}
+	}
+
+	// convolveTransformed() of one image, transforming the filters into the start of scratch first
+	void convolve(const conv_geometry& g, ConvolutionAlgorithm algorithm, const real* weights, size_t ldw, const real* image, real* output, real* scratch, size_t scratchSize)
+	{
+		if (scratchSize < convolutionScratchSize(g, algorithm))
+			throw std::logic_error("Convolution scratch buffer is too small");
+		const size_t filterSize = convolutionFilterSize(g, algorithm);
+		const size_t offset = filterSize ? gemm_blocking::aligned(filterSize) : 0;
+		transformFilters(g, algorithm, weights, ldw, scratch);
+		convolveTransformed(g, algorithm, weights, ldw, scratch, image, output, scratch + offset, scratchSize - offset);
+	}
+#endif
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "settings.hpp"
+#include "kernels.hpp"
+
+namespace nn
+{
+	// out[i] = real(in[i]) * scale, used to decode uint8 samples when a batch is assembled
+	void convert(const uint8_t* in, size_t count, float* out, float scale)
+	{
+		kernels().convert(in, count, out, scale);
+	}
+
+	void convert(const uint8_t* in, size_t count, double* out, double scale)
+	{
+		for (size_t i = 0; i < count; ++i)
+			out[i] = double(in[i]) * scale;
+	}
+}
@@ -1,7 +1,14 @@
 #pragma once
 
 #include "layer.hpp"
+#include "conv_engine.hpp"
+#include "separable.hpp"
+#include "thread_pool.hpp"
 #include <Eigen/Dense>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
 
 namespace
 {
@@ -23,9 +30,20 @@ namespace
 		const auto KSizeX = kernel.rows();
 		const auto KSizeY = kernel.cols();
 
-		for (auto row = start_row; row < end_row; row += stride)
-			for (auto col = start_col; col < end_col; col += stride)
-				output(row - start_row, col - start_col) = input.block(row - KSizeX / 2, col - KSizeY / 2, KSizeX, KSizeY).cwiseProduct(kernel).sum();
+		if (stride == 1)
+		{
+			// one kernel tap at a time over a whole output column, so the dispatched axpy runs on contiguous rows
+			for (auto col = start_col; col < end_col; ++col)
+				for (layer::MatrixType::Index kc = 0; kc < KSizeY; ++kc)
+					for (layer::MatrixType::Index kr = 0; kr < KSizeX; ++kr)
+						axpy(end_row - start_row, kernel(kr, kc), &input(start_row - KSizeX / 2 + kr, col - KSizeY / 2 + kc), &output(0, col - start_col));
+		}
+		else
+		{
+			for (auto row = start_row; row < end_row; row += stride)
+				for (auto col = start_col; col < end_col; col += stride)
+					output(row - start_row, col - start_col) = input.block(row - KSizeX / 2, col - KSizeY / 2, KSizeX, KSizeY).cwiseProduct(kernel).sum();
+		}
 
 		if (normalize)
 			return output / kernel.sum();
@@ -33,6 +51,23 @@ namespace
 			return output;
 	}
 
+	// the kernel conv() transformed last on this thread with its spectra or Winograd filters, so filtering
+	// many images with one kernel transforms it once
+	struct conv_kernel_cache
+	{
+		layer::MatrixType kernel;
+		conv_geometry geometry;
+		ConvolutionAlgorithm algorithm = ConvolutionAlgorithm::kAuto;
+		std::vector<real, Eigen::aligned_allocator<real>> transformed;
+		std::vector<real, Eigen::aligned_allocator<real>> scratch;
+	};
+
+	conv_kernel_cache& convKernelCache()
+	{
+		static thread_local conv_kernel_cache cache;
+		return cache;
+	}
+
 	layer::MatrixType zero_pad(const layer::MatrixType& input, uint32_t size)
 	{
 		layer::MatrixType result = layer::MatrixType::Zero(input.rows() + 2 * size, input.cols() + 2 * size);
@@ -43,10 +78,51 @@ namespace
 
 namespace nn
 {
-	layer::MatrixType conv(const layer::MatrixType& input, const layer::MatrixType& kernel, uint32_t stride, bool zeroPad = false, bool normalize = false)
+	// stride 1 convolutions with square kernels of odd size go through the convolution engine, the
+	// others and kDirect through the reference loops below. The engine picks the FFT for large kernels,
+	// kAuto takes two 1D passes for kernels of rank 1. Rows of the input are contiguous, so they are the
+	// width of the engine's image and the columns its height
+	layer::MatrixType conv(const layer::MatrixType& input, const layer::MatrixType& kernel, uint32_t stride, bool zeroPad = false, bool normalize = false,
+		ConvolutionAlgorithm algorithm = ConvolutionAlgorithm::kAuto)
 	{
-		const auto kernel_half_width = kernel.cols() / 2;
-		const auto kernel_half_height = kernel.rows() / 2;
+		const auto k = uint32_t(kernel.rows());
+		if (algorithm != ConvolutionAlgorithm::kDirect && stride == 1 && kernel.cols() == kernel.rows() && k % 2 == 1)
+		{
+			const conv_geometry g(1, uint32_t(input.cols()), uint32_t(input.rows()), 1, k, 1, zeroPad ? k / 2 : 0);
+			if (g.valid())
+			{
+				// kernel.data() is the engine's kernel row after row, its rows are the columns of kernel
+				layer::MatrixType vertical(k, 1), horizontal(k, 1);
+				if (algorithm == ConvolutionAlgorithm::kAuto && k > 1 && separateKernel(kernel.data(), k, k, vertical.data(), horizontal.data()))
+				{
+					auto& cache = convKernelCache();
+					cache.scratch.resize(std::max(cache.scratch.size(), separableScratchSize(g.width)));
+					layer::MatrixType output = layer::MatrixType::Zero(g.outputWidth(), g.outputHeight());
+					separableConvolve(input.data(), g.height, g.width, vertical.data(), k, g.padding, horizontal.data(), k, g.padding, output.data(), cache.scratch.data());
+					if (normalize)
+						output /= kernel.sum();
+					return output;
+				}
+				if (algorithm == ConvolutionAlgorithm::kAuto)
+					algorithm = selectConvolutionAlgorithm(g);
+				auto& cache = convKernelCache();
+				if (cache.algorithm != algorithm || !(cache.geometry == g) || cache.kernel.rows() != kernel.rows() || cache.kernel != kernel)
+				{
+					cache.kernel = kernel;
+					cache.geometry = g;
+					cache.algorithm = algorithm;
+					cache.transformed.resize(convolutionFilterSize(g, algorithm));
+					cache.scratch.resize(convolutionImageScratchSize(g, algorithm));
+					transformFilters(g, algorithm, kernel.data(), 1, cache.transformed.data());
+				}
+				layer::MatrixType output = layer::MatrixType::Zero(g.outputWidth(), g.outputHeight());
+				convolveTransformed(g, algorithm, kernel.data(), 1, cache.transformed.data(), input.data(), output.data(), cache.scratch.data(), cache.scratch.size());
+				if (normalize)
+					output /= kernel.sum();
+				return output;
+			}
+		}
+
 		if (!zeroPad)
 		{
 			const auto result_width = conv_size(input.cols(), kernel.cols(), 0, stride);
@@ -59,13 +135,166 @@ namespace nn
 		}
 		else
 		{
-			return conv_helper(zero_pad(input, kernel_half_width), 
-				kernel, kernel_half_width, kernel_half_height, 
-				kernel_half_width + input.cols(),
-				kernel_half_height + input.rows(),
+			// padded by half the larger side of the kernel on every edge, the output has the size of the input
+			const auto padding = uint32_t(std::max(kernel.rows(), kernel.cols()) / 2);
+			return conv_helper(zero_pad(input, padding),
+				kernel, padding, padding,
+				padding + uint32_t(input.rows()),
+				padding + uint32_t(input.cols()),
 				stride,
 				normalize);
 		}
 	}
 
+	// count images of g.channels x g.height x g.width stored one after another (NCHW) convolved with all
+	// g.filters kernels of g.channels x kernelSize x kernelSize, stored the same way. output takes
+	// count x filters x outputHeight x outputWidth and is overwritten. The padding of g is read as zeros
+	// instead of being copied. Images, and groups of filters when there are fewer images than workers,
+	// are spread over the pool, every group is transformed once for all images. normalize divides every
+	// output channel by the sum of its kernel
+	void convBatch(const conv_geometry& g, const real* images, size_t count, const real* kernels, real* output, thread_pool& pool,
+		bool normalize = false, ConvolutionAlgorithm algorithm = ConvolutionAlgorithm::kAuto)
+	{
+		if (!g.valid())
+			throw std::logic_error("Convolution geometry is invalid");
+		if (count == 0)
+			return;
+		// filters of a group and the geometry of group j, the last one may be smaller
+		const size_t wanted = std::min<size_t>(g.filters, (pool.size() + count - 1) / count);
+		const uint32_t groupFilters = uint32_t((g.filters + wanted - 1) / wanted);
+		const uint32_t groups = (g.filters + groupFilters - 1) / groupFilters;
+		auto groupGeometry = [&](size_t j)
+		{
+			conv_geometry result = g;
+			result.filters = std::min(groupFilters, g.filters - uint32_t(j) * groupFilters);
+			return result;
+		};
+		const conv_geometry group = groupGeometry(0);
+		if (algorithm == ConvolutionAlgorithm::kAuto)
+			algorithm = selectConvolutionAlgorithm(group);
+
+		// the kernels as the engine takes them, a filters x patchSize matrix
+		using Buffer = std::vector<real, Eigen::aligned_allocator<real>>;
+		const size_t patchSize = g.patchSize(), pixels = g.pixels();
+		Buffer weights(g.filters * patchSize);
+		for (uint32_t f = 0; f < g.filters; ++f)
+		{
+			const real* kernel = kernels + f * patchSize;
+			const real scale = normalize ? real(1.0) / std::accumulate(kernel, kernel + patchSize, real(0.0)) : real(1.0);
+			for (size_t p = 0; p < patchSize; ++p)
+				weights[f + p * g.filters] = scale * kernel[p];
+		}
+		std::vector<Buffer> transformed(groups, Buffer(convolutionFilterSize(group, algorithm)));
+		pool.parallel_for(0, groups, 1, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t j = begin; j < end; ++j)
+				transformFilters(groupGeometry(j), algorithm, weights.data() + j * groupFilters, g.filters, transformed[j].data());
+		});
+
+		// scratch per worker, a few tasks per worker to even out their load
+		std::vector<Buffer> scratch(pool.size());
+		const size_t scratchSize = std::max(convolutionImageScratchSize(group, algorithm), convolutionImageScratchSize(groupGeometry(groups - 1), algorithm));
+		const size_t tasks = count * groups;
+		pool.parallel_for(0, tasks, std::max<size_t>(1, tasks / (4 * pool.size())), [&](size_t begin, size_t end, uint32_t worker)
+		{
+			Buffer& s = scratch[worker];
+			if (s.size() < scratchSize)
+				s.resize(scratchSize);
+			for (size_t t = begin; t < end; ++t)
+			{
+				const size_t image = t / groups, j = t % groups;
+				const conv_geometry gj = groupGeometry(j);
+				real* out = output + (image * g.filters + j * groupFilters) * pixels;
+				std::fill(out, out + gj.outputSize(), real(0.0));
+				convolveTransformed(gj, algorithm, weights.data() + j * groupFilters, g.filters, transformed[j].data(),
+					images + image * g.inputSize(), out, s.data(), s.size());
+			}
+		});
+	}
+	// conv() of the stride 1 kernel columnKernel * rowKernel^T given by its two vectors: columnKernel runs down
+	// the columns of input and rowKernel along its rows. zeroPad pads by half of each, normalize divides by the sum of the kernel
+	layer::MatrixType convSeparable(const layer::MatrixType& input, const layer::MatrixType& columnKernel, const layer::MatrixType& rowKernel,
+		bool zeroPad = false, bool normalize = false)
+	{
+		const size_t kc = size_t(columnKernel.size()), kr = size_t(rowKernel.size());
+		const size_t paddingX = zeroPad ? kc / 2 : 0, paddingY = zeroPad ? kr / 2 : 0;
+		if (kc == 0 || kr == 0 || kc > size_t(input.rows()) + 2 * paddingX || kr > size_t(input.cols()) + 2 * paddingY)
+			throw std::logic_error("Separable kernel doesn't fit the input");
+		const size_t width = size_t(input.rows()), height = size_t(input.cols());
+		auto& cache = convKernelCache();
+		cache.scratch.resize(std::max(cache.scratch.size(), separableScratchSize(width)));
+		layer::MatrixType output = layer::MatrixType::Zero(width + 2 * paddingX - kc + 1, height + 2 * paddingY - kr + 1);
+		separableConvolve(input.data(), height, width, rowKernel.data(), kr, paddingY, columnKernel.data(), kc, paddingX, output.data(), cache.scratch.data());
+		if (normalize)
+			output /= columnKernel.sum() * rowKernel.sum();
+		return output;
+	}
+
+	// count images of g.channels x g.height x g.width (NCHW) convolved channel by channel with a kernel of
+	// kernelSize x kernelSize per channel, g.filters has to be g.channels. output takes count x channels x
+	// outputHeight x outputWidth and is overwritten. Kernels of rank 1 take two 1D passes if the stride is 1,
+	// the others the engine on one channel. Images and channels are spread over the pool
+	void convDepthwise(const conv_geometry& g, const real* images, size_t count, const real* kernels, real* output, thread_pool& pool,
+		bool normalize = false)
+	{
+		if (!g.valid() || g.filters != g.channels)
+			throw std::logic_error("Depthwise convolution takes one filter per channel");
+		if (count == 0)
+			return;
+		using Buffer = std::vector<real, Eigen::aligned_allocator<real>>;
+		const size_t k = g.kernelSize, taps = k * k, pixels = g.pixels();
+		const conv_geometry channel(1, g.height, g.width, 1, g.kernelSize, g.stride, g.padding);
+		const ConvolutionAlgorithm algorithm = selectConvolutionAlgorithm(channel);
+
+		// per channel the scaled kernel, its 1D kernels if it has rank 1 or what the engine transforms it to otherwise
+		struct channel_kernel
+		{
+			Buffer weights;
+			Buffer vertical;
+			Buffer horizontal;
+			Buffer transformed;
+			bool separable = false;
+		};
+		std::vector<channel_kernel> channelKernels(g.channels);
+		pool.parallel_for(0, g.channels, 1, [&](size_t begin, size_t end, uint32_t)
+		{
+			for (size_t c = begin; c < end; ++c)
+			{
+				channel_kernel& ck = channelKernels[c];
+				const real* kernel = kernels + c * taps;
+				const real scale = normalize ? real(1.0) / std::accumulate(kernel, kernel + taps, real(0.0)) : real(1.0);
+				ck.weights.resize(taps);
+				std::transform(kernel, kernel + taps, ck.weights.begin(), [scale](real w) { return scale * w; });
+				ck.vertical.resize(k);
+				ck.horizontal.resize(k);
+				ck.separable = g.stride == 1 && k > 1 && separateKernel(ck.weights.data(), k, k, ck.vertical.data(), ck.horizontal.data());
+				if (!ck.separable)
+				{
+					ck.transformed.resize(convolutionFilterSize(channel, algorithm));
+					transformFilters(channel, algorithm, ck.weights.data(), 1, ck.transformed.data());
+				}
+			}
+		});
+
+		std::vector<Buffer> scratch(pool.size());
+		const size_t scratchSize = std::max(convolutionImageScratchSize(channel, algorithm), separableScratchSize(g.width));
+		const size_t tasks = count * g.channels;
+		pool.parallel_for(0, tasks, std::max<size_t>(1, tasks / (4 * pool.size())), [&](size_t begin, size_t end, uint32_t worker)
+		{
+			Buffer& s = scratch[worker];
+			if (s.size() < scratchSize)
+				s.resize(scratchSize);
+			for (size_t t = begin; t < end; ++t)
+			{
+				const channel_kernel& ck = channelKernels[t % g.channels];
+				const real* image = images + t * g.height * g.width;
+				real* out = output + t * pixels;
+				std::fill(out, out + pixels, real(0.0));
+				if (ck.separable)
+					separableConvolve(image, g.height, g.width, ck.vertical.data(), k, g.padding, ck.horizontal.data(), k, g.padding, out, s.data());
+				else
+					convolveTransformed(channel, algorithm, ck.weights.data(), 1, ck.transformed.data(), image, out, s.data(), s.size());
+			}
+		});
+	}
 }
\ No newline at end of file
@@ -1,5 +1,11 @@
 #pragma once
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
 #include "settings.hpp"
+#include "kernels.hpp"
 #if USE_EIGEN == 1
 #include <Eigen/Dense>
 #endif
@@ -14,49 +20,83 @@ namespace nn
 
 #if USE_EIGEN == 1
 	using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
-	using CostFunction = real(*)(const MatrixType& output, const MatrixType& truth);
-	using CostDerivativeFunction = MatrixType(*)(const MatrixType& output, const MatrixType& truth);
+	// the truth is given as one class label per column of the output and never expanded to one-hot.
+	// Costs are summed over the batch, derivatives are written into a caller buffer of the output size
+	using CostFunction = real(*)(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels);
+	using CostDerivativeFunction = void(*)(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels, Eigen::Ref<MatrixType> derivative);
 
-	template<CostType t> real cost(const MatrixType& output, const MatrixType& truth);
-	template<CostType t> MatrixType cost_derivative(const MatrixType& output, const MatrixType& truth);
+	template<CostType t> real cost(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels);
+	template<CostType t> void cost_derivative(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels, Eigen::Ref<MatrixType> derivative);
 
-	// mse
-	template<>
-	real cost<CostType::kQuadratic>(const MatrixType& output, const MatrixType& truth)
+	// output - truth, the derivative of both costs
+	void output_minus_truth(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels, Eigen::Ref<MatrixType>& derivative)
 	{
-		if (output.rows() != truth.rows() || output.cols() != truth.cols())
+		if (output.rows() != derivative.rows() || output.cols() != derivative.cols())
 			throw std::logic_error("Cost functions require equally sized matrices");
-		const real c = real((truth - output).squaredNorm());
+		derivative = output;
+		for (MatrixType::Index i = 0; i < output.cols(); ++i)
+			derivative(labels[i], i) -= real(1.0);
+	}
+
+	// mse, |a - y|^2 = |a|^2 - 2 * a[label] + 1 per sample
+	template<>
+	real cost<CostType::kQuadratic>(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels)
+	{
+		real c = real(output.squaredNorm()) + real(output.cols());
+		for (MatrixType::Index i = 0; i < output.cols(); ++i)
+			c -= real(2.0) * output(labels[i], i);
 		return real(0.5) * c;
 	}
 	template<>
-	MatrixType cost_derivative<CostType::kQuadratic>(const MatrixType& output, const MatrixType& truth)
+	void cost_derivative<CostType::kQuadratic>(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels, Eigen::Ref<MatrixType> derivative)
 	{
-		if (output.rows() != truth.rows() || output.cols() != truth.cols())
-			throw std::logic_error("Cost functions require equally sized matrices");
-		return output - truth;
+		output_minus_truth(output, labels, derivative);
 	}
 
-	// cross-entropy
+	// cross-entropy of independent outputs, -log(1 - a) summed over every output with the label entries
+	// corrected to -log(a). Arguments of the logs are clamped, so saturated outputs give a large finite cost
 	template<>
-	real cost<CostType::kCrossEntropy>(const MatrixType& output, const MatrixType& truth)
+	real cost<CostType::kCrossEntropy>(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels)
 	{
-		if (output.rows() != truth.rows() || output.cols() != truth.cols())
-			throw std::logic_error("Cost functions require equally sized matrices");
-		const MatrixType one = MatrixType::Ones(truth.rows(), truth.cols());
-		MatrixType tmp = -truth.array() * output.unaryExpr(&logf).array() - (one - truth).array() * ((one - output).unaryExpr(&logf).array());
-		auto& arr = tmp.array();
-		for (int i = 0; i < arr.size(); ++i)
-			if (!std::isfinite(arr(i)))
-				arr(i) = 0.0f;
-		return tmp.sum();
+		const real tiny = std::numeric_limits<real>::min();
+		real c = real(0.0);
+		for (MatrixType::Index i = 0; i < output.cols(); ++i)
+		{
+			c -= sumLogComplement(size_t(output.rows()), output.col(i).data(), tiny);
+			const real a = output(labels[i], i);
+			c += log(std::max(real(1.0) - a, tiny)) - log(std::max(a, tiny));
+		}
+		return c;
 	}
 	template<>
-	MatrixType cost_derivative<CostType::kCrossEntropy>(const MatrixType& output, const MatrixType& truth)
+	void cost_derivative<CostType::kCrossEntropy>(const Eigen::Ref<const MatrixType>& output, const uint8_t* labels, Eigen::Ref<MatrixType> derivative)
 	{
-		if (output.rows() != truth.rows() || output.cols() != truth.cols())
-			throw std::logic_error("Cost functions require equally sized matrices");
-		return (output - truth);
+		output_minus_truth(output, labels, derivative);
+	}
+
+	// softmax followed by the cross-entropy of the resulting distribution, one pass per column. The logits z
+	// are replaced by the probabilities p and the returned cost sums -log p[label] = log(sum(exp(z - max))) - (z[label] - max),
+	// so no log of an underflowed probability is taken. If gradient is given it gets p - y, the derivative
+	// with respect to the logits. Without labels it is just the softmax
+	real softmax_cross_entropy(Eigen::Ref<MatrixType> logits, const uint8_t* labels, Eigen::Ref<MatrixType>* gradient)
+	{
+		if (gradient && (!labels || gradient->rows() != logits.rows() || gradient->cols() != logits.cols()))
+			throw std::logic_error("Softmax gradient requires labels and a buffer of the output size");
+		real c = real(0.0);
+		for (MatrixType::Index i = 0; i < logits.cols(); ++i)
+		{
+			auto z = logits.col(i);
+			const real label = labels ? z(labels[i]) : real(0.0);
+			const real logSum = softmax(size_t(z.rows()), z.data());
+			if (labels)
+				c += logSum - label;
+			if (gradient)
+			{
+				gradient->col(i) = z;
+				(*gradient)(labels[i], i) -= real(1.0);
+			}
+		}
+		return c;
 	}
 #endif
-}
\ No newline at end of file
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <stdint.h>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define NN_X86 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#else
+#define NN_X86 0
+#endif
+
+// kernels using instructions above the build target are compiled for them one function at a time
+// and only called after checking cpuFeatures(). MSVC compiles any intrinsic without flags
+#if NN_X86 && defined(__GNUC__)
+#define NN_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define NN_TARGET_AVX512 __attribute__((target("avx512f")))
+#define NN_TARGET_AVX512BF16 __attribute__((target("avx512f,avx512bf16")))
+#else
+#define NN_TARGET_AVX2
+#define NN_TARGET_AVX512
+#define NN_TARGET_AVX512BF16
+#endif
+
+namespace nn
+{
+	// instruction sets usable by this process: supported by the CPU and enabled by the OS
+	struct cpu_features
+	{
+		bool sse42 = false;
+		bool avx2 = false; // with FMA and F16C
+		bool avx512f = false;
+		bool avx512bf16 = false;
+	};
+
+	namespace
+	{
+#if NN_X86
+		void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+		{
+#ifdef _MSC_VER
+			int r[4];
+			__cpuidex(r, int(leaf), int(subleaf));
+			for (int i = 0; i < 4; ++i)
+				regs[i] = uint32_t(r[i]);
+#else
+			__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		}
+
+		// register state the OS saves on context switches
+		uint64_t xgetbv0()
+		{
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return (uint64_t(edx) << 32) | eax;
+#endif
+		}
+#endif
+
+		cpu_features detectCpuFeatures()
+		{
+			cpu_features features;
+#if NN_X86
+			uint32_t regs[4];
+			cpuid(0, 0, regs);
+			const uint32_t maxLeaf = regs[0];
+			cpuid(1, 0, regs);
+			features.sse42 = (regs[2] & (1u << 20)) != 0;
+			const bool fma = (regs[2] & (1u << 12)) != 0;
+			const bool f16c = (regs[2] & (1u << 29)) != 0;
+			// OSXSAVE and AVX
+			if ((regs[2] & (1u << 27)) == 0 || (regs[2] & (1u << 28)) == 0 || maxLeaf < 7)
+				return features;
+			const uint64_t xcr0 = xgetbv0();
+			cpuid(7, 0, regs);
+			const uint32_t maxSubleaf = regs[0];
+			// XMM and YMM state, then opmask and ZMM state
+			features.avx2 = fma && f16c && (regs[1] & (1u << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+			features.avx512f = features.avx2 && (regs[1] & (1u << 16)) != 0 && (xcr0 & 0xE6) == 0xE6;
+			if (maxSubleaf >= 1)
+			{
+				cpuid(7, 1, regs);
+				features.avx512bf16 = features.avx512f && (regs[0] & (1u << 5)) != 0;
+			}
+#endif
+			return features;
+		}
+	}
+
+	// detected on the first call
+	const cpu_features& cpuFeatures()
+	{
+		static const cpu_features features = detectCpuFeatures();
+		return features;
+	}
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include "settings.hpp"
+#include "idx.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+	// all samples live as columns of one column-major buffer which is shared between
+	// a dataset and its subsets, so a contiguous range of samples is just a view.
+	// Samples can also stay in their raw IDX representation (e.g. uint8 pixels) and
+	// be decoded only when a batch is assembled
+#if USE_EIGEN == 1
+	class dataset
+	{
+	public:
+		using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
+		using ConstBatch = Eigen::Map<const MatrixType>;
+
+		dataset() {}
+		dataset(MatrixType&& samples, std::vector<uint8_t>&& labels) :
+			m_samples(std::make_shared<MatrixType>(std::move(samples))),
+			m_sampleSize(uint32_t(m_samples->rows())),
+			m_size(m_samples->cols())
+		{
+			auto labelStorage = std::make_shared<std::vector<uint8_t>>(std::move(labels));
+			m_labels = labelStorage->data();
+			m_labelStorage = labelStorage;
+			if (m_size != labelStorage->size())
+				throw std::logic_error("Samples and labels should be of the same size");
+		}
+		// samples are decoded as element * scale on batch assembly, labels have to be uint8
+		dataset(const std::shared_ptr<const idx_file>& samples, const std::shared_ptr<const idx_file>& labels, real scale, size_t maxSamples = size_t(-1)) :
+			m_raw(samples),
+			m_labelStorage(labels),
+			m_labels(labels->payload()),
+			m_scale(scale),
+			m_sampleSize(uint32_t(samples->itemSize())),
+			m_size(std::min(samples->count(), maxSamples))
+		{
+			if (labels->type() != IdxType::kUInt8 || labels->rank() != 1)
+				throw std::runtime_error("Labels should be a vector of uint8");
+			if (labels->count() < m_size)
+				throw std::logic_error("Samples and labels should be of the same size");
+		}
+
+		size_t size() const { return m_size; }
+		uint32_t sampleSize() const { return m_sampleSize; }
+		// true if samples are kept decoded and batch() without scratch is available
+		bool decoded() const { return bool(m_samples); }
+
+		uint8_t label(size_t i) const { return m_labels[m_begin + i]; }
+		const uint8_t* labels() const { return m_labels + m_begin; }
+
+		// contiguous samples [start, start + count) without copying, decoded datasets only
+		ConstBatch batch(size_t start, size_t count) const
+		{
+			if (!m_samples)
+				throw std::logic_error("Raw datasets need a scratch matrix to assemble a batch");
+			return ConstBatch(m_samples->data() + (m_begin + start) * m_sampleSize, m_sampleSize, count);
+		}
+
+		// same as above, raw samples are decoded into scratch
+		ConstBatch batch(size_t start, size_t count, MatrixType& scratch) const
+		{
+			if (m_samples)
+				return batch(start, count);
+			scratch.resize(m_sampleSize, count);
+			decodeRange(start, count, scratch.data());
+			return ConstBatch(scratch.data(), m_sampleSize, count);
+		}
+
+		// copies samples in the order given by indices, used when the data is shuffled
+		void gather(const uint32_t* indices, size_t count, MatrixType& samples, uint8_t* labels) const
+		{
+			samples.resize(m_sampleSize, count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (m_samples)
+					samples.col(i) = m_samples->col(m_begin + indices[i]);
+				else
+					decodeRange(indices[i], 1, samples.col(i).data());
+				labels[i] = m_labels[m_begin + indices[i]];
+			}
+		}
+
+		// samples [begin, end) sharing the storage with this dataset
+		dataset subset(size_t begin, size_t end) const
+		{
+			if (begin > end || end > m_size)
+				throw std::out_of_range("Subset is out of the dataset range");
+			dataset result(*this);
+			result.m_begin = m_begin + begin;
+			result.m_size = end - begin;
+			return result;
+		}
+
+		// decodes all samples into memory, trading 4x the memory for zero-copy batches
+		dataset decode() const
+		{
+			MatrixType samples;
+			if (m_samples)
+				samples = batch(0, m_size);
+			else
+				batch(0, m_size, samples);
+			return dataset(std::move(samples), std::vector<uint8_t>(labels(), labels() + m_size));
+		}
+	private:
+		void decodeRange(size_t start, size_t count, real* out) const
+		{
+			m_raw->convert((m_begin + start) * m_sampleSize, count * m_sampleSize, out, m_scale);
+		}
+
+		std::shared_ptr<const MatrixType> m_samples;
+		std::shared_ptr<const idx_file> m_raw;
+		std::shared_ptr<const void> m_labelStorage;
+		const uint8_t* m_labels = nullptr;
+		real m_scale = real(1.0);
+		uint32_t m_sampleSize = 0;
+		size_t m_begin = 0;
+		size_t m_size = 0;
+	};
+#endif
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <future>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "network.hpp"
+#include "workspace.hpp"
+#include "dataset.hpp"
+
+// Eigen's allocation check is process wide, it would fire on the evaluation running next to training
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+#error "async_evaluator allocates on other threads while training runs, EIGEN_RUNTIME_NO_MALLOC is for single threaded checks"
+#endif
+
+namespace nn
+{
+	// evaluates snapshots of a network on a background thread while training goes on. Snapshots
+	// are evaluated one after another in submission order, results come through a future or a callback
+	// called on the background thread. The evaluation itself runs on the thread pool of the snapshot
+	class async_evaluator
+	{
+	public:
+		using Callback = std::function<void(const evaluate_results& results)>;
+
+		async_evaluator(const dataset& inputs, size_t count = 0, uint32_t batchSize = 256) :
+			m_inputs(inputs),
+			m_count(count),
+			m_batchSize(batchSize),
+			m_thread(&async_evaluator::work, this)
+		{
+		}
+
+		// finishes the pending evaluations
+		~async_evaluator()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_submitted.notify_all();
+			m_thread.join();
+		}
+
+		async_evaluator(const async_evaluator&) = delete;
+		async_evaluator& operator=(const async_evaluator&) = delete;
+
+		// snapshots the weights, the network can be trained further as soon as this returns
+		std::future<evaluate_results> evaluate(const network& net)
+		{
+			auto result = std::make_shared<std::promise<evaluate_results>>();
+			auto future = result->get_future();
+			submit(net, [result](const evaluate_results& results) { result->set_value(results); });
+			return future;
+		}
+
+		void evaluate(const network& net, Callback callback)
+		{
+			submit(net, std::move(callback));
+		}
+
+		// blocks until every submitted snapshot is evaluated
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_idle.wait(lock, [&] { return m_jobs.empty() && !m_running; });
+		}
+	private:
+		struct job
+		{
+			network snapshot;
+			Callback callback;
+		};
+
+		void submit(const network& net, Callback callback)
+		{
+			job j{ net.snapshot(), std::move(callback) };
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_jobs.push_back(std::move(j));
+			}
+			m_submitted.notify_one();
+		}
+
+		void work()
+		{
+			while (true)
+			{
+				job j;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_submitted.wait(lock, [&] { return m_stop || !m_jobs.empty(); });
+					if (m_jobs.empty())
+						return;
+					j = std::move(m_jobs.front());
+					m_jobs.pop_front();
+					m_running = true;
+				}
+				// evaluation allocates, the no_malloc_scope of the training steps only covers their own threads
+				const auto results = j.snapshot.evaluate(m_inputs, m_count, m_batchSize);
+				j.callback(results);
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_running = false;
+				}
+				m_idle.notify_all();
+			}
+		}
+
+		dataset m_inputs;
+		size_t m_count;
+		uint32_t m_batchSize;
+		std::deque<job> m_jobs;
+		bool m_running = false;
+		bool m_stop = false;
+		std::mutex m_mutex;
+		std::condition_variable m_submitted;
+		std::condition_variable m_idle;
+		std::thread m_thread;
+	};
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include "settings.hpp"
+#include "kernels.hpp"
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// radix-2 FFTs of power of two sizes on split complex numbers, the real parts in one array and the
+	// imaginary parts in another. The transforms are unnormalized, the inverse of the forward transform
+	// is the input times the size
+	class fft_plan
+	{
+	public:
+		fft_plan() {}
+		explicit fft_plan(size_t size) :
+			m_size(size),
+			m_reversed(size),
+			m_twiddles(size)
+		{
+			if (size == 0 || (size & (size - 1)))
+				throw std::logic_error("FFT size has to be a power of two");
+			uint32_t bits = 0;
+			while ((size_t(1) << bits) < size)
+				++bits;
+			for (size_t i = 0; i < size; ++i)
+			{
+				size_t reversed = 0;
+				for (uint32_t b = 0; b < bits; ++b)
+					reversed |= ((i >> b) & 1) << (bits - 1 - b);
+				m_reversed[i] = reversed;
+			}
+			// exp(-2 pi i j / size) for the first half, computed in double
+			for (size_t j = 0; j < size / 2; ++j)
+			{
+				const double angle = -2.0 * 3.14159265358979323846 * double(j) / double(size);
+				m_twiddles[2 * j] = real(std::cos(angle));
+				m_twiddles[2 * j + 1] = real(std::sin(angle));
+			}
+		}
+
+		size_t size() const { return m_size; }
+
+		// in place on count sequences side by side: element i of sequence k is re[i * count + k], im[i * count + k].
+		// Every butterfly runs over all sequences at once through the dispatched kernel
+		void forward(real* re, real* im, size_t count = 1) const { transform(re, im, count, real(1.0)); }
+		void inverse(real* re, real* im, size_t count = 1) const { transform(re, im, count, real(-1.0)); }
+	private:
+		void transform(real* re, real* im, size_t count, real direction) const
+		{
+			for (size_t i = 0; i < m_size; ++i)
+			{
+				const size_t r = m_reversed[i];
+				if (i < r)
+				{
+					std::swap_ranges(re + i * count, re + (i + 1) * count, re + r * count);
+					std::swap_ranges(im + i * count, im + (i + 1) * count, im + r * count);
+				}
+			}
+			for (size_t half = 1; half < m_size; half *= 2)
+			{
+				const size_t step = m_size / (2 * half);
+				for (size_t start = 0; start < m_size; start += 2 * half)
+					for (size_t j = 0; j < half; ++j)
+					{
+						const size_t a = (start + j) * count, b = a + half * count;
+						butterfly(count, m_twiddles[2 * j * step], direction * m_twiddles[2 * j * step + 1], re + a, im + a, re + b, im + b);
+					}
+			}
+		}
+
+		size_t m_size = 0;
+		std::vector<size_t> m_reversed;
+		std::vector<real> m_twiddles;
+	};
+
+	// rows x cols reals, row-major, to rows x (cols / 2 + 1) complex numbers, the rest of the spectrum are
+	// their conjugates. The spectrum is split, all real parts followed by all imaginary parts. Pairs of rows
+	// go through the column sized FFT as one complex row and are untangled afterwards, then the columns go
+	// through the row sized one, both passes on all their sequences at once
+	class fft2d_plan
+	{
+	public:
+		fft2d_plan() {}
+		fft2d_plan(size_t rows, size_t cols) :
+			m_rows(rows),
+			m_cols(cols)
+		{
+			if (rows < 2)
+				throw std::logic_error("2D FFT takes two rows at least");
+		}
+
+		size_t rows() const { return m_rows.size(); }
+		size_t cols() const { return m_cols.size(); }
+		// complex numbers in a row of the spectrum
+		size_t spectrumCols() const { return cols() / 2 + 1; }
+		// reals of the spectrum, the imaginary parts start at half of it
+		size_t spectrumSize() const { return 2 * rows() * spectrumCols(); }
+		// reals of the work buffer both directions take
+		size_t workSize() const { return rows() * cols(); }
+
+		// the spectrum of the height x width image with leading dimension ld, zero padded to rows x cols
+		void forward(const real* image, size_t height, size_t width, size_t ld, real* spectrum, real* work) const
+		{
+			const size_t pairs = rows() / 2, half = cols() / 2, sc = spectrumCols();
+			// element x of pair p is column x of rows 2p and 2p + 1 as real and imaginary part
+			real* zr = work;
+			real* zi = work + cols() * pairs;
+			std::fill(work, work + workSize(), real(0.0));
+			for (size_t y = 0; y < height; ++y)
+			{
+				const real* in = image + y * ld;
+				real* out = (y & 1 ? zi : zr) + y / 2;
+				for (size_t x = 0; x < width; ++x)
+					out[x * pairs] = in[x];
+			}
+			m_cols.forward(zr, zi, pairs);
+			// with Z the transform of a pair, its rows are (Z[k] + conj(Z[cols - k])) / 2 and (Z[k] - conj(Z[cols - k])) / 2i
+			real* sr = spectrum;
+			real* si = spectrum + rows() * sc;
+			for (size_t k = 0; k <= half; ++k)
+			{
+				const size_t a = k * pairs, b = ((cols() - k) % cols()) * pairs;
+				for (size_t p = 0; p < pairs; ++p)
+				{
+					const real ar = zr[a + p], ai = zi[a + p], br = zr[b + p], bi = zi[b + p];
+					const size_t even = 2 * p * sc + k, odd = even + sc;
+					sr[even] = real(0.5) * (ar + br);
+					si[even] = real(0.5) * (ai - bi);
+					sr[odd] = real(0.5) * (ai + bi);
+					si[odd] = real(0.5) * (br - ar);
+				}
+			}
+			m_rows.forward(sr, si, sc);
+		}
+
+		// spectrum is overwritten, the rows x cols image comes out rows * cols times the one transformed
+		void inverse(real* spectrum, real* image, real* work) const
+		{
+			const size_t pairs = rows() / 2, half = cols() / 2, sc = spectrumCols();
+			real* sr = spectrum;
+			real* si = spectrum + rows() * sc;
+			m_rows.inverse(sr, si, sc);
+			// pairs of rows as one complex row again, the columns past half are the conjugates
+			real* zr = work;
+			real* zi = work + cols() * pairs;
+			for (size_t x = 0; x < cols(); ++x)
+			{
+				const size_t k = x <= half ? x : cols() - x;
+				const real sign = x <= half ? real(1.0) : real(-1.0);
+				for (size_t p = 0; p < pairs; ++p)
+				{
+					const size_t even = 2 * p * sc + k, odd = even + sc;
+					zr[x * pairs + p] = sr[even] - sign * si[odd];
+					zi[x * pairs + p] = sign * si[even] + sr[odd];
+				}
+			}
+			m_cols.inverse(zr, zi, pairs);
+			for (size_t y = 0; y < rows(); ++y)
+			{
+				const real* in = (y & 1 ? zi : zr) + y / 2;
+				real* out = image + y * cols();
+				for (size_t x = 0; x < cols(); ++x)
+					out[x] = in[x * pairs];
+			}
+		}
+	private:
+		fft_plan m_rows;
+		fft_plan m_cols;
+	};
+
+	// plans are built once per size and shared by all threads
+	const fft2d_plan& fft2dPlan(size_t rows, size_t cols)
+	{
+		static std::mutex mutex;
+		static std::map<std::pair<size_t, size_t>, std::unique_ptr<fft2d_plan>> plans;
+		std::lock_guard<std::mutex> lock(mutex);
+		auto& plan = plans[std::make_pair(rows, cols)];
+		if (!plan)
+			plan.reset(new fft2d_plan(rows, cols));
+		return *plan;
+	}
+#endif
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <stdexcept>
+#include "settings.hpp"
+#include "im2col.hpp"
+#include "fft.hpp"
+#include "gemm.hpp"
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// stride 1 convolutions as products of spectra, O(log n) per pixel whatever the kernel size. Images are
+	// cut into blocks which are transformed zero padded to the FFT size, so the full convolution of a block
+	// fits without wrapping around, and the results are added up with their overlap (overlap-add). Small
+	// images are one block. The kernels are flipped, the layers compute correlations
+	namespace
+	{
+		size_t nextPowerOfTwo(size_t value)
+		{
+			size_t result = 1;
+			while (result < value)
+				result *= 2;
+			return result;
+		}
+
+		// FFT size of one dimension: the whole image if it fits, otherwise blocks about three kernels long
+		size_t fftTileSize(size_t size, uint32_t kernelSize)
+		{
+			return std::max<size_t>(2, std::min(nextPowerOfTwo(size + kernelSize - 1), std::max<size_t>(64, nextPowerOfTwo(4 * size_t(kernelSize)))));
+		}
+
+		const fft2d_plan& fftConvolutionPlan(const conv_geometry& g)
+		{
+			return fft2dPlan(fftTileSize(g.height, g.kernelSize), fftTileSize(g.width, g.kernelSize));
+		}
+
+		void checkFft(const conv_geometry& g)
+		{
+			if (g.stride != 1)
+				throw std::logic_error("FFT convolution takes stride 1");
+		}
+	}
+
+	// reals the spectra of all filters and channels of g take, followed by the flipped kernel they are
+	// transformed from and the work buffer of the FFT
+	size_t fftFilterSize(const conv_geometry& g)
+	{
+		const size_t rows = fftTileSize(g.height, g.kernelSize), cols = fftTileSize(g.width, g.kernelSize);
+		return gemm_blocking::aligned(size_t(g.filters) * g.channels * 2 * rows * (cols / 2 + 1)) +
+			gemm_blocking::aligned(size_t(g.kernelSize) * g.kernelSize) + rows * cols;
+	}
+
+	// reals of scratch fftConvolve takes per image: the spectra of all channels of a block, their sum
+	// per filter, the full convolution of the block and the work buffer of the FFT
+	size_t fftScratchSize(const conv_geometry& g)
+	{
+		const size_t rows = fftTileSize(g.height, g.kernelSize), cols = fftTileSize(g.width, g.kernelSize);
+		const size_t spectrum = gemm_blocking::aligned(2 * rows * (cols / 2 + 1));
+		return (size_t(g.channels) + 1) * spectrum + 2 * gemm_blocking::aligned(rows * cols);
+	}
+
+	// the spectra of the flipped filters x patchSize weights with leading dimension ldw, scaled by the
+	// inverse of the FFT size so the products come back at the right scale. They stay valid until the weights change
+	void fftTransformFilters(const conv_geometry& g, const real* weights, size_t ldw, real* spectra)
+	{
+		checkFft(g);
+		const fft2d_plan& plan = fftConvolutionPlan(g);
+		const size_t k = g.kernelSize, size = plan.spectrumSize();
+		const real scale = real(1.0) / real(plan.rows() * plan.cols());
+		real* kernel = spectra + gemm_blocking::aligned(size_t(g.filters) * g.channels * size);
+		real* work = kernel + gemm_blocking::aligned(k * k);
+		for (uint32_t f = 0; f < g.filters; ++f)
+			for (uint32_t c = 0; c < g.channels; ++c)
+			{
+				for (size_t ky = 0; ky < k; ++ky)
+					for (size_t kx = 0; kx < k; ++kx)
+						kernel[(k - 1 - ky) * k + k - 1 - kx] = scale * weights[f + ((c * k + ky) * k + kx) * ldw];
+				plan.forward(kernel, k, k, k, spectra + (size_t(f) * g.channels + c) * size, work);
+			}
+	}
+
+	// output += the convolution of one image with the filter spectra, output is filters x outputHeight x outputWidth
+	void fftConvolve(const conv_geometry& g, const real* spectra, const real* image, real* output, real* scratch, size_t scratchSize)
+	{
+		checkFft(g);
+		if (scratchSize < fftScratchSize(g))
+			throw std::logic_error("FFT scratch buffer is too small");
+		const fft2d_plan& plan = fftConvolutionPlan(g);
+		const size_t rows = plan.rows(), cols = plan.cols(), size = plan.spectrumSize();
+		const size_t k = g.kernelSize, oh = g.outputHeight(), ow = g.outputWidth();
+		// input pixels of a block, the rest of the FFT size takes its full convolution
+		const size_t blockRows = rows - k + 1, blockCols = cols - k + 1;
+		const size_t stride = gemm_blocking::aligned(size);
+		real* channelSpectra = scratch;
+		real* sum = channelSpectra + g.channels * stride;
+		real* block = sum + stride;
+		real* work = block + gemm_blocking::aligned(rows * cols);
+
+		for (size_t by = 0; by < g.height; by += blockRows)
+			for (size_t bx = 0; bx < g.width; bx += blockCols)
+			{
+				const size_t height = std::min(blockRows, g.height - by), width = std::min(blockCols, g.width - bx);
+				for (uint32_t c = 0; c < g.channels; ++c)
+					plan.forward(image + (size_t(c) * g.height + by) * g.width + bx, height, width, g.width, channelSpectra + c * stride, work);
+				// row r of the full convolution is output row by + r + padding - (k - 1), likewise for the columns
+				const size_t shiftY = by + g.padding, shiftX = bx + g.padding;
+				const size_t firstRow = shiftY < k - 1 ? k - 1 - shiftY : 0, firstCol = shiftX < k - 1 ? k - 1 - shiftX : 0;
+				const size_t lastRow = std::min(height + k - 1, oh + k - 1 - shiftY), lastCol = std::min(width + k - 1, ow + k - 1 - shiftX);
+				if (firstRow >= lastRow || firstCol >= lastCol)
+					continue;
+				for (uint32_t f = 0; f < g.filters; ++f)
+				{
+					std::fill(sum, sum + size, real(0.0));
+					for (uint32_t c = 0; c < g.channels; ++c)
+					{
+						const real* x = channelSpectra + c * stride;
+						const real* w = spectra + (size_t(f) * g.channels + c) * size;
+						complexMultiplyAdd(size / 2, x, x + size / 2, w, w + size / 2, sum, sum + size / 2);
+					}
+					plan.inverse(sum, block, work);
+					real* out = output + f * oh * ow;
+					for (size_t r = firstRow; r < lastRow; ++r)
+					{
+						const real* in = block + r * cols;
+						real* row = out + (shiftY + r - (k - 1)) * ow;
+						for (size_t x = firstCol; x < lastCol; ++x)
+							row[shiftX + x - (k - 1)] += in[x];
+					}
+				}
+			}
+	}
+#endif
+}
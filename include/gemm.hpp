@@ -0,0 +1,367 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <stdexcept>
+#include "settings.hpp"
+#include "precision.hpp"
+#include "kernels.hpp"
+#include "sgemm.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+	enum class BackendType
+	{
+		kEigen,
+		kPacked // sgemm.hpp for float, Eigen for anything else
+	};
+
+	// linear algebra the layers run on, over column-major storage with leading dimensions.
+	// None of the operations allocates
+	struct linear_algebra
+	{
+		// c = alpha * op(a) * op(b) + beta * c, c is rows x cols, depth is the inner dimension.
+		// c isn't read when beta is zero, so products overwriting their output take no extra pass
+		void(*gemm)(size_t rows, size_t cols, size_t depth, real alpha,
+			const real* a, size_t lda, bool transposeA,
+			const real* b, size_t ldb, bool transposeB,
+			real beta, real* c, size_t ldc, real* packing, size_t packingSize);
+		// number of reals the packing buffer of gemm takes
+		size_t(*gemmPackingSize)(size_t rows, size_t cols, size_t depth);
+		// y += alpha * op(a) * x, op(a) is rows x cols
+		void(*gemv)(size_t rows, size_t cols, real alpha, const real* a, size_t lda, bool transposeA, const real* x, real* y);
+		// y = alpha * x + beta * y
+		void(*axpby)(size_t size, real alpha, const real* x, real beta, real* y);
+		// y = x * y elementwise
+		void(*multiply)(size_t size, const real* x, real* y);
+	};
+
+#if USE_EIGEN == 1
+	// Eigen's blocking with the packing buffers supplied by the caller. Eigen allocates them
+	// on every product otherwise (on the heap when they don't fit its stack limit)
+	class gemm_blocking : public Eigen::internal::level3_blocking<real, real>
+	{
+	public:
+		using Index = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>::Index;
+
+		gemm_blocking(Index rows, Index cols, Index depth, real* packing = nullptr)
+		{
+			m_mc = rows;
+			m_nc = cols;
+			m_kc = depth;
+			Eigen::internal::computeProductBlockingSizes<real, real, 1>(m_kc, m_mc, m_nc);
+			m_sizeA = aligned(size_t(m_kc * m_mc));
+			m_sizeB = aligned(size_t(m_kc * cols));
+			m_sizeW = aligned(size_t(m_kc * Eigen::internal::gebp_traits<real, real>::WorkSpaceFactor));
+			if (packing)
+			{
+				m_blockA = packing;
+				m_blockB = packing + m_sizeA;
+				m_blockW = packing + m_sizeA + m_sizeB;
+			}
+		}
+
+		// number of reals the packing buffers of the product take
+		size_t packingSize() const { return m_sizeA + m_sizeB + m_sizeW; }
+
+		// keeps every buffer 64 byte aligned if the first one is
+		static size_t aligned(size_t size) { return (size + 15) & ~size_t(15); }
+	private:
+		size_t m_sizeA;
+		size_t m_sizeB;
+		size_t m_sizeW;
+	};
+
+	namespace
+	{
+		using BackendVectorMap = Eigen::Map<Eigen::Matrix<real, Eigen::Dynamic, 1>>;
+		using ConstBackendVectorMap = Eigen::Map<const Eigen::Matrix<real, Eigen::Dynamic, 1>>;
+		using ConstBackendMatrixMap = Eigen::Map<const Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>, 0, Eigen::OuterStride<>>;
+		using BackendMatrixMap = Eigen::Map<Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>, 0, Eigen::OuterStride<>>;
+
+		// c = beta * c, zeroes c when beta is zero
+		void scaleOutput(size_t rows, size_t cols, real beta, real* c, size_t ldc)
+		{
+			using Index = gemm_blocking::Index;
+			if (beta == real(1.0) || rows == 0 || cols == 0)
+				return;
+			BackendMatrixMap result(c, Index(rows), Index(cols), Eigen::OuterStride<>(Index(ldc)));
+			if (beta == real(0.0))
+				result.setZero();
+			else
+				result *= beta;
+		}
+
+		size_t eigenGemmPackingSize(size_t rows, size_t cols, size_t depth)
+		{
+			using Index = gemm_blocking::Index;
+			return gemm_blocking(Index(rows), Index(cols), Index(depth)).packingSize();
+		}
+
+		void eigenGemm(size_t rows, size_t cols, size_t depth, real alpha,
+			const real* a, size_t lda, bool transposeA,
+			const real* b, size_t ldb, bool transposeB,
+			real beta, real* c, size_t ldc, real* packing, size_t packingSize)
+		{
+			using namespace Eigen;
+			using Index = gemm_blocking::Index;
+			// Eigen's kernels only accumulate
+			scaleOutput(rows, cols, beta, c, ldc);
+			if (rows == 0 || cols == 0 || depth == 0)
+				return;
+			gemm_blocking blocking(Index(rows), Index(cols), Index(depth), packing);
+			if (blocking.packingSize() > packingSize)
+				throw std::logic_error("Matrix product packing buffer is too small");
+
+			if (!transposeA && !transposeB)
+				internal::general_matrix_matrix_product<Index, real, ColMajor, false, real, ColMajor, false, ColMajor>::run(
+					Index(rows), Index(cols), Index(depth), a, Index(lda), b, Index(ldb), c, Index(ldc), alpha, blocking);
+			else if (transposeA && !transposeB)
+				internal::general_matrix_matrix_product<Index, real, RowMajor, false, real, ColMajor, false, ColMajor>::run(
+					Index(rows), Index(cols), Index(depth), a, Index(lda), b, Index(ldb), c, Index(ldc), alpha, blocking);
+			else if (!transposeA && transposeB)
+				internal::general_matrix_matrix_product<Index, real, ColMajor, false, real, RowMajor, false, ColMajor>::run(
+					Index(rows), Index(cols), Index(depth), a, Index(lda), b, Index(ldb), c, Index(ldc), alpha, blocking);
+			else
+				internal::general_matrix_matrix_product<Index, real, RowMajor, false, real, RowMajor, false, ColMajor>::run(
+					Index(rows), Index(cols), Index(depth), a, Index(lda), b, Index(ldb), c, Index(ldc), alpha, blocking);
+		}
+
+		void eigenGemv(size_t rows, size_t cols, real alpha, const real* a, size_t lda, bool transposeA, const real* x, real* y)
+		{
+			using Index = gemm_blocking::Index;
+			BackendVectorMap result(y, Index(rows));
+			if (!transposeA)
+				result.noalias() += alpha * ConstBackendMatrixMap(a, Index(rows), Index(cols), Eigen::OuterStride<>(Index(lda))) * ConstBackendVectorMap(x, Index(cols));
+			else
+				result.noalias() += alpha * ConstBackendMatrixMap(a, Index(cols), Index(rows), Eigen::OuterStride<>(Index(lda))).transpose() * ConstBackendVectorMap(x, Index(cols));
+		}
+
+		void eigenAxpby(size_t size, real alpha, const real* x, real beta, real* y)
+		{
+			using Index = gemm_blocking::Index;
+			BackendVectorMap result(y, Index(size));
+			result = alpha * ConstBackendVectorMap(x, Index(size)) + beta * result;
+		}
+
+		void eigenMultiply(size_t size, const real* x, real* y)
+		{
+			using Index = gemm_blocking::Index;
+			BackendVectorMap(y, Index(size)).array() *= ConstBackendVectorMap(x, Index(size)).array();
+		}
+
+		// the in-tree sgemm where real is float
+		size_t packedGemmPackingSize(size_t rows, size_t cols, size_t depth)
+		{
+			return std::is_same<real, float>::value ? sgemmPackingSize(rows, cols, depth) : eigenGemmPackingSize(rows, cols, depth);
+		}
+
+		template <typename T>
+		void packedGemv(size_t rows, size_t cols, T alpha, const T* a, size_t lda, bool transposeA, const T* x, T* y)
+		{
+			if (!transposeA)
+			{
+				// columns scaled by x and summed into y, four at a time to save passes over y
+				size_t j = 0;
+				for (; j + 4 <= cols; j += 4)
+				{
+					const T s0 = alpha * x[j], s1 = alpha * x[j + 1], s2 = alpha * x[j + 2], s3 = alpha * x[j + 3];
+					const T* c0 = a + j * lda;
+					const T* c1 = c0 + lda;
+					const T* c2 = c1 + lda;
+					const T* c3 = c2 + lda;
+					for (size_t i = 0; i < rows; ++i)
+						y[i] += s0 * c0[i] + s1 * c1[i] + s2 * c2[i] + s3 * c3[i];
+				}
+				for (; j < cols; ++j)
+				{
+					const T scale = alpha * x[j];
+					const T* column = a + j * lda;
+					for (size_t i = 0; i < rows; ++i)
+						y[i] += scale * column[i];
+				}
+				return;
+			}
+			for (size_t i = 0; i < rows; ++i)
+			{
+				const T* column = a + i * lda;
+				T sum = T(0.0);
+				for (size_t j = 0; j < cols; ++j)
+					sum += column[j] * x[j];
+				y[i] += alpha * sum;
+			}
+		}
+
+		// Eigen for anything but float
+		template <typename T>
+		void packedGemm(size_t rows, size_t cols, size_t depth, T alpha,
+			const T* a, size_t lda, bool transposeA,
+			const T* b, size_t ldb, bool transposeB,
+			T beta, T* c, size_t ldc, T* packing, size_t packingSize)
+		{
+			eigenGemm(rows, cols, depth, alpha, a, lda, transposeA, b, ldb, transposeB, beta, c, ldc, packing, packingSize);
+		}
+		void packedGemm(size_t rows, size_t cols, size_t depth, float alpha,
+			const float* a, size_t lda, bool transposeA,
+			const float* b, size_t ldb, bool transposeB,
+			float beta, float* c, size_t ldc, float* packing, size_t packingSize)
+		{
+			// a single column isn't worth packing, scaling it is a pass over one column of the output
+			if (cols == 1 && !transposeB)
+			{
+				scaleOutput(rows, 1, beta, c, ldc);
+				packedGemv(rows, depth, alpha, a, lda, transposeA, b, c);
+			}
+			else
+				sgemm(rows, cols, depth, alpha, a, lda, transposeA, b, ldb, transposeB, beta, c, ldc, packing, packingSize);
+		}
+
+		void packedAxpby(size_t size, real alpha, const real* x, real beta, real* y)
+		{
+			for (size_t i = 0; i < size; ++i)
+				y[i] = alpha * x[i] + beta * y[i];
+		}
+
+		void packedMultiply(size_t size, const real* x, real* y)
+		{
+			for (size_t i = 0; i < size; ++i)
+				y[i] *= x[i];
+		}
+
+		std::atomic<BackendType>& backendSetting()
+		{
+			static std::atomic<BackendType> type(BackendType::kEigen);
+			return type;
+		}
+	}
+
+	const linear_algebra& backend(BackendType type)
+	{
+		static const linear_algebra eigen{ eigenGemm, eigenGemmPackingSize, eigenGemv, eigenAxpby, eigenMultiply };
+		static const linear_algebra packed{ packedGemm, packedGemmPackingSize, packedGemv<real>, packedAxpby, packedMultiply };
+		return type == BackendType::kPacked ? packed : eigen;
+	}
+
+	// the backend gemm() and the training steps go through, process wide and Eigen by default.
+	// Workspaces size their packing buffers for every backend, so it can be switched at any time
+	const linear_algebra& backend() { return backend(backendSetting().load(std::memory_order_relaxed)); }
+	void setBackend(BackendType type) { backendSetting().store(type, std::memory_order_relaxed); }
+
+	// packing buffer size of a rows x depth by depth x cols product, enough for any backend
+	size_t gemmPackingSize(size_t rows, size_t cols, size_t depth)
+	{
+		return std::max(backend(BackendType::kEigen).gemmPackingSize(rows, cols, depth), backend(BackendType::kPacked).gemmPackingSize(rows, cols, depth));
+	}
+
+	// c = alpha * op(a) * op(b) + beta * c where op transposes when the flag is set, without any allocation.
+	// c isn't read when beta is zero. packing has to hold gemmPackingSize() reals and be aligned to 16 bytes
+	void gemm(real alpha,
+		const Eigen::Ref<const Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>>& a, bool transposeA,
+		const Eigen::Ref<const Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>>& b, bool transposeB,
+		real beta, Eigen::Ref<Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>> c,
+		real* packing, size_t packingSize)
+	{
+		const auto rows = transposeA ? a.cols() : a.rows();
+		const auto depth = transposeA ? a.rows() : a.cols();
+		const auto cols = transposeB ? b.rows() : b.cols();
+		if ((transposeB ? b.cols() : b.rows()) != depth || c.rows() != rows || c.cols() != cols)
+			throw std::logic_error("Matrix product dimensions mismatch");
+		backend().gemm(size_t(rows), size_t(cols), size_t(depth), alpha,
+			a.data(), size_t(a.outerStride()), transposeA,
+			b.data(), size_t(b.outerStride()), transposeB,
+			beta, c.data(), size_t(c.outerStride()), packing, packingSize);
+	}
+
+	// a column-major matrix kept in 16 bits, see StorageType
+	struct stored_matrix
+	{
+		StorageType type = StorageType::kFloat;
+		size_t rows = 0;
+		size_t cols = 0;
+		std::vector<uint16_t> data;
+
+		bool empty() const { return data.empty(); }
+	};
+
+	// result = m rounded to type, kHalf or kBfloat16. Allocates only if result had another size
+	void storeMatrix(const Eigen::Ref<const Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>>& m, StorageType type, stored_matrix& result)
+	{
+		result.type = type;
+		result.rows = size_t(m.rows());
+		result.cols = size_t(m.cols());
+		result.data.resize(result.rows * result.cols);
+		for (size_t j = 0; j < result.cols; ++j)
+			narrow(type, result.rows, m.col(j).data(), result.data.data() + j * result.rows);
+	}
+
+	namespace
+	{
+		// blocks of a stored matrix widened at a time take up to 64K reals, which stay in L2. They span
+		// whole columns up to kStoredRows, so they are read as one range rather than a page per column
+		const size_t kStoredBlockSize = 65536;
+		const size_t kStoredRows = 4096;
+
+		// rows and depth of the blocks of a rows x depth op(a)
+		void storedBlocking(size_t rows, size_t depth, size_t& mc, size_t& kc)
+		{
+			mc = std::min(rows, kStoredRows);
+			kc = std::min(depth, std::max<size_t>(kStoredBlockSize / std::max<size_t>(mc, 1), 16));
+		}
+	}
+
+	// packing buffer size of a product with a stored matrix: a widened block followed by the packing of its product
+	size_t storedGemmPackingSize(size_t rows, size_t cols, size_t depth)
+	{
+		size_t mc, kc;
+		storedBlocking(rows, depth, mc, kc);
+		return gemm_blocking::aligned(mc * kc) + gemmPackingSize(mc, cols, kc);
+	}
+
+	// c = alpha * op(a) * op(b) + beta * c with a stored in 16 bits. Blocks of op(a) are widened into the packing buffer
+	// and multiplied from there by the backend, so a is read once at half the bytes and the products accumulate in reals
+	void gemm(real alpha, const stored_matrix& a, bool transposeA,
+		const Eigen::Ref<const Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>>& b, bool transposeB,
+		real beta, Eigen::Ref<Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>> c,
+		real* packing, size_t packingSize)
+	{
+		const size_t rows = transposeA ? a.cols : a.rows;
+		const size_t depth = transposeA ? a.rows : a.cols;
+		const size_t cols = size_t(transposeB ? b.rows() : b.cols());
+		if (size_t(transposeB ? b.cols() : b.rows()) != depth || size_t(c.rows()) != rows || size_t(c.cols()) != cols)
+			throw std::logic_error("Matrix product dimensions mismatch");
+		if (storedGemmPackingSize(rows, cols, depth) > packingSize)
+			throw std::logic_error("Matrix product packing buffer is too small");
+		if (depth == 0)
+			scaleOutput(rows, cols, beta, c.data(), size_t(c.outerStride()));
+		size_t mc, kc;
+		storedBlocking(rows, depth, mc, kc);
+		const size_t blockSize = gemm_blocking::aligned(mc * kc);
+		const size_t ldb = size_t(b.outerStride()), ldc = size_t(c.outerStride());
+		real* block = packing;
+		for (size_t ic = 0; ic < rows; ic += mc)
+			for (size_t pc = 0; pc < depth; pc += kc)
+			{
+				const size_t m = std::min(mc, rows - ic), k = std::min(kc, depth - pc);
+				// widened the way it is stored, m x k or k x m when a is transposed
+				if (!transposeA && m == a.rows)
+					widen(a.type, m * k, a.data.data() + pc * a.rows, block);
+				else if (!transposeA)
+					for (size_t p = 0; p < k; ++p)
+						widen(a.type, m, a.data.data() + ic + (pc + p) * a.rows, block + p * m);
+				else
+					for (size_t i = 0; i < m; ++i)
+						widen(a.type, k, a.data.data() + pc + (ic + i) * a.rows, block + i * k);
+				backend().gemm(m, cols, k, alpha,
+					block, transposeA ? k : m, transposeA,
+					b.data() + (transposeB ? pc * ldb : pc), ldb, transposeB,
+					pc == 0 ? beta : real(1.0), c.data() + ic, ldc, packing + blockSize, packingSize - blockSize);
+			}
+	}
+#endif
+}
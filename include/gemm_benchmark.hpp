@@ -0,0 +1,141 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include "settings.hpp"
+#include "gemm.hpp"
+#include "sgemm.hpp"
+#include "timing.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// GFLOP/s of the backends and of every sgemm kernel this CPU runs on the products of MLP training:
+	// forward, weight gradient and backpropagated error of every {units, inputs} layer shape over a sweep
+	// of batch sizes, then of the current backend with the left operand stored in bfloat16 and half.
+	// The largest difference to the Eigen result is printed for every product, leaving out the stored
+	// operands, which differ by their rounding
+	void benchmarkGemm(std::ostream& out,
+		const std::vector<std::pair<uint32_t, uint32_t>>& layers = { { 256, 784 }, { 256, 256 }, { 10, 256 } },
+		const std::vector<uint32_t>& batchSizes = { 1, 8, 32, 128, 512 },
+		float secondsPerProduct = 0.05f)
+	{
+		using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
+		using Product = std::function<void(size_t rows, size_t cols, size_t depth, const real* a, size_t lda, bool transposeA,
+			const real* b, size_t ldb, bool transposeB, real* c, size_t ldc, real* packing, size_t packingSize)>;
+		struct candidate
+		{
+			std::string name;
+			Product run;
+		};
+
+		std::vector<candidate> candidates;
+		for (auto type : { BackendType::kEigen, BackendType::kPacked })
+		{
+			const auto& ops = backend(type);
+			candidates.push_back(candidate{ type == BackendType::kEigen ? "eigen" : "packed",
+				[&ops](size_t rows, size_t cols, size_t depth, const real* a, size_t lda, bool transposeA,
+					const real* b, size_t ldb, bool transposeB, real* c, size_t ldc, real* packing, size_t packingSize)
+			{
+				ops.gemm(rows, cols, depth, real(1.0), a, lda, transposeA, b, ldb, transposeB, real(0.0), c, ldc, packing, packingSize);
+			} });
+		}
+		if (std::is_same<real, float>::value)
+		{
+			for (const auto& kernel : sgemmKernels())
+				candidates.push_back(candidate{ std::string("sgemm/") + kernel.name,
+					[kernel](size_t rows, size_t cols, size_t depth, const real* a, size_t lda, bool transposeA,
+						const real* b, size_t ldb, bool transposeB, real* c, size_t ldc, real* packing, size_t packingSize)
+				{
+					sgemm(rows, cols, depth, 1.0f, reinterpret_cast<const float*>(a), lda, transposeA, reinterpret_cast<const float*>(b), ldb, transposeB,
+						0.0f, reinterpret_cast<float*>(c), ldc, reinterpret_cast<float*>(packing), packingSize, kernel);
+				} });
+		}
+
+		const StorageType storageTypes[] = { StorageType::kBfloat16, StorageType::kHalf };
+		out << std::setw(10) << "product" << std::setw(22) << "shape";
+		for (const auto& c : candidates)
+			out << std::setw(16) << c.name;
+		out << std::setw(16) << "bf16" << std::setw(16) << "half";
+		out << std::setw(12) << "max diff" << std::endl;
+
+		std::vector<real, Eigen::aligned_allocator<real>> packing;
+		for (const auto& shape : layers)
+			for (auto batchSize : batchSizes)
+			{
+				const MatrixType weights = MatrixType::Random(shape.first, shape.second);
+				const MatrixType inputs = MatrixType::Random(shape.second, batchSize);
+				const MatrixType delta = MatrixType::Random(shape.first, batchSize);
+				struct product
+				{
+					const char* name;
+					const MatrixType& a;
+					bool transposeA;
+					const MatrixType& b;
+					bool transposeB;
+				};
+				const product products[] = {
+					{ "forward", weights, false, inputs, false },
+					{ "nabla w", delta, false, inputs, true },
+					{ "delta", weights, true, delta, false } };
+				for (const auto& p : products)
+				{
+					const size_t rows = size_t(p.transposeA ? p.a.cols() : p.a.rows());
+					const size_t depth = size_t(p.transposeA ? p.a.rows() : p.a.cols());
+					const size_t cols = size_t(p.transposeB ? p.b.rows() : p.b.cols());
+					size_t packingSize = std::max(gemmPackingSize(rows, cols, depth), storedGemmPackingSize(rows, cols, depth));
+					if (std::is_same<real, float>::value)
+						for (const auto& kernel : sgemmKernels())
+							packingSize = std::max(packingSize, sgemmPackingSize(rows, cols, depth, kernel));
+					packing.resize(packingSize);
+
+					out << std::setw(10) << p.name << std::setw(22) << (std::to_string(rows) + "x" + std::to_string(depth) + "*" + std::to_string(depth) + "x" + std::to_string(cols));
+					MatrixType reference;
+					real maxDiff = real(0.0);
+					auto measure = [&](const std::function<void()>& run)
+					{
+						size_t repetitions = 0;
+						timing timer;
+						do
+						{
+							run();
+							++repetitions;
+						} while (timer.seconds() < secondsPerProduct);
+						out << std::setw(16) << std::fixed << std::setprecision(2) << 2.0 * rows * cols * depth * repetitions / timer.seconds() * 1e-9;
+					};
+					for (const auto& c : candidates)
+					{
+						MatrixType result = MatrixType::Zero(rows, cols);
+						auto run = [&]
+						{
+							c.run(rows, cols, depth, p.a.data(), size_t(p.a.outerStride()), p.transposeA, p.b.data(), size_t(p.b.outerStride()), p.transposeB,
+								result.data(), size_t(result.outerStride()), packing.data(), packing.size());
+						};
+						run();
+						if (reference.size() == 0)
+							reference = result;
+						else
+							maxDiff = std::max(maxDiff, (result - reference).cwiseAbs().maxCoeff());
+						measure(run);
+					}
+					for (auto type : storageTypes)
+					{
+						stored_matrix a;
+						storeMatrix(p.a, type, a);
+						MatrixType result = MatrixType::Zero(rows, cols);
+						measure([&] { gemm(real(1.0), a, p.transposeA, p.b, p.transposeB, real(0.0), result, packing.data(), packing.size()); });
+					}
+					out << std::setw(12) << std::scientific << std::setprecision(1) << maxDiff << std::endl;
+				}
+			}
+	}
+#endif
+}
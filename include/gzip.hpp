@@ -0,0 +1,302 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include "inflate.hpp"
+
+namespace nn
+{
+	bool isGzip(const uint8_t* data, size_t size) { return size >= 18 && data[0] == 0x1F && data[1] == 0x8B && data[2] == 8; }
+
+	// decompresses a gzip file held in memory. The beginning of the stream is decoded on the
+	// calling thread by peek(), the rest is decoded by start() in the background while the
+	// caller waits only for the bytes it needs. Multi-member archives which record member
+	// sizes (BGZF) are decoded by several threads in parallel
+	class gzip_reader
+	{
+	public:
+		gzip_reader(const uint8_t* in, size_t size) : m_in(in), m_size(size)
+		{
+			if (!isGzip(in, size))
+				throw std::runtime_error("Not a gzip stream");
+			indexMembers();
+		}
+
+		~gzip_reader()
+		{
+			m_stop = true;
+			for (auto& worker : m_workers)
+				worker.join();
+		}
+
+		gzip_reader(const gzip_reader&) = delete;
+		gzip_reader& operator=(const gzip_reader&) = delete;
+
+		// decodes at least the first bytes of the output on the calling thread, start() must not be called yet
+		const uint8_t* peek(size_t bytes)
+		{
+			if (m_buffer.size() < bytes)
+				m_buffer.resize(bytes);
+			decodeSequential(bytes);
+			if (m_outPos < bytes)
+				throw std::runtime_error("Compressed stream is truncated");
+			return m_buffer.data();
+		}
+
+		// decodes the rest of the first size bytes of the output in the background
+		void start(size_t size, unsigned threads)
+		{
+			m_buffer.resize(std::max(size, m_outPos));
+			m_limit = size;
+			m_available = std::min(m_outPos, size);
+			if (!m_members.empty() && threads > 1)
+			{
+				// finish the member peek() stopped in, the remaining ones are independent
+				m_nextMember = 0;
+				while (m_inflater && m_nextMember < m_members.size() && m_members[m_nextMember].out != m_memberOut)
+					++m_nextMember;
+				if (m_inflater && m_nextMember < m_members.size())
+					decodeSequential(std::min(m_limit, m_members[m_nextMember].out + m_members[m_nextMember].outSize));
+				m_nextMember = 0;
+				while (m_nextMember < m_members.size() && m_members[m_nextMember].out < m_outPos)
+					++m_nextMember;
+				m_firstPending = m_nextMember;
+				m_available = std::min(m_outPos, size);
+				m_done.assign(m_members.size(), false);
+				threads = unsigned(std::min<size_t>(threads, m_members.size() - m_nextMember));
+				if (threads == 0 && m_available < m_limit)
+					m_error = "Compressed stream is truncated";
+				for (unsigned i = 0; i < threads; ++i)
+					m_workers.push_back(std::thread(&gzip_reader::decodeMembers, this));
+			}
+			else
+				m_workers.push_back(std::thread(&gzip_reader::decodeStream, this));
+		}
+
+		// blocks until the first bytes of the output are decoded. Throws once the stream turns out to be
+		// corrupted or truncated, even for bytes decoded before the check of their member's trailer failed
+		void wait(size_t bytes) const
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_ready.wait(lock, [&] { return m_available >= bytes || !m_error.empty(); });
+			if (!m_error.empty())
+				throw std::runtime_error(m_error);
+		}
+
+		const uint8_t* data() const { return m_buffer.data(); }
+	private:
+		static const size_t kChunkSize = 1 << 20;
+
+		struct member
+		{
+			size_t in;     // offset of the deflate data
+			size_t inSize;
+			size_t out;    // offset of the decoded data
+			size_t outSize;
+			uint32_t crc;
+		};
+
+		// returns the offset of the deflate data of the member at offset, blockSize is the BGZF member size or 0
+		size_t parseHeader(size_t offset, size_t& blockSize) const
+		{
+			if (!isGzip(m_in + offset, m_size - offset))
+				throw std::runtime_error("Bad gzip header");
+			const uint8_t flags = m_in[offset + 3];
+			size_t pos = offset + 10;
+			blockSize = 0;
+			if (flags & 0x04) // FEXTRA
+			{
+				const size_t xlen = m_in[pos] | (m_in[pos + 1] << 8);
+				const size_t end = pos + 2 + xlen;
+				if (end > m_size)
+					throw std::runtime_error("Bad gzip header");
+				for (size_t p = pos + 2; p + 4 <= end;)
+				{
+					const size_t len = m_in[p + 2] | (m_in[p + 3] << 8);
+					if (m_in[p] == 'B' && m_in[p + 1] == 'C' && len == 2 && p + 6 <= end)
+						blockSize = size_t(m_in[p + 4] | (m_in[p + 5] << 8)) + 1;
+					p += 4 + len;
+				}
+				pos = end;
+			}
+			if (flags & 0x08) // FNAME
+				while (pos < m_size && m_in[pos++]);
+			if (flags & 0x10) // FCOMMENT
+				while (pos < m_size && m_in[pos++]);
+			if (flags & 0x02) // FHCRC
+				pos += 2;
+			if (pos >= m_size)
+				throw std::runtime_error("Bad gzip header");
+			return pos;
+		}
+
+		// members can only be located without decoding if every one of them records its size
+		void indexMembers()
+		{
+			size_t offset = 0, out = 0;
+			while (offset < m_size && isGzip(m_in + offset, m_size - offset))
+			{
+				size_t blockSize;
+				const size_t data = parseHeader(offset, blockSize);
+				if (blockSize == 0 || offset + blockSize > m_size || data + 8 > offset + blockSize)
+				{
+					m_members.clear();
+					return;
+				}
+				const uint8_t* trailer = m_in + offset + blockSize - 8;
+				member m;
+				m.in = data;
+				m.inSize = offset + blockSize - 8 - data;
+				m.out = out;
+				m.outSize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | (size_t(trailer[7]) << 24);
+				m.crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint32_t(trailer[3]) << 24);
+				m_members.push_back(m);
+				out += m.outSize;
+				offset += blockSize;
+			}
+		}
+
+		void checkTrailer(size_t trailer, uint32_t crc, size_t size) const
+		{
+			if (trailer + 8 > m_size)
+				throw std::runtime_error("Compressed stream is truncated");
+			const uint8_t* t = m_in + trailer;
+			const uint32_t expectedCrc = t[0] | (t[1] << 8) | (t[2] << 16) | (uint32_t(t[3]) << 24);
+			const uint32_t expectedSize = t[4] | (t[5] << 8) | (t[6] << 16) | (uint32_t(t[7]) << 24);
+			if (crc != expectedCrc || uint32_t(size) != expectedSize)
+				throw std::runtime_error("Compressed stream is corrupted: CRC mismatch");
+		}
+
+		// decodes members one after another until limit bytes of output are available
+		void decodeSequential(size_t limit)
+		{
+			while (!m_finished)
+			{
+				if (!m_inflater)
+				{
+					if (m_outPos >= limit)
+						break;
+					if (!isGzip(m_in + m_inPos, m_size - m_inPos))
+					{
+						m_finished = true;
+						break;
+					}
+					size_t blockSize;
+					m_memberData = parseHeader(m_inPos, blockSize);
+					m_memberOut = m_outPos;
+					m_crc = 0;
+					m_inflater.reset(new inflater(m_in + m_memberData, m_size - m_memberData));
+				}
+				size_t position = m_outPos - m_memberOut;
+				const bool done = m_inflater->run(m_buffer.data() + m_memberOut, position, limit - m_memberOut);
+				m_crc = crc32(m_crc, m_buffer.data() + m_outPos, m_memberOut + position - m_outPos);
+				m_outPos = m_memberOut + position;
+				if (done)
+				{
+					const size_t trailer = m_memberData + m_inflater->consumed();
+					checkTrailer(trailer, m_crc, m_outPos - m_memberOut);
+					m_inPos = trailer + 8;
+					m_inflater.reset();
+				}
+				else
+					break;
+			}
+		}
+
+		void publish(size_t available, const std::string& error = std::string())
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_available = std::max(m_available, available);
+			if (m_error.empty())
+				m_error = error;
+			m_ready.notify_all();
+		}
+
+		void decodeStream()
+		{
+			try
+			{
+				while (!m_stop && m_outPos < m_limit && !m_finished)
+				{
+					decodeSequential(std::min(m_outPos + kChunkSize, m_limit));
+					publish(m_outPos);
+				}
+				if (m_outPos < m_limit)
+					publish(m_outPos, "Compressed stream is truncated");
+			}
+			catch (const std::exception& e)
+			{
+				publish(m_outPos, e.what());
+			}
+		}
+
+		void decodeMembers()
+		{
+			size_t k;
+			while (!m_stop && (k = m_nextMember++) < m_members.size())
+			{
+				const auto& m = m_members[k];
+				try
+				{
+					if (m.out < m_limit)
+					{
+						const size_t capacity = std::min(m.outSize, m_limit - m.out);
+						inflater member(m_in + m.in, m.inSize);
+						size_t position = 0;
+						const bool done = member.run(m_buffer.data() + m.out, position, capacity);
+						if (done && (position != m.outSize || crc32(0, m_buffer.data() + m.out, position) != m.crc))
+							throw std::runtime_error("Compressed stream is corrupted: CRC mismatch");
+						if (!done && position < capacity)
+							throw std::runtime_error("Compressed stream is truncated");
+					}
+				}
+				catch (const std::exception& e)
+				{
+					publish(0, e.what());
+					return;
+				}
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_done[k] = true;
+				while (m_firstPending < m_members.size() && m_done[m_firstPending])
+				{
+					const auto& done = m_members[m_firstPending++];
+					m_available = std::min(done.out + done.outSize, m_limit);
+				}
+				if (m_firstPending == m_members.size() && m_available < m_limit && m_error.empty())
+					m_error = "Compressed stream is truncated";
+				m_ready.notify_all();
+			}
+		}
+
+		const uint8_t* m_in;
+		size_t m_size;
+		std::vector<member> m_members;
+		std::vector<uint8_t> m_buffer;
+		size_t m_limit = 0;
+
+		// sequential decoding state
+		std::unique_ptr<inflater> m_inflater;
+		size_t m_inPos = 0;
+		size_t m_memberData = 0;
+		size_t m_memberOut = 0;
+		size_t m_outPos = 0;
+		uint32_t m_crc = 0;
+		bool m_finished = false;
+
+		// background decoding state
+		std::vector<std::thread> m_workers;
+		std::atomic<size_t> m_nextMember{ 0 };
+		std::atomic<bool> m_stop{ false };
+		std::vector<bool> m_done;
+		size_t m_firstPending = 0;
+		mutable std::mutex m_mutex;
+		mutable std::condition_variable m_ready;
+		size_t m_available = 0;
+		std::string m_error;
+	};
+}
@@ -0,0 +1,249 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+#include "settings.hpp"
+#include "conversion.hpp"
+#include "gzip.hpp"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace
+{
+	uint16_t load_be16(const uint8_t* p) { return uint16_t((p[0] << 8) | p[1]); }
+	uint32_t load_be32(const uint8_t* p) { return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]); }
+	uint64_t load_be64(const uint8_t* p) { return (uint64_t(load_be32(p)) << 32) | load_be32(p + 4); }
+}
+
+namespace nn
+{
+	// element type is the third byte of the IDX magic number
+	enum class IdxType
+	{
+		kUInt8 = 0x08,
+		kInt8 = 0x09,
+		kInt16 = 0x0B,
+		kInt32 = 0x0C,
+		kFloat32 = 0x0D,
+		kFloat64 = 0x0E
+	};
+
+	// memory mapped IDX file of any type and rank, the payload stays in its on-disk
+	// representation and is decoded by convert() on demand. Gzipped files are
+	// decompressed in the background, accessors wait only for the bytes they touch
+	class idx_file
+	{
+	public:
+		explicit idx_file(const std::string& filename, unsigned threads = std::thread::hardware_concurrency())
+		{
+#ifdef _WIN32
+			m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE)
+				throw std::runtime_error("Can't open IDX file " + filename);
+			LARGE_INTEGER size;
+			GetFileSizeEx(m_file, &size);
+			m_mappedSize = size_t(size.QuadPart);
+			m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (m_mapping)
+				m_mapped = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+			m_file = open(filename.c_str(), O_RDONLY);
+			if (m_file < 0)
+				throw std::runtime_error("Can't open IDX file " + filename);
+			struct stat st;
+			fstat(m_file, &st);
+			m_mappedSize = size_t(st.st_size);
+			void* data = m_mappedSize ? mmap(nullptr, m_mappedSize, PROT_READ, MAP_PRIVATE, m_file, 0) : MAP_FAILED;
+			if (data != MAP_FAILED)
+			{
+				m_mapped = static_cast<const uint8_t*>(data);
+				madvise(data, m_mappedSize, MADV_WILLNEED);
+			}
+#endif
+			if (!m_mapped)
+			{
+				unmap();
+				throw std::runtime_error("Can't map IDX file " + filename);
+			}
+			try
+			{
+				if (isGzip(m_mapped, m_mappedSize))
+				{
+					m_gzip.reset(new gzip_reader(m_mapped, m_mappedSize));
+					parseHeader(m_gzip->peek(4 + 4 * size_t(m_gzip->peek(4)[3])));
+					m_size = m_headerSize + count() * m_itemSize * elementSize();
+					m_gzip->start(m_size, threads);
+					m_data = m_gzip->data();
+				}
+				else
+				{
+					m_data = m_mapped;
+					m_size = m_mappedSize;
+					if (m_size < 4 || m_size < 4 + 4 * size_t(m_data[3]))
+						throw std::runtime_error("Bad IDX header");
+					parseHeader(m_data);
+					if (m_size < m_headerSize + count() * m_itemSize * elementSize())
+						throw std::runtime_error("IDX file is truncated");
+				}
+			}
+			catch (...)
+			{
+				unmap();
+				throw;
+			}
+		}
+
+		~idx_file() { unmap(); }
+
+		idx_file(const idx_file&) = delete;
+		idx_file& operator=(const idx_file&) = delete;
+
+		IdxType type() const { return m_type; }
+		uint32_t rank() const { return uint32_t(m_dims.size()); }
+		const std::vector<uint32_t>& dims() const { return m_dims; }
+		// number of items along the first dimension and elements per item
+		size_t count() const { return m_dims[0]; }
+		size_t itemSize() const { return m_itemSize; }
+		size_t elementSize() const
+		{
+			switch (m_type)
+			{
+			case IdxType::kInt16: return 2;
+			case IdxType::kInt32: case IdxType::kFloat32: return 4;
+			case IdxType::kFloat64: return 8;
+			default: return 1;
+			}
+		}
+		// raw big-endian payload, blocks until a compressed file is fully decoded
+		const uint8_t* payload() const
+		{
+			if (m_gzip)
+				m_gzip->wait(m_size);
+			return m_data + m_headerSize;
+		}
+
+		// decodes elements [first, first + count) of the payload as out[i] = element * scale
+		template<typename T>
+		void convert(size_t first, size_t count, T* out, T scale) const
+		{
+			if (m_gzip)
+				m_gzip->wait(m_headerSize + (first + count) * elementSize());
+			const uint8_t* p = m_data + m_headerSize + first * elementSize();
+			switch (m_type)
+			{
+			case IdxType::kUInt8:
+				nn::convert(p, count, out, scale);
+				break;
+			case IdxType::kInt8:
+				for (size_t i = 0; i < count; ++i)
+					out[i] = T(int8_t(p[i])) * scale;
+				break;
+			case IdxType::kInt16:
+				for (size_t i = 0; i < count; ++i)
+					out[i] = T(int16_t(load_be16(p + 2 * i))) * scale;
+				break;
+			case IdxType::kInt32:
+				for (size_t i = 0; i < count; ++i)
+					out[i] = T(int32_t(load_be32(p + 4 * i))) * scale;
+				break;
+			case IdxType::kFloat32:
+				for (size_t i = 0; i < count; ++i)
+				{
+					const uint32_t bits = load_be32(p + 4 * i);
+					float value;
+					memcpy(&value, &bits, sizeof(value));
+					out[i] = T(value) * scale;
+				}
+				break;
+			case IdxType::kFloat64:
+				for (size_t i = 0; i < count; ++i)
+				{
+					const uint64_t bits = load_be64(p + 8 * i);
+					double value;
+					memcpy(&value, &bits, sizeof(value));
+					out[i] = T(value) * scale;
+				}
+				break;
+			}
+		}
+	private:
+		// header has to hold at least 4 + 4 * rank bytes
+		void parseHeader(const uint8_t* header)
+		{
+			if (header[0] != 0 || header[1] != 0)
+				throw std::runtime_error("Bad magic number");
+			const uint8_t type = header[2];
+			if (type != 0x08 && type != 0x09 && type != 0x0B && type != 0x0C && type != 0x0D && type != 0x0E)
+				throw std::runtime_error("Unknown IDX data type");
+			m_type = IdxType(type);
+			const uint32_t rank = header[3];
+			m_headerSize = 4 + 4 * size_t(rank);
+			if (rank == 0)
+				throw std::runtime_error("Bad IDX header");
+			m_itemSize = 1;
+			for (uint32_t i = 0; i < rank; ++i)
+			{
+				m_dims.push_back(load_be32(header + 4 + 4 * i));
+				if (i > 0)
+					m_itemSize *= m_dims.back();
+			}
+		}
+
+		void unmap()
+		{
+			// background decompression reads the mapping
+			m_gzip.reset();
+#ifdef _WIN32
+			if (m_mapped)
+				UnmapViewOfFile(m_mapped);
+			if (m_mapping)
+				CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+			m_mapping = nullptr;
+			m_file = INVALID_HANDLE_VALUE;
+#else
+			if (m_mapped)
+				munmap(const_cast<uint8_t*>(m_mapped), m_mappedSize);
+			if (m_file >= 0)
+				close(m_file);
+			m_file = -1;
+#endif
+			m_mapped = nullptr;
+			m_data = nullptr;
+		}
+
+#ifdef _WIN32
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = nullptr;
+#else
+		int m_file = -1;
+#endif
+		const uint8_t* m_mapped = nullptr;
+		size_t m_mappedSize = 0;
+		std::unique_ptr<gzip_reader> m_gzip;
+		// decompressed or mapped contents
+		const uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+		size_t m_headerSize = 0;
+		size_t m_itemSize = 0;
+		IdxType m_type = IdxType::kUInt8;
+		std::vector<uint32_t> m_dims;
+	};
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include "settings.hpp"
+
+namespace nn
+{
+	// shape of a 2D convolution over images of channels x height x width stored channel after channel,
+	// every channel row after row. Kernels are square, the output has one channel per filter
+	struct conv_geometry
+	{
+		conv_geometry() {}
+		conv_geometry(uint32_t channels, uint32_t height, uint32_t width, uint32_t filters, uint32_t kernelSize, uint32_t stride = 1, uint32_t padding = 0) :
+			channels(channels), height(height), width(width), filters(filters), kernelSize(kernelSize), stride(stride), padding(padding)
+		{
+		}
+
+		uint32_t outputHeight() const { return (height + 2 * padding - kernelSize) / stride + 1; }
+		uint32_t outputWidth() const { return (width + 2 * padding - kernelSize) / stride + 1; }
+		// pixels of one output channel
+		size_t pixels() const { return size_t(outputHeight()) * outputWidth(); }
+		// inputs one output pixel sees, over all input channels
+		size_t patchSize() const { return size_t(channels) * kernelSize * kernelSize; }
+		size_t inputSize() const { return size_t(channels) * height * width; }
+		size_t outputSize() const { return size_t(filters) * pixels(); }
+		bool operator==(const conv_geometry& other) const
+		{
+			return channels == other.channels && height == other.height && width == other.width && filters == other.filters &&
+				kernelSize == other.kernelSize && stride == other.stride && padding == other.padding;
+		}
+		bool valid() const
+		{
+			return channels && height && width && filters && kernelSize && stride &&
+				kernelSize <= height + 2 * padding && kernelSize <= width + 2 * padding;
+		}
+
+		uint32_t channels = 0;
+		uint32_t height = 0;
+		uint32_t width = 0;
+		uint32_t filters = 0;
+		uint32_t kernelSize = 0;
+		uint32_t stride = 1;
+		uint32_t padding = 0;
+	};
+
+	namespace
+	{
+		// output columns [begin, end) whose input column ox * stride + kx - padding lies inside the image
+		void im2colRange(const conv_geometry& g, uint32_t kx, size_t& begin, size_t& end)
+		{
+			const size_t ow = g.outputWidth();
+			begin = kx >= g.padding ? 0 : std::min<size_t>(ow, (g.padding - kx + g.stride - 1) / g.stride);
+			end = g.width + g.padding > kx ? std::min<size_t>(ow, (g.width + g.padding - kx + g.stride - 1) / g.stride) : 0;
+			begin = std::min(begin, end);
+		}
+	}
+
+	// lowers one image to a pixels x patchSize column-major matrix: column (c * k + ky) * k + kx holds the input
+	// each output pixel multiplies with that kernel tap, zero where the tap falls into the padding.
+	// The convolution is then a single product with the filters as a filters x patchSize matrix
+	void im2col(const conv_geometry& g, const real* image, real* columns)
+	{
+		const size_t oh = g.outputHeight(), ow = g.outputWidth(), pixels = oh * ow;
+		for (uint32_t c = 0; c < g.channels; ++c)
+			for (uint32_t ky = 0; ky < g.kernelSize; ++ky)
+				for (uint32_t kx = 0; kx < g.kernelSize; ++kx)
+				{
+					real* column = columns + ((size_t(c) * g.kernelSize + ky) * g.kernelSize + kx) * pixels;
+					size_t begin, end;
+					im2colRange(g, kx, begin, end);
+					for (size_t oy = 0; oy < oh; ++oy)
+					{
+						real* out = column + oy * ow;
+						const size_t y = oy * g.stride + ky;
+						if (y < g.padding || y - g.padding >= g.height)
+						{
+							std::fill(out, out + ow, real(0.0));
+							continue;
+						}
+						const real* in = image + (size_t(c) * g.height + y - g.padding) * g.width;
+						std::fill(out, out + begin, real(0.0));
+						if (g.stride == 1 && begin < end)
+							std::copy(in + begin + kx - g.padding, in + end + kx - g.padding, out + begin);
+						else
+							for (size_t ox = begin; ox < end; ++ox)
+								out[ox] = in[ox * g.stride + kx - g.padding];
+						std::fill(out + end, out + ow, real(0.0));
+					}
+				}
+	}
+
+	// the adjoint of im2col: every entry of columns is added to the input pixel it was read from, the padding is dropped
+	void col2im(const conv_geometry& g, const real* columns, real* image)
+	{
+		const size_t oh = g.outputHeight(), ow = g.outputWidth(), pixels = oh * ow;
+		for (uint32_t c = 0; c < g.channels; ++c)
+			for (uint32_t ky = 0; ky < g.kernelSize; ++ky)
+				for (uint32_t kx = 0; kx < g.kernelSize; ++kx)
+				{
+					const real* column = columns + ((size_t(c) * g.kernelSize + ky) * g.kernelSize + kx) * pixels;
+					size_t begin, end;
+					im2colRange(g, kx, begin, end);
+					for (size_t oy = 0; oy < oh; ++oy)
+					{
+						const size_t y = oy * g.stride + ky;
+						if (y < g.padding || y - g.padding >= g.height)
+							continue;
+						const real* in = column + oy * ow;
+						real* out = image + (size_t(c) * g.height + y - g.padding) * g.width;
+						for (size_t ox = begin; ox < end; ++ox)
+							out[ox * g.stride + kx - g.padding] += in[ox];
+					}
+				}
+	}
+}
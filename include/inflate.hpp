@@ -0,0 +1,384 @@
+#pragma once
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace nn
+{
+	// canonical huffman code, codes up to kFastBits long are decoded with a single table lookup
+	struct huffman_code
+	{
+		static const int kMaxBits = 15;
+		static const int kFastBits = 10;
+
+		uint16_t fast[1 << kFastBits]; // (symbol << 4) | code length, 0 for longer codes
+		uint16_t count[kMaxBits + 1];  // number of codes of each length
+		uint16_t symbol[288];          // symbols ordered by their codes
+
+		void build(const uint8_t* lengths, int n)
+		{
+			memset(count, 0, sizeof(count));
+			memset(fast, 0, sizeof(fast));
+			for (int i = 0; i < n; ++i)
+				count[lengths[i]]++;
+			count[0] = 0;
+			int left = 1;
+			for (int len = 1; len <= kMaxBits; ++len)
+			{
+				left = (left << 1) - count[len];
+				if (left < 0)
+					throw std::runtime_error("Corrupted deflate stream: over-subscribed code");
+			}
+
+			uint16_t offsets[kMaxBits + 2];
+			uint32_t nextCode[kMaxBits + 2];
+			offsets[1] = 0;
+			nextCode[1] = 0;
+			for (int len = 1; len <= kMaxBits; ++len)
+			{
+				offsets[len + 1] = offsets[len] + count[len];
+				nextCode[len + 1] = (nextCode[len] + count[len]) << 1;
+			}
+			for (int i = 0; i < n; ++i)
+			{
+				const int len = lengths[i];
+				if (len == 0)
+					continue;
+				symbol[offsets[len]++] = uint16_t(i);
+				const uint32_t code = nextCode[len]++;
+				if (len > kFastBits)
+					continue;
+				// the stream stores codes starting from the most significant bit
+				uint32_t reversed = 0;
+				for (int b = 0; b < len; ++b)
+					reversed |= ((code >> b) & 1) << (len - 1 - b);
+				for (uint32_t j = reversed; j < (1u << kFastBits); j += 1u << len)
+					fast[j] = uint16_t((i << 4) | len);
+			}
+		}
+	};
+
+	// decoder of a raw DEFLATE (RFC 1951) stream held in memory. Decoding can be
+	// suspended whenever the output buffer is full and resumed with a larger one
+	class inflater
+	{
+	public:
+		inflater(const uint8_t* in, size_t size) : m_in(in), m_size(size) {}
+
+		// decodes into out[position, capacity), out[0, position) has to hold everything decoded
+		// so far since back-references point into it. Returns true when the last block is done
+		bool run(uint8_t* out, size_t& position, size_t capacity)
+		{
+			while (true)
+			{
+				while (m_copyLeft && position < capacity)
+				{
+					out[position] = out[position - m_copyDistance];
+					++position;
+					--m_copyLeft;
+				}
+				if (m_copyLeft)
+					return false;
+
+				if (m_state == State::kHeader)
+				{
+					if (m_final)
+					{
+						m_state = State::kDone;
+						return true;
+					}
+					readBlockHeader();
+				}
+				else if (m_state == State::kStored)
+				{
+					const size_t n = std::min(m_storedLeft, capacity - position);
+					if (m_pos + n > m_size)
+						throw std::runtime_error("Corrupted deflate stream: truncated stored block");
+					memcpy(out + position, m_in + m_pos, n);
+					m_pos += n;
+					position += n;
+					m_storedLeft -= n;
+					if (m_storedLeft)
+						return false;
+					m_state = State::kHeader;
+				}
+				else if (m_state == State::kHuffman)
+				{
+					if (!decodeSymbols(out, position, capacity))
+						return false;
+				}
+				else
+					return true;
+			}
+		}
+
+		// input bytes used by the stream, valid once run() returned true
+		size_t consumed() const { return m_pos - m_bitCount / 8; }
+	private:
+		enum class State
+		{
+			kHeader,
+			kStored,
+			kHuffman,
+			kDone
+		};
+
+		void refill()
+		{
+			while (m_bitCount <= 56 && m_pos < m_size)
+			{
+				m_bits |= uint64_t(m_in[m_pos++]) << m_bitCount;
+				m_bitCount += 8;
+			}
+		}
+
+		uint32_t bits(int n)
+		{
+			if (m_bitCount < n)
+			{
+				refill();
+				if (m_bitCount < n)
+					throw std::runtime_error("Corrupted deflate stream: unexpected end of input");
+			}
+			const uint32_t result = uint32_t(m_bits & ((uint64_t(1) << n) - 1));
+			m_bits >>= n;
+			m_bitCount -= n;
+			return result;
+		}
+
+		int decode(const huffman_code& h)
+		{
+			if (m_bitCount < huffman_code::kMaxBits)
+				refill();
+			const uint16_t entry = h.fast[m_bits & ((1u << huffman_code::kFastBits) - 1)];
+			if (entry && (entry & 15) <= m_bitCount)
+			{
+				m_bits >>= entry & 15;
+				m_bitCount -= entry & 15;
+				return entry >> 4;
+			}
+			int code = 0, first = 0, index = 0;
+			for (int len = 1; len <= huffman_code::kMaxBits; ++len)
+			{
+				code |= int(bits(1));
+				const int count = h.count[len];
+				if (code - count < first)
+					return h.symbol[index + (code - first)];
+				index += count;
+				first += count;
+				first <<= 1;
+				code <<= 1;
+			}
+			throw std::runtime_error("Corrupted deflate stream: bad code");
+		}
+
+		void readBlockHeader()
+		{
+			m_final = bits(1) != 0;
+			const uint32_t type = bits(2);
+			if (type == 0)
+			{
+				// drop the bits up to the byte boundary and give back whole buffered bytes
+				bits(m_bitCount % 8);
+				m_pos -= m_bitCount / 8;
+				m_bits = 0;
+				m_bitCount = 0;
+				if (m_pos + 4 > m_size)
+					throw std::runtime_error("Corrupted deflate stream: unexpected end of input");
+				const uint32_t len = m_in[m_pos] | (m_in[m_pos + 1] << 8);
+				const uint32_t nlen = m_in[m_pos + 2] | (m_in[m_pos + 3] << 8);
+				if (len != (~nlen & 0xFFFF))
+					throw std::runtime_error("Corrupted deflate stream: bad stored block length");
+				m_pos += 4;
+				m_storedLeft = len;
+				m_state = State::kStored;
+			}
+			else if (type == 1)
+			{
+				static const fixed_codes fixed;
+				m_lengthCode = &fixed.length;
+				m_distanceCode = &fixed.distance;
+				m_state = State::kHuffman;
+			}
+			else if (type == 2)
+			{
+				readDynamicCodes();
+				m_state = State::kHuffman;
+			}
+			else
+				throw std::runtime_error("Corrupted deflate stream: bad block type");
+		}
+
+		void readDynamicCodes()
+		{
+			static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+			const int nlen = int(bits(5)) + 257;
+			const int ndist = int(bits(5)) + 1;
+			const int ncode = int(bits(4)) + 4;
+			if (nlen > 286 || ndist > 30)
+				throw std::runtime_error("Corrupted deflate stream: bad counts");
+
+			uint8_t lengths[286 + 30] = {};
+			for (int i = 0; i < ncode; ++i)
+				lengths[order[i]] = uint8_t(bits(3));
+			huffman_code lencode;
+			lencode.build(lengths, 19);
+
+			int index = 0;
+			while (index < nlen + ndist)
+			{
+				const int sym = decode(lencode);
+				if (sym < 16)
+				{
+					lengths[index++] = uint8_t(sym);
+					continue;
+				}
+				uint8_t len = 0;
+				int repeat;
+				if (sym == 16)
+				{
+					if (index == 0)
+						throw std::runtime_error("Corrupted deflate stream: repeat without a length");
+					len = lengths[index - 1];
+					repeat = 3 + int(bits(2));
+				}
+				else if (sym == 17)
+					repeat = 3 + int(bits(3));
+				else
+					repeat = 11 + int(bits(7));
+				if (index + repeat > nlen + ndist)
+					throw std::runtime_error("Corrupted deflate stream: too many lengths");
+				while (repeat--)
+					lengths[index++] = len;
+			}
+			if (lengths[256] == 0)
+				throw std::runtime_error("Corrupted deflate stream: no end of block code");
+
+			m_dynamicLength.build(lengths, nlen);
+			m_dynamicDistance.build(lengths + nlen, ndist);
+			m_lengthCode = &m_dynamicLength;
+			m_distanceCode = &m_dynamicDistance;
+		}
+
+		bool decodeSymbols(uint8_t* out, size_t& position, size_t capacity)
+		{
+			static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+			static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+			static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+			static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+			while (true)
+			{
+				if (position == capacity)
+				{
+					// the output is full, but the block may end right here
+					const uint64_t bitsBefore = m_bits;
+					const int bitCountBefore = m_bitCount;
+					const size_t posBefore = m_pos;
+					if (decode(*m_lengthCode) == 256)
+					{
+						m_state = State::kHeader;
+						return true;
+					}
+					m_bits = bitsBefore;
+					m_bitCount = bitCountBefore;
+					m_pos = posBefore;
+					return false;
+				}
+				const int sym = decode(*m_lengthCode);
+				if (sym < 256)
+				{
+					out[position++] = uint8_t(sym);
+					continue;
+				}
+				if (sym == 256)
+				{
+					m_state = State::kHeader;
+					return true;
+				}
+				if (sym > 285)
+					throw std::runtime_error("Corrupted deflate stream: bad length symbol");
+				const size_t length = lengthBase[sym - 257] + bits(lengthExtra[sym - 257]);
+				const int dsym = decode(*m_distanceCode);
+				if (dsym > 29)
+					throw std::runtime_error("Corrupted deflate stream: bad distance symbol");
+				const size_t distance = distanceBase[dsym] + bits(distanceExtra[dsym]);
+				if (distance > position)
+					throw std::runtime_error("Corrupted deflate stream: distance too far back");
+
+				const size_t n = std::min(length, capacity - position);
+				const uint8_t* from = out + position - distance;
+				uint8_t* to = out + position;
+				if (distance >= n)
+					memcpy(to, from, n);
+				else
+					for (size_t i = 0; i < n; ++i)
+						to[i] = from[i];
+				position += n;
+				m_copyLeft = length - n;
+				m_copyDistance = distance;
+				if (m_copyLeft)
+					return false;
+			}
+		}
+
+		struct fixed_codes
+		{
+			huffman_code length;
+			huffman_code distance;
+			fixed_codes()
+			{
+				uint8_t lengths[288];
+				for (int i = 0; i < 144; ++i) lengths[i] = 8;
+				for (int i = 144; i < 256; ++i) lengths[i] = 9;
+				for (int i = 256; i < 280; ++i) lengths[i] = 7;
+				for (int i = 280; i < 288; ++i) lengths[i] = 8;
+				length.build(lengths, 288);
+				for (int i = 0; i < 30; ++i) lengths[i] = 5;
+				distance.build(lengths, 30);
+			}
+		};
+
+		const uint8_t* m_in;
+		size_t m_size;
+		size_t m_pos = 0;
+		uint64_t m_bits = 0;
+		int m_bitCount = 0;
+
+		State m_state = State::kHeader;
+		bool m_final = false;
+		size_t m_storedLeft = 0;
+		size_t m_copyLeft = 0;
+		size_t m_copyDistance = 0;
+		const huffman_code* m_lengthCode = nullptr;
+		const huffman_code* m_distanceCode = nullptr;
+		huffman_code m_dynamicLength;
+		huffman_code m_dynamicDistance;
+	};
+
+	// CRC-32 as used by gzip, crc starts at 0
+	uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+	{
+		struct table
+		{
+			uint32_t entries[256];
+			table()
+			{
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					uint32_t c = i;
+					for (int k = 0; k < 8; ++k)
+						c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+					entries[i] = c;
+				}
+			}
+		};
+		static const table t;
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = t.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+}
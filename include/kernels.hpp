@@ -0,0 +1,417 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <cmath>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "settings.hpp"
+#include "activations.hpp"
+#include "precision.hpp"
+#include "cpu_features.hpp"
+#include "sgemm.hpp"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NN_KERNELS_SSE2 1
+#endif
+
+namespace nn
+{
+	// instruction set variants of the elementwise kernels, chosen at startup from cpuFeatures().
+	// The generic variant is scalar C++ apart from SSE2, which every x64 CPU has
+	enum class IsaLevel
+	{
+		kGeneric,
+		kSse42,
+		kAvx2,
+		kAvx512
+	};
+
+	// the kernels on float columns the layers, costs, convolution and batch assembly spend their time in
+	struct kernel_table
+	{
+		IsaLevel isa;
+		const char* name;
+		// a = f(a + bias) and, if da isn't null, da = f'(a). bias may be null
+		void(*biasActivation)(ActivationType type, size_t size, const float* bias, float* a, float* da);
+		// z = softmax(z), returns log(sum(exp(z))) of the input
+		float(*softmax)(size_t size, float* z);
+		// sum of log(max(1 - a, tiny)), the part of the cross-entropy cost not depending on labels
+		float(*sumLogComplement)(size_t size, const float* a, float tiny);
+		// y += alpha * x
+		void(*axpy)(size_t size, float alpha, const float* x, float* y);
+		// out = in * scale
+		void(*convert)(const uint8_t* in, size_t count, float* out, float scale);
+		// FFT butterflies on split complex numbers: t = b * w, b = a - t, a = a + t
+		void(*butterfly)(size_t size, float wr, float wi, float* ar, float* ai, float* br, float* bi);
+		// c += a * b on split complex numbers
+		void(*complexMultiplyAdd)(size_t size, const float* ar, const float* ai, const float* br, const float* bi, float* cr, float* ci);
+		// y[i] += sum of kernel[t] * x[i + t] over the taps, the 1D passes of separable convolutions
+		void(*correlate)(size_t size, size_t taps, const float* kernel, const float* x, float* y);
+		// where x[i] > y[i]: y[i] = x[i] and positions[i] = first + i, the running maxima of max pooling
+		void(*maxUpdate)(size_t size, const float* x, float first, float* y, float* positions);
+		// out = in rounded to 16 bits and back, the storage of StorageType::kHalf and kBfloat16
+		void(*floatToHalf)(size_t size, const float* in, uint16_t* out);
+		void(*halfToFloat)(size_t size, const uint16_t* in, float* out);
+		void(*floatToBfloat16)(size_t size, const float* in, uint16_t* out);
+		void(*bfloat16ToFloat)(size_t size, const uint16_t* in, float* out);
+	};
+
+#if USE_EIGEN == 1
+	namespace
+	{
+		template <typename T, ActivationType t>
+		void genericBiasActivation(size_t size, const T* bias, T* a, T* da)
+		{
+			const activation<t> f;
+			const activation_derivative<t> df;
+			for (size_t i = 0; i < size; ++i)
+			{
+				a[i] = T(f(bias ? a[i] + bias[i] : a[i]));
+				if (da)
+					da[i] = T(df(a[i]));
+			}
+		}
+
+		template <typename T>
+		void genericBiasActivation(ActivationType type, size_t size, const T* bias, T* a, T* da)
+		{
+			switch (type)
+			{
+			case ActivationType::kSigmoid: genericBiasActivation<T, ActivationType::kSigmoid>(size, bias, a, da); break;
+			case ActivationType::kRelu: genericBiasActivation<T, ActivationType::kRelu>(size, bias, a, da); break;
+			case ActivationType::kLRelu: genericBiasActivation<T, ActivationType::kLRelu>(size, bias, a, da); break;
+			case ActivationType::kTanh: genericBiasActivation<T, ActivationType::kTanh>(size, bias, a, da); break;
+			default: genericBiasActivation<T, ActivationType::kLinear>(size, bias, a, da); break;
+			}
+		}
+
+		template <typename T>
+		T genericSoftmax(size_t size, T* z)
+		{
+			if (size == 0)
+				return T(0.0);
+			const T maxCoeff = *std::max_element(z, z + size);
+			T sum = T(0.0);
+			for (size_t i = 0; i < size; ++i)
+			{
+				z[i] = std::exp(z[i] - maxCoeff);
+				sum += z[i];
+			}
+			const T scale = T(1.0) / sum;
+			for (size_t i = 0; i < size; ++i)
+				z[i] *= scale;
+			return maxCoeff + std::log(sum);
+		}
+
+		template <typename T>
+		T genericSumLogComplement(size_t size, const T* a, T tiny)
+		{
+			T sum = T(0.0);
+			for (size_t i = 0; i < size; ++i)
+				sum += std::log(std::max(T(1.0) - a[i], tiny));
+			return sum;
+		}
+
+		template <typename T>
+		void genericAxpy(size_t size, T alpha, const T* x, T* y)
+		{
+			for (size_t i = 0; i < size; ++i)
+				y[i] += alpha * x[i];
+		}
+
+		template <typename T>
+		void genericButterfly(size_t size, T wr, T wi, T* ar, T* ai, T* br, T* bi)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				const T tr = br[i] * wr - bi[i] * wi, ti = br[i] * wi + bi[i] * wr;
+				br[i] = ar[i] - tr;
+				bi[i] = ai[i] - ti;
+				ar[i] += tr;
+				ai[i] += ti;
+			}
+		}
+
+		template <typename T>
+		void genericComplexMultiplyAdd(size_t size, const T* ar, const T* ai, const T* br, const T* bi, T* cr, T* ci)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				cr[i] += ar[i] * br[i] - ai[i] * bi[i];
+				ci[i] += ar[i] * bi[i] + ai[i] * br[i];
+			}
+		}
+
+		template <typename T>
+		void genericCorrelate(size_t size, size_t taps, const T* kernel, const T* x, T* y)
+		{
+			for (size_t i = 0; i < size; ++i)
+			{
+				T sum = T(0.0);
+				for (size_t t = 0; t < taps; ++t)
+					sum += kernel[t] * x[i + t];
+				y[i] += sum;
+			}
+		}
+
+		template <typename T>
+		void genericMaxUpdate(size_t size, const T* x, T first, T* y, T* positions)
+		{
+			for (size_t i = 0; i < size; ++i)
+				if (x[i] > y[i])
+				{
+					y[i] = x[i];
+					positions[i] = first + T(i);
+				}
+		}
+
+		void genericFloatToHalf(size_t size, const float* in, uint16_t* out)
+		{
+			for (size_t i = 0; i < size; ++i)
+				out[i] = floatToHalf(in[i]);
+		}
+
+		void genericHalfToFloat(size_t size, const uint16_t* in, float* out)
+		{
+			for (size_t i = 0; i < size; ++i)
+				out[i] = halfToFloat(in[i]);
+		}
+
+		void genericFloatToBfloat16(size_t size, const float* in, uint16_t* out)
+		{
+			for (size_t i = 0; i < size; ++i)
+				out[i] = floatToBfloat16(in[i]);
+		}
+
+		void genericBfloat16ToFloat(size_t size, const uint16_t* in, float* out)
+		{
+			for (size_t i = 0; i < size; ++i)
+				out[i] = bfloat16ToFloat(in[i]);
+		}
+
+		void genericConvert(const uint8_t* in, size_t count, float* out, float scale)
+		{
+			size_t i = 0;
+#if NN_KERNELS_SSE2 == 1
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 s = _mm_set1_ps(scale);
+			for (; i + 16 <= count; i += 16)
+			{
+				const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+				const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+				const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+				_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), s));
+				_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), s));
+				_mm_storeu_ps(out + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), s));
+				_mm_storeu_ps(out + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), s));
+			}
+#endif
+			for (; i < count; ++i)
+				out[i] = float(in[i]) * scale;
+		}
+	}
+#endif
+}
+
+#if USE_EIGEN == 1 && NN_X86
+#define NN_KERNEL_ISA 1
+#define NN_KERNEL_NAMESPACE kernels_sse42
+#include "kernels_isa.hpp"
+#undef NN_KERNEL_NAMESPACE
+#undef NN_KERNEL_ISA
+#define NN_KERNEL_ISA 2
+#define NN_KERNEL_NAMESPACE kernels_avx2
+#include "kernels_isa.hpp"
+#undef NN_KERNEL_NAMESPACE
+#undef NN_KERNEL_ISA
+#define NN_KERNEL_ISA 3
+#define NN_KERNEL_NAMESPACE kernels_avx512
+#include "kernels_isa.hpp"
+#undef NN_KERNEL_NAMESPACE
+#undef NN_KERNEL_ISA
+#endif
+
+namespace nn
+{
+#if USE_EIGEN == 1 && NN_X86
+	namespace
+	{
+		// AVX-512 BF16 rounds 16 floats per instruction, to nearest even like the others but with
+		// subnormal floats taken as zeros
+		NN_TARGET_AVX512BF16 void floatToBfloat16Avx512Bf16(size_t size, const float* in, uint16_t* out)
+		{
+			size_t i = 0;
+			for (; i + 16 <= size; i += 16)
+			{
+				const __m256bh rounded = _mm512_cvtneps_pbh(_mm512_loadu_ps(in + i));
+				memcpy(out + i, &rounded, sizeof(rounded));
+			}
+			if (i < size)
+			{
+				float tail[16] = {};
+				for (size_t j = i; j < size; ++j)
+					tail[j - i] = in[j];
+				const __m256bh rounded = _mm512_cvtneps_pbh(_mm512_loadu_ps(tail));
+				memcpy(out + i, &rounded, (size - i) * sizeof(uint16_t));
+			}
+		}
+	}
+#endif
+
+#if USE_EIGEN == 1
+	bool isaSupported(IsaLevel isa)
+	{
+		switch (isa)
+		{
+		case IsaLevel::kSse42: return NN_X86 && cpuFeatures().sse42;
+		case IsaLevel::kAvx2: return NN_X86 && cpuFeatures().sse42 && cpuFeatures().avx2;
+		case IsaLevel::kAvx512: return NN_X86 && cpuFeatures().sse42 && cpuFeatures().avx512f;
+		default: return true;
+		}
+	}
+
+	// the kernels of one variant, throws if this CPU can't run it
+	const kernel_table& kernels(IsaLevel isa)
+	{
+		static const kernel_table generic{ IsaLevel::kGeneric, "generic", genericBiasActivation<float>, genericSoftmax<float>,
+			genericSumLogComplement<float>, genericAxpy<float>, genericConvert, genericButterfly<float>, genericComplexMultiplyAdd<float>,
+			genericCorrelate<float>, genericMaxUpdate<float>, genericFloatToHalf, genericHalfToFloat, genericFloatToBfloat16, genericBfloat16ToFloat };
+#if NN_X86
+		static const kernel_table sse42{ IsaLevel::kSse42, "sse4.2", kernels_sse42::biasActivation, kernels_sse42::softmax,
+			kernels_sse42::sumLogComplement, kernels_sse42::axpy, kernels_sse42::convert, kernels_sse42::butterfly, kernels_sse42::complexMultiplyAdd,
+			kernels_sse42::correlate, kernels_sse42::maxUpdate, kernels_sse42::floatToHalf, kernels_sse42::halfToFloat, kernels_sse42::floatToBfloat16,
+			kernels_sse42::bfloat16ToFloat };
+		static const kernel_table avx2{ IsaLevel::kAvx2, "avx2", kernels_avx2::biasActivation, kernels_avx2::softmax,
+			kernels_avx2::sumLogComplement, kernels_avx2::axpy, kernels_avx2::convert, kernels_avx2::butterfly, kernels_avx2::complexMultiplyAdd,
+			kernels_avx2::correlate, kernels_avx2::maxUpdate, kernels_avx2::floatToHalf, kernels_avx2::halfToFloat, kernels_avx2::floatToBfloat16,
+			kernels_avx2::bfloat16ToFloat };
+		static const kernel_table avx512{ IsaLevel::kAvx512, "avx512", kernels_avx512::biasActivation, kernels_avx512::softmax,
+			kernels_avx512::sumLogComplement, kernels_avx512::axpy, kernels_avx512::convert, kernels_avx512::butterfly, kernels_avx512::complexMultiplyAdd,
+			kernels_avx512::correlate, kernels_avx512::maxUpdate, kernels_avx512::floatToHalf, kernels_avx512::halfToFloat,
+			cpuFeatures().avx512bf16 ? floatToBfloat16Avx512Bf16 : kernels_avx512::floatToBfloat16, kernels_avx512::bfloat16ToFloat };
+#endif
+		if (!isaSupported(isa))
+			throw std::runtime_error("Instruction set is not supported by this CPU");
+		switch (isa)
+		{
+#if NN_X86
+		case IsaLevel::kSse42: return sse42;
+		case IsaLevel::kAvx2: return avx2;
+		case IsaLevel::kAvx512: return avx512;
+#endif
+		default: return generic;
+		}
+	}
+
+	// the widest variant this CPU runs
+	IsaLevel bestIsa()
+	{
+		for (auto isa : { IsaLevel::kAvx512, IsaLevel::kAvx2, IsaLevel::kSse42 })
+			if (isaSupported(isa))
+				return isa;
+		return IsaLevel::kGeneric;
+	}
+
+	namespace
+	{
+		std::atomic<const kernel_table*>& kernelSetting()
+		{
+			static std::atomic<const kernel_table*> table(&kernels(bestIsa()));
+			return table;
+		}
+	}
+
+	// the kernels every caller goes through, the best variant unless setKernels() picked another one
+	const kernel_table& kernels() { return *kernelSetting().load(std::memory_order_relaxed); }
+	void setKernels(IsaLevel isa) { kernelSetting().store(&kernels(isa), std::memory_order_relaxed); }
+
+	// which variant every dispatched kernel runs
+	struct kernel_variant
+	{
+		std::string kernel;
+		std::string variant;
+	};
+
+	std::vector<kernel_variant> kernelVariants()
+	{
+		const std::string variant = kernels().name;
+#if NN_X86
+		const std::string storageVariant = kernels().floatToBfloat16 == floatToBfloat16Avx512Bf16 ? "avx512bf16" : variant;
+#else
+		const std::string storageVariant = variant;
+#endif
+		return {
+			{ "activations", variant },
+			{ "softmax", variant },
+			{ "cost", variant },
+			{ "convolution", variant },
+			{ "fft", variant },
+			{ "pooling", variant },
+			{ "storage", storageVariant },
+			{ "gather", variant },
+			{ "sgemm", sgemmKernel().name } };
+	}
+
+	// "activations: avx2, softmax: avx2, ..." for logs
+	std::string kernelReport()
+	{
+		std::string report;
+		for (const auto& v : kernelVariants())
+			report += (report.empty() ? "" : ", ") + v.kernel + ": " + v.variant;
+		return report;
+	}
+
+	// float goes through the dispatched kernels, double through the generic ones
+	void biasActivation(ActivationType type, size_t size, const float* bias, float* a, float* da) { kernels().biasActivation(type, size, bias, a, da); }
+	void biasActivation(ActivationType type, size_t size, const double* bias, double* a, double* da) { genericBiasActivation(type, size, bias, a, da); }
+	float softmax(size_t size, float* z) { return kernels().softmax(size, z); }
+	double softmax(size_t size, double* z) { return genericSoftmax(size, z); }
+	float sumLogComplement(size_t size, const float* a, float tiny) { return kernels().sumLogComplement(size, a, tiny); }
+	double sumLogComplement(size_t size, const double* a, double tiny) { return genericSumLogComplement(size, a, tiny); }
+	void axpy(size_t size, float alpha, const float* x, float* y) { kernels().axpy(size, alpha, x, y); }
+	void axpy(size_t size, double alpha, const double* x, double* y) { genericAxpy(size, alpha, x, y); }
+	void butterfly(size_t size, float wr, float wi, float* ar, float* ai, float* br, float* bi) { kernels().butterfly(size, wr, wi, ar, ai, br, bi); }
+	void butterfly(size_t size, double wr, double wi, double* ar, double* ai, double* br, double* bi) { genericButterfly(size, wr, wi, ar, ai, br, bi); }
+	void complexMultiplyAdd(size_t size, const float* ar, const float* ai, const float* br, const float* bi, float* cr, float* ci) { kernels().complexMultiplyAdd(size, ar, ai, br, bi, cr, ci); }
+	void complexMultiplyAdd(size_t size, const double* ar, const double* ai, const double* br, const double* bi, double* cr, double* ci) { genericComplexMultiplyAdd(size, ar, ai, br, bi, cr, ci); }
+	void correlate(size_t size, size_t taps, const float* kernel, const float* x, float* y) { kernels().correlate(size, taps, kernel, x, y); }
+	void correlate(size_t size, size_t taps, const double* kernel, const double* x, double* y) { genericCorrelate(size, taps, kernel, x, y); }
+	void maxUpdate(size_t size, const float* x, float first, float* y, float* positions) { kernels().maxUpdate(size, x, first, y, positions); }
+	void maxUpdate(size_t size, const double* x, double first, double* y, double* positions) { genericMaxUpdate(size, x, first, y, positions); }
+
+	// out = in rounded to a 16 bit storage type and back. double goes through float
+	void narrow(StorageType type, size_t size, const float* in, uint16_t* out)
+	{
+		if (type == StorageType::kFloat)
+			throw std::logic_error("Storage type isn't 16 bits wide");
+		(type == StorageType::kHalf ? kernels().floatToHalf : kernels().floatToBfloat16)(size, in, out);
+	}
+
+	void narrow(StorageType type, size_t size, const double* in, uint16_t* out)
+	{
+		if (type == StorageType::kFloat)
+			throw std::logic_error("Storage type isn't 16 bits wide");
+		for (size_t i = 0; i < size; ++i)
+			out[i] = type == StorageType::kHalf ? floatToHalf(float(in[i])) : floatToBfloat16(float(in[i]));
+	}
+
+	void widen(StorageType type, size_t size, const uint16_t* in, float* out)
+	{
+		if (type == StorageType::kFloat)
+			throw std::logic_error("Storage type isn't 16 bits wide");
+		(type == StorageType::kHalf ? kernels().halfToFloat : kernels().bfloat16ToFloat)(size, in, out);
+	}
+
+	void widen(StorageType type, size_t size, const uint16_t* in, double* out)
+	{
+		if (type == StorageType::kFloat)
+			throw std::logic_error("Storage type isn't 16 bits wide");
+		for (size_t i = 0; i < size; ++i)
+			out[i] = type == StorageType::kHalf ? halfToFloat(in[i]) : bfloat16ToFloat(in[i]);
+	}
+#endif
+}
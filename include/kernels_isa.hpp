@@ -0,0 +1,585 @@
+// kernels of one instruction set. kernels.hpp includes this once per variant with NN_KERNEL_ISA set to
+// 1 (SSE4.2), 2 (AVX2) or 3 (AVX-512) and NN_KERNEL_NAMESPACE naming the variant, everything here is
+// compiled for that instruction set. There is no include guard on purpose
+
+#if NN_KERNEL_ISA == 1
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse4.2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#endif
+#elif NN_KERNEL_ISA == 2
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2,fma,f16c")
+#endif
+#elif NN_KERNEL_ISA == 3
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f,avx2,fma,f16c"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma,f16c")
+#endif
+#endif
+
+namespace nn
+{
+	namespace NN_KERNEL_NAMESPACE
+	{
+		// the vector operations the kernels are written in
+#if NN_KERNEL_ISA == 1
+		using vec = __m128;
+		using ivec = __m128i;
+		const size_t kWidth = 4;
+		vec load(const float* p) { return _mm_loadu_ps(p); }
+		void store(float* p, vec v) { _mm_storeu_ps(p, v); }
+		vec set1(float v) { return _mm_set1_ps(v); }
+		vec add(vec a, vec b) { return _mm_add_ps(a, b); }
+		vec sub(vec a, vec b) { return _mm_sub_ps(a, b); }
+		vec mul(vec a, vec b) { return _mm_mul_ps(a, b); }
+		vec div(vec a, vec b) { return _mm_div_ps(a, b); }
+		vec fmadd(vec a, vec b, vec c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+		vec vmax(vec a, vec b) { return _mm_max_ps(a, b); }
+		vec vmin(vec a, vec b) { return _mm_min_ps(a, b); }
+		vec vfloor(vec a) { return _mm_floor_ps(a); }
+		vec vand(vec a, vec b) { return _mm_and_ps(a, b); }
+		vec vor(vec a, vec b) { return _mm_or_ps(a, b); }
+		// a > b ? t : f
+		vec selectGreater(vec a, vec b, vec t, vec f) { return _mm_blendv_ps(f, t, _mm_cmpgt_ps(a, b)); }
+		ivec toInt(vec a) { return _mm_cvttps_epi32(a); }
+		vec toFloat(ivec a) { return _mm_cvtepi32_ps(a); }
+		ivec seti(int v) { return _mm_set1_epi32(v); }
+		ivec addi(ivec a, ivec b) { return _mm_add_epi32(a, b); }
+		ivec subi(ivec a, ivec b) { return _mm_sub_epi32(a, b); }
+		ivec shiftLeft23(ivec a) { return _mm_slli_epi32(a, 23); }
+		ivec shiftRight23(ivec a) { return _mm_srli_epi32(a, 23); }
+		vec asFloat(ivec a) { return _mm_castsi128_ps(a); }
+		ivec asInt(vec a) { return _mm_castps_si128(a); }
+		float hsum(vec a)
+		{
+			a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+			return _mm_cvtss_f32(_mm_add_ss(a, _mm_shuffle_ps(a, a, 1)));
+		}
+		float hmax(vec a)
+		{
+			a = _mm_max_ps(a, _mm_movehl_ps(a, a));
+			return _mm_cvtss_f32(_mm_max_ss(a, _mm_shuffle_ps(a, a, 1)));
+		}
+		// 4 bytes widened to floats
+		vec loadBytes(const uint8_t* p)
+		{
+			int32_t bytes;
+			memcpy(&bytes, p, sizeof(bytes));
+			return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+		}
+		ivec andi(ivec a, ivec b) { return _mm_and_si128(a, b); }
+		ivec ori(ivec a, ivec b) { return _mm_or_si128(a, b); }
+		ivec shiftRight16(ivec a) { return _mm_srli_epi32(a, 16); }
+		ivec selectGreateri(ivec a, ivec b, ivec t, ivec f) { return _mm_blendv_epi8(f, t, _mm_cmpgt_epi32(a, b)); }
+		// 4 bfloat16 widened to floats, the low 16 bits of every lane stored
+		vec loadBfloat16(const uint16_t* p) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))), 16)); }
+		void storeLow16(uint16_t* p, ivec a) { _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi32(a, a)); }
+#elif NN_KERNEL_ISA == 2
+		using vec = __m256;
+		using ivec = __m256i;
+		const size_t kWidth = 8;
+		vec load(const float* p) { return _mm256_loadu_ps(p); }
+		void store(float* p, vec v) { _mm256_storeu_ps(p, v); }
+		vec set1(float v) { return _mm256_set1_ps(v); }
+		vec add(vec a, vec b) { return _mm256_add_ps(a, b); }
+		vec sub(vec a, vec b) { return _mm256_sub_ps(a, b); }
+		vec mul(vec a, vec b) { return _mm256_mul_ps(a, b); }
+		vec div(vec a, vec b) { return _mm256_div_ps(a, b); }
+		vec fmadd(vec a, vec b, vec c) { return _mm256_fmadd_ps(a, b, c); }
+		vec vmax(vec a, vec b) { return _mm256_max_ps(a, b); }
+		vec vmin(vec a, vec b) { return _mm256_min_ps(a, b); }
+		vec vfloor(vec a) { return _mm256_floor_ps(a); }
+		vec vand(vec a, vec b) { return _mm256_and_ps(a, b); }
+		vec vor(vec a, vec b) { return _mm256_or_ps(a, b); }
+		vec selectGreater(vec a, vec b, vec t, vec f) { return _mm256_blendv_ps(f, t, _mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+		ivec toInt(vec a) { return _mm256_cvttps_epi32(a); }
+		vec toFloat(ivec a) { return _mm256_cvtepi32_ps(a); }
+		ivec seti(int v) { return _mm256_set1_epi32(v); }
+		ivec addi(ivec a, ivec b) { return _mm256_add_epi32(a, b); }
+		ivec subi(ivec a, ivec b) { return _mm256_sub_epi32(a, b); }
+		ivec shiftLeft23(ivec a) { return _mm256_slli_epi32(a, 23); }
+		ivec shiftRight23(ivec a) { return _mm256_srli_epi32(a, 23); }
+		vec asFloat(ivec a) { return _mm256_castsi256_ps(a); }
+		ivec asInt(vec a) { return _mm256_castps_si256(a); }
+		float hsum(vec a)
+		{
+			__m128 h = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+			h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+			return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+		}
+		float hmax(vec a)
+		{
+			__m128 h = _mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+			h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+			return _mm_cvtss_f32(_mm_max_ss(h, _mm_shuffle_ps(h, h, 1)));
+		}
+		vec loadBytes(const uint8_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)))); }
+		ivec andi(ivec a, ivec b) { return _mm256_and_si256(a, b); }
+		ivec ori(ivec a, ivec b) { return _mm256_or_si256(a, b); }
+		ivec shiftRight16(ivec a) { return _mm256_srli_epi32(a, 16); }
+		ivec selectGreateri(ivec a, ivec b, ivec t, ivec f) { return _mm256_blendv_epi8(f, t, _mm256_cmpgt_epi32(a, b)); }
+		vec loadBfloat16(const uint16_t* p) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))), 16)); }
+		// packing works within 128 bit lanes, the low quarter of each lane holds its 4 values
+		void storeLow16(uint16_t* p, ivec a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(a, a), 0x08))); }
+		// IEEE half through F16C
+		vec loadHalf(const uint16_t* p) { return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+		void storeHalf(uint16_t* p, vec a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT)); }
+#elif NN_KERNEL_ISA == 3
+		using vec = __m512;
+		using ivec = __m512i;
+		const size_t kWidth = 16;
+		vec load(const float* p) { return _mm512_loadu_ps(p); }
+		void store(float* p, vec v) { _mm512_storeu_ps(p, v); }
+		vec set1(float v) { return _mm512_set1_ps(v); }
+		vec add(vec a, vec b) { return _mm512_add_ps(a, b); }
+		vec sub(vec a, vec b) { return _mm512_sub_ps(a, b); }
+		vec mul(vec a, vec b) { return _mm512_mul_ps(a, b); }
+		vec div(vec a, vec b) { return _mm512_div_ps(a, b); }
+		vec fmadd(vec a, vec b, vec c) { return _mm512_fmadd_ps(a, b, c); }
+		vec vmax(vec a, vec b) { return _mm512_max_ps(a, b); }
+		vec vmin(vec a, vec b) { return _mm512_min_ps(a, b); }
+		vec vfloor(vec a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC); }
+		// bitwise float operations need AVX512DQ, the integer ones don't
+		vec vand(vec a, vec b) { return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b))); }
+		vec vor(vec a, vec b) { return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a), _mm512_castps_si512(b))); }
+		vec selectGreater(vec a, vec b, vec t, vec f) { return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_GT_OQ), f, t); }
+		ivec toInt(vec a) { return _mm512_cvttps_epi32(a); }
+		vec toFloat(ivec a) { return _mm512_cvtepi32_ps(a); }
+		ivec seti(int v) { return _mm512_set1_epi32(v); }
+		ivec addi(ivec a, ivec b) { return _mm512_add_epi32(a, b); }
+		ivec subi(ivec a, ivec b) { return _mm512_sub_epi32(a, b); }
+		ivec shiftLeft23(ivec a) { return _mm512_slli_epi32(a, 23); }
+		ivec shiftRight23(ivec a) { return _mm512_srli_epi32(a, 23); }
+		vec asFloat(ivec a) { return _mm512_castsi512_ps(a); }
+		ivec asInt(vec a) { return _mm512_castps_si512(a); }
+		__m256 upperHalf(vec a) { return _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1)); }
+		float hsum(vec a)
+		{
+			const __m256 q = _mm256_add_ps(_mm512_castps512_ps256(a), upperHalf(a));
+			__m128 h = _mm_add_ps(_mm256_castps256_ps128(q), _mm256_extractf128_ps(q, 1));
+			h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+			return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+		}
+		float hmax(vec a)
+		{
+			const __m256 q = _mm256_max_ps(_mm512_castps512_ps256(a), upperHalf(a));
+			__m128 h = _mm_max_ps(_mm256_castps256_ps128(q), _mm256_extractf128_ps(q, 1));
+			h = _mm_max_ps(h, _mm_movehl_ps(h, h));
+			return _mm_cvtss_f32(_mm_max_ss(h, _mm_shuffle_ps(h, h, 1)));
+		}
+		vec loadBytes(const uint8_t* p) { return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)))); }
+		ivec andi(ivec a, ivec b) { return _mm512_and_si512(a, b); }
+		ivec ori(ivec a, ivec b) { return _mm512_or_si512(a, b); }
+		ivec shiftRight16(ivec a) { return _mm512_srli_epi32(a, 16); }
+		ivec selectGreateri(ivec a, ivec b, ivec t, ivec f) { return _mm512_mask_blend_epi32(_mm512_cmpgt_epi32_mask(a, b), f, t); }
+		vec loadBfloat16(const uint16_t* p) { return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))), 16)); }
+		void storeLow16(uint16_t* p, ivec a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_cvtepi32_epi16(a)); }
+		vec loadHalf(const uint16_t* p) { return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))); }
+		void storeHalf(uint16_t* p, vec a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_cvtps_ph(a, _MM_FROUND_TO_NEAREST_INT)); }
+#endif
+
+		// exp and log after Cephes, the same approximations Eigen uses, accurate to about 1 ulp in float
+		vec vexp(vec x)
+		{
+			x = vmin(vmax(x, set1(-88.3762626647949f)), set1(88.3762626647949f));
+			// exp(x) = 2^n * exp(r), n = round(x / ln 2)
+			const vec n = vfloor(fmadd(x, set1(1.44269504088896341f), set1(0.5f)));
+			x = sub(x, mul(n, set1(0.693359375f)));
+			x = sub(x, mul(n, set1(-2.12194440e-4f)));
+			vec y = set1(1.9875691500e-4f);
+			y = fmadd(y, x, set1(1.3981999507e-3f));
+			y = fmadd(y, x, set1(8.3334519073e-3f));
+			y = fmadd(y, x, set1(4.1665795894e-2f));
+			y = fmadd(y, x, set1(1.6666665459e-1f));
+			y = fmadd(y, x, set1(5.0000001201e-1f));
+			y = add(fmadd(y, mul(x, x), x), set1(1.0f));
+			return mul(y, asFloat(shiftLeft23(addi(toInt(n), seti(127)))));
+		}
+
+		// positive arguments only
+		vec vlog(vec x)
+		{
+			x = vmax(x, asFloat(seti(0x00800000)));
+			// x = m * 2^e with m in [0.5, 1)
+			vec e = add(toFloat(subi(shiftRight23(asInt(x)), seti(0x7f))), set1(1.0f));
+			x = vor(vand(x, asFloat(seti(~0x7f800000))), set1(0.5f));
+			// m below sqrt(1/2) is doubled and e decremented
+			const vec one = set1(1.0f);
+			const vec small = selectGreater(set1(0.707106781186547524f), x, x, set1(0.0f));
+			e = sub(e, selectGreater(set1(0.707106781186547524f), x, one, set1(0.0f)));
+			x = add(sub(x, one), small);
+			const vec z = mul(x, x);
+			vec y = set1(7.0376836292e-2f);
+			y = fmadd(y, x, set1(-1.1514610310e-1f));
+			y = fmadd(y, x, set1(1.1676998740e-1f));
+			y = fmadd(y, x, set1(-1.2420140846e-1f));
+			y = fmadd(y, x, set1(1.4249322787e-1f));
+			y = fmadd(y, x, set1(-1.6668057665e-1f));
+			y = fmadd(y, x, set1(2.0000714765e-1f));
+			y = fmadd(y, x, set1(-2.4999993993e-1f));
+			y = fmadd(y, x, set1(3.3333331174e-1f));
+			y = mul(mul(y, x), z);
+			y = fmadd(e, set1(-2.12194440e-4f), y);
+			y = sub(y, mul(z, set1(0.5f)));
+			return fmadd(e, set1(0.693359375f), add(x, y));
+		}
+
+		vec biased(const float* a, const float* bias, size_t i) { return bias ? add(load(a + i), load(bias + i)) : load(a + i); }
+
+		// a = f(a + bias) and, if da isn't null, da = f'(a) for one column, bias may be null
+		void biasActivation(ActivationType type, size_t size, const float* bias, float* a, float* da)
+		{
+			const vec zero = set1(0.0f);
+			const vec one = set1(1.0f);
+			size_t i = 0;
+			switch (type)
+			{
+			case ActivationType::kSigmoid:
+				for (; i + kWidth <= size; i += kWidth)
+				{
+					const vec y = div(one, add(one, vexp(sub(zero, biased(a, bias, i)))));
+					store(a + i, y);
+					if (da)
+						store(da + i, mul(y, sub(one, y)));
+				}
+				break;
+			case ActivationType::kRelu:
+				for (; i + kWidth <= size; i += kWidth)
+				{
+					const vec y = vmax(biased(a, bias, i), zero);
+					store(a + i, y);
+					if (da)
+						store(da + i, selectGreater(y, zero, one, zero));
+				}
+				break;
+			case ActivationType::kLRelu:
+			{
+				const vec slope = set1(kLReluSlope);
+				for (; i + kWidth <= size; i += kWidth)
+				{
+					const vec z = biased(a, bias, i);
+					const vec y = vmax(z, mul(z, slope));
+					store(a + i, y);
+					if (da)
+						store(da + i, selectGreater(y, zero, one, slope));
+				}
+				break;
+			}
+			case ActivationType::kTanh:
+			{
+				const vec two = set1(2.0f);
+				for (; i + kWidth <= size; i += kWidth)
+				{
+					const vec y = sub(div(two, add(one, vexp(mul(set1(-2.0f), biased(a, bias, i))))), one);
+					store(a + i, y);
+					if (da)
+						store(da + i, sub(one, mul(y, y)));
+				}
+				break;
+			}
+			default:
+				for (; i + kWidth <= size; i += kWidth)
+				{
+					store(a + i, biased(a, bias, i));
+					if (da)
+						store(da + i, one);
+				}
+				break;
+			}
+			// the tail as one zero padded vector
+			if (i < size)
+			{
+				float tailA[kWidth] = {}, tailBias[kWidth] = {}, tailDa[kWidth];
+				std::copy(a + i, a + size, tailA);
+				if (bias)
+					std::copy(bias + i, bias + size, tailBias);
+				biasActivation(type, kWidth, tailBias, tailA, tailDa);
+				std::copy(tailA, tailA + size - i, a + i);
+				if (da)
+					std::copy(tailDa, tailDa + size - i, da + i);
+			}
+		}
+
+		// z = exp(z - max) / sum(exp(z - max)), returns log(sum(exp(z)))
+		float softmax(size_t size, float* z)
+		{
+			// too short for a single vector
+			if (size < kWidth)
+				return genericSoftmax(size, z);
+			size_t i = kWidth;
+			vec m = load(z);
+			for (; i + kWidth <= size; i += kWidth)
+				m = vmax(m, load(z + i));
+			float maxCoeff = hmax(m);
+			for (; i < size; ++i)
+				maxCoeff = std::max(maxCoeff, z[i]);
+
+			const vec shift = set1(maxCoeff);
+			vec sums = set1(0.0f);
+			for (i = 0; i + kWidth <= size; i += kWidth)
+			{
+				const vec e = vexp(sub(load(z + i), shift));
+				store(z + i, e);
+				sums = add(sums, e);
+			}
+			float sum = hsum(sums);
+			for (; i < size; ++i)
+			{
+				z[i] = std::exp(z[i] - maxCoeff);
+				sum += z[i];
+			}
+
+			const vec scale = set1(1.0f / sum);
+			for (i = 0; i + kWidth <= size; i += kWidth)
+				store(z + i, mul(load(z + i), scale));
+			for (; i < size; ++i)
+				z[i] *= 1.0f / sum;
+			return maxCoeff + std::log(sum);
+		}
+
+		// sum of log(max(1 - a, tiny))
+		float sumLogComplement(size_t size, const float* a, float tiny)
+		{
+			const vec one = set1(1.0f);
+			const vec floor = set1(tiny);
+			vec sums = set1(0.0f);
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+				sums = add(sums, vlog(vmax(sub(one, load(a + i)), floor)));
+			// zero padding adds log(1) = 0
+			float tail[kWidth] = {};
+			std::copy(a + i, a + size, tail);
+			return hsum(add(sums, vlog(vmax(sub(one, load(tail)), floor))));
+		}
+
+		// y += alpha * x
+		void axpy(size_t size, float alpha, const float* x, float* y)
+		{
+			const vec scale = set1(alpha);
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+				store(y + i, fmadd(scale, load(x + i), load(y + i)));
+			// the tail stays in this function, calls into the generic code from here would run with the upper halves dirty
+			for (; i < size; ++i)
+				y[i] += alpha * x[i];
+		}
+
+		// radix-2 butterflies of the FFT on split complex rows: t = b * w, b = a - t, a = a + t
+		void butterfly(size_t size, float wr, float wi, float* ar, float* ai, float* br, float* bi)
+		{
+			const vec vr = set1(wr), vi = set1(wi);
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+			{
+				const vec xr = load(br + i), xi = load(bi + i);
+				const vec tr = sub(mul(xr, vr), mul(xi, vi)), ti = fmadd(xr, vi, mul(xi, vr));
+				const vec yr = load(ar + i), yi = load(ai + i);
+				store(br + i, sub(yr, tr));
+				store(bi + i, sub(yi, ti));
+				store(ar + i, add(yr, tr));
+				store(ai + i, add(yi, ti));
+			}
+			// the tail stays in this function, see axpy()
+			for (; i < size; ++i)
+			{
+				const float tr = br[i] * wr - bi[i] * wi, ti = br[i] * wi + bi[i] * wr;
+				br[i] = ar[i] - tr;
+				bi[i] = ai[i] - ti;
+				ar[i] += tr;
+				ai[i] += ti;
+			}
+		}
+
+		// c += a * b on split complex numbers, the products of spectra
+		void complexMultiplyAdd(size_t size, const float* ar, const float* ai, const float* br, const float* bi, float* cr, float* ci)
+		{
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+			{
+				const vec xr = load(ar + i), xi = load(ai + i), yr = load(br + i), yi = load(bi + i);
+				store(cr + i, sub(fmadd(xr, yr, load(cr + i)), mul(xi, yi)));
+				store(ci + i, fmadd(xr, yi, fmadd(xi, yr, load(ci + i))));
+			}
+			for (; i < size; ++i)
+			{
+				cr[i] += ar[i] * br[i] - ai[i] * bi[i];
+				ci[i] += ar[i] * bi[i] + ai[i] * br[i];
+			}
+		}
+
+		// y[i] += sum of kernel[t] * x[i + t], four vectors of outputs stay in registers over all taps
+		void correlate(size_t size, size_t taps, const float* kernel, const float* x, float* y)
+		{
+			size_t i = 0;
+			for (; i + 4 * kWidth <= size; i += 4 * kWidth)
+			{
+				vec s0 = load(y + i), s1 = load(y + i + kWidth), s2 = load(y + i + 2 * kWidth), s3 = load(y + i + 3 * kWidth);
+				for (size_t t = 0; t < taps; ++t)
+				{
+					const vec w = set1(kernel[t]);
+					const float* in = x + i + t;
+					s0 = fmadd(w, load(in), s0);
+					s1 = fmadd(w, load(in + kWidth), s1);
+					s2 = fmadd(w, load(in + 2 * kWidth), s2);
+					s3 = fmadd(w, load(in + 3 * kWidth), s3);
+				}
+				store(y + i, s0);
+				store(y + i + kWidth, s1);
+				store(y + i + 2 * kWidth, s2);
+				store(y + i + 3 * kWidth, s3);
+			}
+			for (; i + kWidth <= size; i += kWidth)
+			{
+				vec sum = load(y + i);
+				for (size_t t = 0; t < taps; ++t)
+					sum = fmadd(set1(kernel[t]), load(x + i + t), sum);
+				store(y + i, sum);
+			}
+			for (; i < size; ++i)
+			{
+				float sum = 0.0f;
+				for (size_t t = 0; t < taps; ++t)
+					sum += kernel[t] * x[i + t];
+				y[i] += sum;
+			}
+		}
+
+		// where x > y: y = x and positions = first + i, the positions count up a vector at a time
+		void maxUpdate(size_t size, const float* x, float first, float* y, float* positions)
+		{
+			float offsets[kWidth];
+			for (size_t j = 0; j < kWidth; ++j)
+				offsets[j] = float(j);
+			vec position = add(set1(first), load(offsets));
+			const vec step = set1(float(kWidth));
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+			{
+				const vec a = load(x + i), b = load(y + i);
+				store(positions + i, selectGreater(a, b, position, load(positions + i)));
+				store(y + i, selectGreater(a, b, a, b));
+				position = add(position, step);
+			}
+			for (; i < size; ++i)
+				if (x[i] > y[i])
+				{
+					y[i] = x[i];
+					positions[i] = first + float(i);
+				}
+		}
+
+		// out = in * scale, the uint8 to float decoding of samples
+		void convert(const uint8_t* in, size_t count, float* out, float scale)
+		{
+			const vec s = set1(scale);
+			size_t i = 0;
+			for (; i + kWidth <= count; i += kWidth)
+				store(out + i, mul(loadBytes(in + i), s));
+			for (; i < count; ++i)
+				out[i] = float(in[i]) * scale;
+		}
+
+		// bfloat16 of the floats: the upper halves rounded to nearest even, NaNs kept quiet instead of rounded to infinities
+		ivec roundBfloat16(vec a)
+		{
+			const ivec bits = asInt(a);
+			const ivec upper = shiftRight16(bits);
+			const ivec rounded = shiftRight16(addi(addi(bits, seti(0x7fff)), andi(upper, seti(1))));
+			return selectGreateri(andi(bits, seti(0x7fffffff)), seti(0x7f800000), ori(upper, seti(0x40)), rounded);
+		}
+
+		// the 16 bit storage conversions. Tails are padded to a whole vector, in place of scalar code
+		void floatToBfloat16(size_t size, const float* in, uint16_t* out)
+		{
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+				storeLow16(out + i, roundBfloat16(load(in + i)));
+			if (i < size)
+			{
+				float tail[kWidth] = {};
+				uint16_t result[kWidth];
+				for (size_t j = i; j < size; ++j)
+					tail[j - i] = in[j];
+				storeLow16(result, roundBfloat16(load(tail)));
+				for (size_t j = i; j < size; ++j)
+					out[j] = result[j - i];
+			}
+		}
+
+		void bfloat16ToFloat(size_t size, const uint16_t* in, float* out)
+		{
+			size_t i = 0;
+			for (; i + kWidth <= size; i += kWidth)
+				store(out + i, loadBfloat16(in + i));
+			if (i < size)
+			{
+				uint16_t tail[kWidth] = {};
+				float result[kWidth];
+				for (size_t j = i; j < size; ++j)
+					tail[j - i] = in[j];
+				store(result, loadBfloat16(tail));
+				for (size_t j = i; j < size; ++j)
+					out[j] = result[j - i];
+			}
+		}
+
+		// SSE4.2 has no half conversions, it rounds one value at a time
+		void floatToHalf(size_t size, const float* in, uint16_t* out)
+		{
+			size_t i = 0;
+#if NN_KERNEL_ISA >= 2
+			for (; i + kWidth <= size; i += kWidth)
+				storeHalf(out + i, load(in + i));
+			if (i < size)
+			{
+				float tail[kWidth] = {};
+				uint16_t result[kWidth];
+				for (size_t j = i; j < size; ++j)
+					tail[j - i] = in[j];
+				storeHalf(result, load(tail));
+				for (size_t j = i; j < size; ++j)
+					out[j] = result[j - i];
+			}
+#else
+			for (; i < size; ++i)
+				out[i] = nn::floatToHalf(in[i]);
+#endif
+		}
+
+		void halfToFloat(size_t size, const uint16_t* in, float* out)
+		{
+			size_t i = 0;
+#if NN_KERNEL_ISA >= 2
+			for (; i + kWidth <= size; i += kWidth)
+				store(out + i, loadHalf(in + i));
+			if (i < size)
+			{
+				uint16_t tail[kWidth] = {};
+				float result[kWidth];
+				for (size_t j = i; j < size; ++j)
+					tail[j - i] = in[j];
+				store(result, loadHalf(tail));
+				for (size_t j = i; j < size; ++j)
+					out[j] = result[j - i];
+			}
+#else
+			for (; i < size; ++i)
+				out[i] = nn::halfToFloat(in[i]);
+#endif
+		}
+	}
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
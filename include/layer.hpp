@@ -1,8 +1,19 @@
 #pragma once
 #include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
 #include "settings.hpp"
 #include "weight_initialization.hpp"
 #include "activations.hpp"
+#include "thread_pool.hpp"
+#include "gemm.hpp"
+#include "cost.hpp"
+#include "kernels.hpp"
+#include "im2col.hpp"
+#include "conv_engine.hpp"
+#include "pooling.hpp"
+#include "aligned_matrix.hpp"
 #if USE_EIGEN == 1
 #include <Eigen/Dense>
 #endif
@@ -13,190 +24,445 @@ namespace nn
 	{
 		kInput,
 		kFC,
-		kSoftmax
+		kSoftmax,
+		kConv,    // filters x patch weights and one bias per filter, see conv_geometry
+		kMaxPool, // maximum of every window per channel, no weights, see maxPool()
+		kAvgPool  // mean of every window per channel, no weights, see avgPool()
 	};
 
+	bool isPooling(LayerType type) { return type == LayerType::kMaxPool || type == LayerType::kAvgPool; }
+
 	// any layer has some amount of units and activation function
 #if USE_EIGEN == 1
 	class layer
 	{
 	public:
 		using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
+		using ConstRef = Eigen::Ref<const MatrixType>;
 
 		layer(LayerType type,
 			uint32_t unitsInLayer,
 			uint32_t unitsInPreviousLayer, 
 			ActivationType activationType, 
-			WeightInitializationType weightInitializationType) : 
+			WeightInitializationType weightInitializationType,
+			const conv_geometry& geometry = conv_geometry()) : 
 			m_type(type),
+			m_activationType(activationType),
 			m_unitsInLayer(unitsInLayer), 
-			m_unitsInPreviousLayer(unitsInPreviousLayer)
+			m_unitsInPreviousLayer(unitsInPreviousLayer),
+			m_geometry(geometry)
 		{
-			// set activation type
-			if (activationType == ActivationType::kSigmoid)
-			{
-				m_activation = activation<ActivationType::kSigmoid>;
-				m_activationDerivative = activation_derivative<ActivationType::kSigmoid>;
-			}
-			else if (activationType == ActivationType::kLinear)
-			{
-				m_activation = activation<ActivationType::kLinear>;
-				m_activationDerivative = activation_derivative<ActivationType::kLinear>;
-			}
-			else if (activationType == ActivationType::kTanh)
-			{
-				m_activation = activation<ActivationType::kTanh>;
-				m_activationDerivative = activation_derivative<ActivationType::kTanh>;
-			}
-			else if (activationType == ActivationType::kRelu)
-			{
-				m_activation = activation<ActivationType::kRelu>;
-				m_activationDerivative = activation_derivative<ActivationType::kRelu>;
-			}
-			else if (activationType == ActivationType::kLRelu)
+			if ((type == LayerType::kConv || isPooling(type)) && (!geometry.valid() || geometry.outputSize() != unitsInLayer || geometry.inputSize() != unitsInPreviousLayer))
+				throw std::logic_error("Convolution geometry doesn't match the layer");
+			if (isPooling(type))
 			{
-				m_activation = activation<ActivationType::kLRelu>;
-				m_activationDerivative = activation_derivative<ActivationType::kLRelu>;
+				checkPooling(geometry);
+				// max pooling keeps the positions of the maxima as reals, which count exactly up to 2^24 for floats
+				if (geometry.inputSize() > (size_t(1) << 24) || activationType != ActivationType::kNone)
+					throw std::logic_error("Pooling takes inputs up to 2^24 and no activation");
 			}
-
 			if (type != LayerType::kInput)
 			{
 				if (weightInitializationType == WeightInitializationType::kGaussian)
 				{
-					m_weight = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer()).unaryExpr(weight_initalization<WeightInitializationType::kZeros>());
-					m_nabla_w = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer());
-					m_bias = MatrixType::Zero(UnitsInLayer(), 1).unaryExpr(weight_initalization<WeightInitializationType::kZeros>());
-					m_nabla_b = MatrixType::Zero(UnitsInLayer(), 1);
+					m_weight = MatrixType::Zero(weightRows(), weightCols()).unaryExpr(weight_initalization<WeightInitializationType::kZeros>());
+					m_nabla_w = MatrixType::Zero(weightRows(), weightCols());
+					m_bias = MatrixType::Zero(biasRows(), 1).unaryExpr(weight_initalization<WeightInitializationType::kZeros>());
+					m_nabla_b = MatrixType::Zero(biasRows(), 1);
 				}
 				else if (weightInitializationType == WeightInitializationType::kSequentialDebug)
 				{
-					m_weight = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer()).unaryExpr(weight_initalization<WeightInitializationType::kSequentialDebug>());
-					m_nabla_w = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer());
-					m_bias = MatrixType::Zero(UnitsInLayer(), 1).unaryExpr(weight_initalization<WeightInitializationType::kSequentialDebug>());
-					m_nabla_b = MatrixType::Zero(UnitsInLayer(), 1);
+					m_weight = MatrixType::Zero(weightRows(), weightCols()).unaryExpr(weight_initalization<WeightInitializationType::kSequentialDebug>());
+					m_nabla_w = MatrixType::Zero(weightRows(), weightCols());
+					m_bias = MatrixType::Zero(biasRows(), 1).unaryExpr(weight_initalization<WeightInitializationType::kSequentialDebug>());
+					m_nabla_b = MatrixType::Zero(biasRows(), 1);
 				}
 				else if (weightInitializationType == WeightInitializationType::kUniform)
 				{
-					m_weight = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer()).unaryExpr(weight_initalization<WeightInitializationType::kUniform>());
-					m_nabla_w = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer());
-					m_bias = MatrixType::Zero(UnitsInLayer(), 1).unaryExpr(weight_initalization<WeightInitializationType::kUniform>());
-					m_nabla_b = MatrixType::Zero(UnitsInLayer(), 1);
+					m_weight = MatrixType::Zero(weightRows(), weightCols()).unaryExpr(weight_initalization<WeightInitializationType::kUniform>());
+					m_nabla_w = MatrixType::Zero(weightRows(), weightCols());
+					m_bias = MatrixType::Zero(biasRows(), 1).unaryExpr(weight_initalization<WeightInitializationType::kUniform>());
+					m_nabla_b = MatrixType::Zero(biasRows(), 1);
 				}
 				else if (weightInitializationType == WeightInitializationType::kGaussian)
 				{
-					m_weight = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer()).unaryExpr(weight_initalization<WeightInitializationType::kGaussian>());
-					m_nabla_w = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer());
-					m_bias = MatrixType::Zero(UnitsInLayer(), 1).unaryExpr(weight_initalization<WeightInitializationType::kGaussian>());
-					m_nabla_b = MatrixType::Zero(UnitsInLayer(), 1);
+					m_weight = MatrixType::Zero(weightRows(), weightCols()).unaryExpr(weight_initalization<WeightInitializationType::kGaussian>());
+					m_nabla_w = MatrixType::Zero(weightRows(), weightCols());
+					m_bias = MatrixType::Zero(biasRows(), 1).unaryExpr(weight_initalization<WeightInitializationType::kGaussian>());
+					m_nabla_b = MatrixType::Zero(biasRows(), 1);
 				}
 				else if (weightInitializationType == WeightInitializationType::kWeightedGaussian)
 				{
-					m_weight = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer()).unaryExpr(weight_initalization<WeightInitializationType::kWeightedGaussian>(UnitsInLayer()));
-					m_nabla_w = MatrixType::Zero(UnitsInLayer(), UnitsInPreviousLayer());
-					m_bias = MatrixType::Zero(UnitsInLayer(), 1).unaryExpr(weight_initalization<WeightInitializationType::kWeightedGaussian>(UnitsInLayer()));
-					m_nabla_b = MatrixType::Zero(UnitsInLayer(), 1);
+					m_weight = MatrixType::Zero(weightRows(), weightCols()).unaryExpr(weight_initalization<WeightInitializationType::kWeightedGaussian>(weightFan()));
+					m_nabla_w = MatrixType::Zero(weightRows(), weightCols());
+					m_bias = MatrixType::Zero(biasRows(), 1).unaryExpr(weight_initalization<WeightInitializationType::kWeightedGaussian>(weightFan()));
+					m_nabla_b = MatrixType::Zero(biasRows(), 1);
 				}
 			}
 		}
 
+		// convolution of the previous layer's output, unitsInPreviousLayer has to be geometry.inputSize()
+		layer(const conv_geometry& geometry, ActivationType activationType, WeightInitializationType weightInitializationType) :
+			layer(LayerType::kConv, uint32_t(geometry.outputSize()), uint32_t(geometry.inputSize()), activationType, weightInitializationType, geometry)
+		{
+		}
+
+		// max or average pooling of the previous layer's output, geometry.filters has to be geometry.channels.
+		// Pooling layers have no weights and no activation, they can't be the output layer
+		layer(LayerType type, const conv_geometry& geometry) :
+			layer(type, uint32_t(geometry.outputSize()), uint32_t(geometry.inputSize()), ActivationType::kNone, WeightInitializationType::kNone, geometry)
+		{
+			if (!isPooling(type))
+				throw std::logic_error("Layer type doesn't take a pooling geometry");
+		}
+
 		~layer() {}
 
-		void computeWeightedSum(const MatrixType& input) 
+		// copy of the weights and the settings without the training buffers. The 16 bit copy is taken again
+		// from the current weights, during training the one of this layer is as old as the last refresh
+		layer snapshot() const
 		{
-			m_z.noalias() = m_weight * input;
-			for (int i = 0; i < m_z.cols(); ++i)
-				m_z.col(i).noalias() += m_bias;
-			
+			layer result(m_type, m_unitsInLayer, m_unitsInPreviousLayer, m_activationType, WeightInitializationType::kNone, m_geometry);
+			result.m_weight = m_weight;
+			result.m_bias = m_bias;
+			result.m_convolutionAlgorithm = m_convolutionAlgorithm;
+			result.setWeightStorage(weightStorage());
+			return result;
 		}
-		void setActivations(const MatrixType& input) { m_a.noalias() = input; }
-		void computeActivations(const MatrixType& input) 
-		{ 
-			if (m_type == LayerType::kFC)
-				m_a.noalias() = input.unaryExpr(m_activation);
-			else if (m_type == LayerType::kSoftmax)
+
+		// reinitializes weights and biases on the pool, every column gets its own generator
+		// seeded from seed and the column index, so the result doesn't depend on the pool size
+		void initializeWeights(WeightInitializationType weightInitializationType, thread_pool& pool, uint32_t seed)
+		{
+			if (m_type == LayerType::kInput)
+				return;
+			m_weight.resize(weightRows(), weightCols());
+			m_bias.resize(biasRows(), 1);
+			m_nabla_w = MatrixType::Zero(weightRows(), weightCols());
+			m_nabla_b = MatrixType::Zero(biasRows(), 1);
+			const auto columns = size_t(m_weight.cols());
+			// the extra column is the bias
+			pool.parallel_for(0, columns + 1, 16, [&](size_t begin, size_t end, uint32_t)
 			{
-				if (m_a.rows() != input.rows() || m_a.cols() != input.cols())
-					m_a = MatrixType::Zero(input.rows(), input.cols());
-				MatrixType maxCol(m_a.rows(), 1);
-				for (int i = 0; i < input.cols(); ++i)
+				for (size_t c = begin; c < end; ++c)
 				{
-					maxCol.setConstant(input.maxCoeff()); // prevent softmax overflow
-					m_a.col(i).noalias() = (input.col(i) - maxCol).unaryExpr(&expf);
-					m_a.col(i) /= m_a.col(i).sum();
+					auto column = c < columns ? m_weight.col(c) : m_bias.col(0);
+					std::seed_seq seeds{ seed, uint32_t(c) };
+					std::mt19937 rng(seeds);
+					for (int i = 0; i < column.rows(); ++i)
+						column(i) = initialWeight(weightInitializationType, rng, c < columns ? c * column.rows() + i : i);
 				}
+			});
+			setWeightStorage(weightStorage());
+		}
+
+		// keeps a 16 bit copy of the weights of fully connected and softmax layers, which inference multiplies
+		// by at half the bytes read, see computeForward(). Training updates the weights in reals, this takes
+		// the copy again. Convolution weights are few and reused at every pixel, they stay in reals
+		void setWeightStorage(StorageType type)
+		{
+			if (type == StorageType::kFloat || m_type == LayerType::kInput || m_type == LayerType::kConv || isPooling(m_type))
+				m_storedWeight = stored_matrix();
+			else
+				storeMatrix(m_weight, type, m_storedWeight);
+		}
+		StorageType weightStorage() const { return m_storedWeight.empty() ? StorageType::kFloat : m_storedWeight.type; }
+
+		// singlethread version, keeps the activations and their derivatives in the layer.
+		// Softmax layers have no derivatives, the cost derivative goes straight to the logits
+		void computeForward(const ConstRef& input)
+		{
+			if (isPooling(m_type))
+			{
+				m_a.resize(UnitsInLayer(), input.cols());
+				m_da.resize(UnitsInLayer(), input.cols());
+				std::vector<real, Eigen::aligned_allocator<real>> scratch(scratchSize(uint32_t(input.cols()), false));
+				pool(input, m_a, m_da.data(), scratch.data(), scratch.size());
+				return;
 			}
+			if (m_type == LayerType::kConv)
+			{
+				m_a.resize(UnitsInLayer(), input.cols());
+				std::vector<real, Eigen::aligned_allocator<real>> packing(scratchSize(uint32_t(input.cols()), false));
+				product(input, m_a, packing.data(), packing.size());
+			}
+			else
+				m_a.noalias() = m_weight * input;
+			if (m_type != LayerType::kSoftmax)
+				m_da.resize(m_a.rows(), m_a.cols());
+			Eigen::Ref<MatrixType> da(m_da);
+			epilogue(m_a, &da);
 		}
-		void computeActivationDerivatives(const MatrixType& input) 
-		{ 
-			if (m_type == LayerType::kFC)
-				m_da.noalias() = input.unaryExpr(m_activationDerivative);
-			else if (m_type == LayerType::kSoftmax)
-				m_da = MatrixType::Ones(m_a.rows(), m_a.cols());
+
+		// allocation-free version writing into caller buffers: a = f(W * input + b), da = f'(W * input + b),
+		// da is left untouched by softmax layers. Max pooling layers keep the positions of their maxima in da
+		// instead, see computeInputGradient(). packing is scratch for the product, see gemm()
+		void computeForward(const ConstRef& input, Eigen::Ref<MatrixType> a, Eigen::Ref<MatrixType> da, real* packing, size_t packingSize) const
+		{
+			if (isPooling(m_type))
+			{
+				if (da.outerStride() != da.rows())
+					throw std::logic_error("Pooling positions have to be contiguous");
+				pool(input, a, da.data(), packing, packingSize);
+				return;
+			}
+			product(input, a, packing, packingSize);
+			epilogue(a, &da);
 		}
 
-		MatrixType computeWeightedSumExplicit(const MatrixType& input)
+		// inference version, the same without the derivatives. storedWeights multiplies by the copy
+		// setWeightStorage() keeps, if there is one
+		void computeForward(const ConstRef& input, Eigen::Ref<MatrixType> a, real* packing, size_t packingSize, bool storedWeights = false) const
 		{
-			MatrixType result = m_weight * input;
-			for (int i = 0; i < result.cols(); ++i)
-				result.col(i).noalias() += m_bias;
-			return result;
+			if (isPooling(m_type))
+			{
+				pool(input, a, nullptr, packing, packingSize);
+				return;
+			}
+			product(input, a, packing, packingSize, storedWeights);
+			epilogue(a, nullptr);
+		}
+
+		// z = W * input + b without the activation, for output stages fusing it with the cost
+		void computeLogits(const ConstRef& input, Eigen::Ref<MatrixType> z, real* packing, size_t packingSize, bool storedWeights = false) const
+		{
+			if (isPooling(m_type))
+				throw std::logic_error("Pooling layers can't be the output layer");
+			product(input, z, packing, packingSize, storedWeights);
+			if (m_type != LayerType::kConv)
+				z.colwise() += m_bias.col(0);
+		}
+
+		// nablaW += delta * input^T summed over the batch, delta being the error at the outputs of the layer
+		void computeWeightGradient(const ConstRef& input, const ConstRef& delta, Eigen::Ref<MatrixType> nablaW, real* packing, size_t packingSize) const
+		{
+			if (isPooling(m_type))
+				return;
+			if (m_type != LayerType::kConv)
+			{
+				gemm(real(1.0), delta, false, input, true, real(1.0), nablaW, packing, packingSize);
+				return;
+			}
+			// per sample: nablaW += delta^T * im2col(input) with delta as pixels x filters
+			const auto& g = m_geometry;
+			const size_t pixels = g.pixels(), columnsSize = gemm_blocking::aligned(pixels * g.patchSize());
+			real* columns = scratch(packing, packingSize);
+			for (MatrixType::Index n = 0; n < input.cols(); ++n)
+			{
+				im2col(g, input.col(n).data(), columns);
+				backend().gemm(g.filters, g.patchSize(), pixels, real(1.0), delta.col(n).data(), pixels, true,
+					columns, pixels, false, real(1.0), nablaW.data(), size_t(nablaW.outerStride()), packing + columnsSize, packingSize - columnsSize);
+			}
 		}
 
-		MatrixType computeActivationsExplicit(const MatrixType& input)
+		// previous = W^T * delta, the error at the inputs of the layer. Max pooling scatters delta to the
+		// positions computeForward() left in place of the derivatives, units x samples, average pooling
+		// spreads it over the windows
+		void computeInputGradient(const ConstRef& delta, Eigen::Ref<MatrixType> previous, real* packing, size_t packingSize, const real* positions = nullptr) const
 		{
-			MatrixType result;
-			if (m_type == LayerType::kFC)
-				result.noalias() = input.unaryExpr(m_activation);
-			else if (m_type == LayerType::kSoftmax)
+			// pooling and col2im add to previous, the product of the other layers overwrites it
+			if (isPooling(m_type) || m_type == LayerType::kConv)
+				previous.setZero();
+			if (isPooling(m_type))
 			{
-				if (result.rows() != input.rows() || result.cols() != input.cols())
-					result = MatrixType::Zero(input.rows(), input.cols());
-				MatrixType maxCol(result.rows(), 1);
-				for (int i = 0; i < input.cols(); ++i)
+				if (m_type == LayerType::kMaxPool && !positions)
+					throw std::logic_error("Max pooling takes the positions of the forward pass");
+				for (MatrixType::Index n = 0; n < delta.cols(); ++n)
 				{
-					maxCol.setConstant(input.maxCoeff()); // prevent softmax overflow
-					result.col(i).noalias() = (input.col(i) - maxCol).unaryExpr(&expf);
-					result.col(i) /= result.col(i).sum();
+					if (m_type == LayerType::kMaxPool)
+						maxPoolBackward(m_geometry, delta.col(n).data(), positions + n * UnitsInLayer(), previous.col(n).data());
+					else
+						avgPoolBackward(m_geometry, delta.col(n).data(), previous.col(n).data());
 				}
+				return;
+			}
+			if (m_type != LayerType::kConv)
+			{
+				gemm(real(1.0), m_weight, true, delta, false, real(0.0), previous, packing, packingSize);
+				return;
+			}
+			// per sample: col2im(delta * W) with delta as pixels x filters
+			const auto& g = m_geometry;
+			const size_t pixels = g.pixels(), columnsSize = gemm_blocking::aligned(pixels * g.patchSize());
+			real* columns = scratch(packing, packingSize);
+			for (MatrixType::Index n = 0; n < delta.cols(); ++n)
+			{
+				backend().gemm(pixels, g.patchSize(), g.filters, real(1.0), delta.col(n).data(), pixels, false,
+					m_weight.data(), size_t(m_weight.outerStride()), false, real(0.0), columns, pixels, packing + columnsSize, packingSize - columnsSize);
+				col2im(g, columns, previous.col(n).data());
 			}
-			return result;
 		}
-		MatrixType computeActivationDerivativesExplicit(const MatrixType& input)
+
+		// nablaB += the bias gradient of one sample, given its error at the outputs of the layer
+		void accumulateBiasGradient(const ConstRef& delta, Eigen::Ref<MatrixType> nablaB) const
 		{
-			MatrixType result;
-			if (m_type == LayerType::kFC)
-				result.noalias() = input.unaryExpr(m_activationDerivative);
-			else if (m_type == LayerType::kSoftmax)
-				result = MatrixType::Ones(input.rows(), input.cols());
-			return result;
+			if (isPooling(m_type))
+				return;
+			if (m_type != LayerType::kConv)
+			{
+				nablaB += delta;
+				return;
+			}
+			const auto pixels = MatrixType::Index(m_geometry.pixels());
+			for (MatrixType::Index c = 0; c < nablaB.rows(); ++c)
+				nablaB(c, 0) += delta.block(c * pixels, 0, pixels, 1).sum();
+		}
+
+		// reals of the packing buffer the forward pass and, with backward, the gradients of a batch take
+		size_t scratchSize(uint32_t batchSize, bool backward) const
+		{
+			if (m_type == LayerType::kInput)
+				return 0;
+			if (isPooling(m_type))
+				return poolingScratchSize(m_geometry);
+			if (m_type != LayerType::kConv)
+			{
+				size_t size = gemmPackingSize(UnitsInLayer(), batchSize, UnitsInPreviousLayer());
+				if (!m_storedWeight.empty())
+					size = std::max(size, storedGemmPackingSize(UnitsInLayer(), batchSize, UnitsInPreviousLayer()));
+				if (backward)
+					size = std::max({ size, gemmPackingSize(UnitsInLayer(), UnitsInPreviousLayer(), batchSize), gemmPackingSize(UnitsInPreviousLayer(), batchSize, UnitsInLayer()) });
+				return size;
+			}
+			// the forward pass takes what its algorithm does, the gradients the columns of one sample followed by the packing of their products
+			const auto& g = m_geometry;
+			const size_t size = convolutionScratchSize(g, convolutionAlgorithm());
+			if (!backward)
+				return size;
+			return std::max(size, gemm_blocking::aligned(g.pixels() * g.patchSize()) +
+				std::max(gemmPackingSize(g.filters, g.patchSize(), g.pixels()), gemmPackingSize(g.pixels(), g.patchSize(), g.filters)));
 		}
 
+		// algorithm of the forward pass of a convolution, kAuto picks one from the geometry. The gradients always go through im2col
+		void setConvolutionAlgorithm(ConvolutionAlgorithm algorithm)
+		{
+			if ((winogradTile(algorithm) && (m_geometry.kernelSize != 3 || m_geometry.stride != 1)) || (algorithm == ConvolutionAlgorithm::kFft && m_geometry.stride != 1))
+				throw std::logic_error("Convolution algorithm doesn't take the geometry");
+			m_convolutionAlgorithm = algorithm;
+		}
+		ConvolutionAlgorithm convolutionAlgorithm() const
+		{
+			return m_convolutionAlgorithm == ConvolutionAlgorithm::kAuto ? selectConvolutionAlgorithm(m_geometry) : m_convolutionAlgorithm;
+		}
 
-		const MatrixType& getWeightedSum() const { return m_z; }
 		const MatrixType& getActivations() const { return m_a; }
 		const MatrixType& getActivationDerivatives() const { return m_da; }
-		const MatrixType& getWeights() const { return m_weight; }
-		MatrixType& getWeights() { return m_weight; }
-		MatrixType& getBias() { return m_bias; }
+		const aligned_matrix& getWeights() const { return m_weight; }
+		aligned_matrix& getWeights() { return m_weight; }
+		aligned_matrix& getBias() { return m_bias; }
 		MatrixType& getNablaB() { return m_nabla_b; }
 		MatrixType& getNablaW() { return m_nabla_w; }
 
+		LayerType type() const { return m_type; }
+		const conv_geometry& geometry() const { return m_geometry; }
+		// weights are units x inputs, filters x patch for convolutions, none for pooling. Biases are per unit or per filter
+		uint32_t weightRows() const { return isPooling(m_type) ? 0 : m_type == LayerType::kConv ? m_geometry.filters : UnitsInLayer(); }
+		uint32_t weightCols() const { return isPooling(m_type) ? 0 : m_type == LayerType::kConv ? uint32_t(m_geometry.patchSize()) : UnitsInPreviousLayer(); }
+		uint32_t biasRows() const { return weightRows(); }
 		uint32_t UnitsInLayer() const { return m_unitsInLayer; }
 		uint32_t UnitsInPreviousLayer() const { return m_unitsInPreviousLayer; }
 	private:
+		// a = W * input, for convolutions a = conv(input, W) + b one sample at a time. Winograd and the FFT
+		// transform the filters once per batch into the start of the packing buffer, the samples share them
+		void product(const ConstRef& input, Eigen::Ref<MatrixType> a, real* packing, size_t packingSize, bool storedWeights = false) const
+		{
+			if (m_type != LayerType::kConv)
+			{
+				if (storedWeights && !m_storedWeight.empty())
+					gemm(real(1.0), m_storedWeight, false, input, false, real(0.0), a, packing, packingSize);
+				else
+					gemm(real(1.0), m_weight, false, input, false, real(0.0), a, packing, packingSize);
+				return;
+			}
+			const auto& g = m_geometry;
+			const size_t pixels = g.pixels(), ldw = size_t(m_weight.outerStride());
+			if (input.rows() != MatrixType::Index(g.inputSize()) || a.rows() != MatrixType::Index(g.outputSize()) || a.cols() != input.cols())
+				throw std::logic_error("Convolution dimensions mismatch");
+			const ConvolutionAlgorithm algorithm = convolutionAlgorithm();
+			if (packingSize < convolutionScratchSize(g, algorithm))
+				throw std::logic_error("Convolution scratch buffer is too small");
+			const size_t filterSize = convolutionFilterSize(g, algorithm);
+			const size_t offset = filterSize ? gemm_blocking::aligned(filterSize) : 0;
+			transformFilters(g, algorithm, m_weight.data(), ldw, packing);
+			for (MatrixType::Index n = 0; n < input.cols(); ++n)
+			{
+				// outputs of a sample are pixels x filters, every filter starts at its bias
+				real* output = a.col(n).data();
+				for (uint32_t c = 0; c < g.filters; ++c)
+					std::fill(output + c * pixels, output + (c + 1) * pixels, m_bias(c, 0));
+				convolveTransformed(g, algorithm, m_weight.data(), ldw, packing, input.col(n).data(), output, packing + offset, packingSize - offset);
+			}
+		}
+
+		// a = the pooled windows one sample at a time, positions of the maxima go to positions if it isn't null
+		void pool(const ConstRef& input, Eigen::Ref<MatrixType> a, real* positions, real* scratch, size_t scratchSize) const
+		{
+			const auto& g = m_geometry;
+			if (input.rows() != MatrixType::Index(g.inputSize()) || a.rows() != MatrixType::Index(g.outputSize()) || a.cols() != input.cols())
+				throw std::logic_error("Pooling dimensions mismatch");
+			if (scratchSize < poolingScratchSize(g))
+				throw std::logic_error("Pooling scratch buffer is too small");
+			for (MatrixType::Index n = 0; n < input.cols(); ++n)
+			{
+				if (m_type == LayerType::kMaxPool)
+					maxPool(g, input.col(n).data(), a.col(n).data(), positions ? positions + n * g.outputSize() : nullptr, scratch);
+				else
+					avgPool(g, input.col(n).data(), a.col(n).data(), scratch);
+			}
+		}
+
+		// the im2col columns of one sample, checked against the size of the packing buffer
+		real* scratch(real* packing, size_t packingSize) const
+		{
+			if (gemm_blocking::aligned(m_geometry.pixels() * m_geometry.patchSize()) > packingSize)
+				throw std::logic_error("Convolution scratch buffer is too small");
+			return packing;
+		}
+
+		// fan of the weighted gaussian initialization
+		uint32_t weightFan() const { return m_type == LayerType::kConv ? weightCols() : UnitsInLayer(); }
+
+		// fused epilogue of the product: a = f(a + b) and, if da is given, da = f'(a). It runs one column
+		// at a time through the dispatched kernel, so every column stays in cache between the steps.
+		// Convolutions have their bias added by the product already
+		void epilogue(Eigen::Ref<MatrixType> a, Eigen::Ref<MatrixType>* da) const
+		{
+			if (m_type == LayerType::kSoftmax)
+			{
+				a.colwise() += m_bias.col(0);
+				softmax_cross_entropy(a, nullptr, nullptr);
+				return;
+			}
+			for (MatrixType::Index i = 0; i < a.cols(); ++i)
+				biasActivation(m_activationType, size_t(a.rows()), m_type == LayerType::kConv ? nullptr : m_bias.data(), a.col(i).data(), da ? da->col(i).data() : nullptr);
+		}
+
+		real initialWeight(WeightInitializationType weightInitializationType, std::mt19937& rng, size_t index) const
+		{
+			switch (weightInitializationType)
+			{
+			case WeightInitializationType::kGaussian: return weight_initalization<WeightInitializationType::kGaussian>()(rng);
+			case WeightInitializationType::kWeightedGaussian: return weight_initalization<WeightInitializationType::kWeightedGaussian>(weightFan())(rng);
+			case WeightInitializationType::kUniform: return weight_initalization<WeightInitializationType::kUniform>()(rng);
+			case WeightInitializationType::kSequentialDebug: return real(index);
+			default: return real(0.0);
+			}
+		}
+
 		LayerType m_type;
+		ActivationType m_activationType;
 		uint32_t m_unitsInLayer;
 		uint32_t m_unitsInPreviousLayer;
-		MatrixType m_z;
+		conv_geometry m_geometry;
+		ConvolutionAlgorithm m_convolutionAlgorithm = ConvolutionAlgorithm::kAuto;
 		MatrixType m_a;
 		MatrixType m_da;
 
-		MatrixType m_weight;
+		aligned_matrix m_weight;
+		stored_matrix m_storedWeight;
 		MatrixType m_nabla_w;
-		MatrixType m_bias;
+		aligned_matrix m_bias;
 		MatrixType m_nabla_b;
-		ActivationFunction m_activation = nullptr;
-		ActivationFunction m_activationDerivative = nullptr;
 	};
 #endif
 }
\ No newline at end of file
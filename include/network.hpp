@@ -1,12 +1,38 @@
 #pragma once
 #include <vector>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
 #include "cost.hpp"
+#include "dataset.hpp"
+#include "pipeline.hpp"
+#include "thread_pool.hpp"
 #include "layer.hpp"
+#include "workspace.hpp"
 #include "activations.hpp"
 
 namespace nn
 {
+	// how psgd workers apply their gradients
+	enum class UpdateType
+	{
+		kLocked,      // every batch is applied under a global lock
+		kHogwild,     // every batch is applied without a global lock, block by block
+		kSynchronous, // every batch is split between the workers, the gradients are summed and applied once
+		kWavefront    // batches run one after another, every layer is updated on another worker as soon as its
+		              // gradients are final while backprop goes on, the next forward pass waits per layer
+	};
+
+	struct psgd_results
+	{
+		size_t updates;
+		// updates computed from weights which other workers changed before they were applied
+		size_t staleUpdates;
+	};
+
 	struct evaluate_results
 	{
 		real accuracy;
@@ -29,8 +55,66 @@ namespace nn
 			return m_layers.back();
 		}
 
+		// convolution of the previous layer's output seen as geometry.channels images of geometry.height x geometry.width
+		Layer& addLayer(const conv_geometry& geometry, ActivationType activationType, WeightInitializationType weightInitializationType)
+		{
+			if (m_layers.empty() || m_layers.back().UnitsInLayer() != geometry.inputSize())
+				throw std::logic_error("Convolution input doesn't match the previous layer");
+			m_layers.push_back(layer(geometry, activationType, weightInitializationType));
+			return m_layers.back();
+		}
+
+		// kMaxPool or kAvgPool of the previous layer's output, geometry.filters has to be geometry.channels
+		Layer& addLayer(LayerType type, const conv_geometry& geometry)
+		{
+			if (m_layers.empty() || m_layers.back().UnitsInLayer() != geometry.inputSize())
+				throw std::logic_error("Pooling input doesn't match the previous layer");
+			m_layers.push_back(layer(type, geometry));
+			return m_layers.back();
+		}
+
+		// pool used by psgd and evaluate, shared by copies of the network and created on first use
+		thread_pool& threadPool() const
+		{
+			if (!m_pool)
+				m_pool = std::make_shared<thread_pool>();
+			return *m_pool;
+		}
+		void setThreadPool(const std::shared_ptr<thread_pool>& pool) { m_pool = pool; }
+
+		// 16 bit copies of the weights of the fully connected layers, which infer() and evaluate() multiply by.
+		// Training updates the weights in reals and takes the copies again when it returns, snapshot() takes its
+		// own from the weights as they are
+		void setWeightStorage(StorageType type)
+		{
+			for (auto& l : m_layers)
+				l.setWeightStorage(type);
+		}
+
+		// reinitializes all weights in parallel, reproducible for a given seed
+		void initializeWeights(WeightInitializationType weightInitializationType, uint32_t seed = 0)
+		{
+			for (size_t i = 1; i < m_layers.size(); ++i)
+				m_layers[i].initializeWeights(weightInitializationType, threadPool(), seed + uint32_t(i) * 0x9E3779B9u);
+		}
+
+		// copy of the weights and the settings without the training buffers, shares the thread pool
+		network snapshot() const
+		{
+			network result;
+			threadPool();
+			result.m_pool = m_pool;
+			result.m_costType = m_costType;
+			result.m_cost = m_cost;
+			result.m_cost_derivative = m_cost_derivative;
+			for (const auto& l : m_layers)
+				result.m_layers.push_back(l.snapshot());
+			return result;
+		}
+
 		void setCostFunction(CostType type)
 		{
+			m_costType = type;
 			if (type == CostType::kQuadratic)
 			{
 				m_cost = cost<CostType::kQuadratic>;
@@ -44,116 +128,194 @@ namespace nn
 		}
 
 		// singlethread version
-		Layer::MatrixType feedforward(const Layer::MatrixType& input)
+		Layer::MatrixType feedforward(const Layer::ConstRef& input)
 		{
-			m_layers[0].setActivations(input);
+			// backprop takes the weight gradient of the first layer from the input, it is kept since the caller's view may be gone by then
+			m_input = input;
 			for (size_t i = 1; i < m_layers.size(); ++i)
-			{
-				auto& l = m_layers[i];
-				l.computeWeightedSum(m_layers[i - 1].getActivations());
-				l.computeActivations(l.getWeightedSum());
-				l.computeActivationDerivatives(l.getWeightedSum());
-			}
+				m_layers[i].computeForward(layerInput(i));
 			return m_layers[m_layers.size() - 1].getActivations();
 		}
 
-		// multithread version
-		void feedforward(const Layer::MatrixType& input, 
-			std::vector<Layer::MatrixType>& activations, 
-			std::vector<Layer::MatrixType>& activationDerivatives)
+		// multithread version, allocation-free: activations and derivatives go to the workspace.
+		// A softmax output trained with cross-entropy is left as logits, backprop fuses the softmax with the cost
+		void feedforward(const Layer::ConstRef& input, workspace& ws) const
 		{
-			MatrixType in = input;
-			activations.push_back(in);
-			activationDerivatives.push_back(MatrixType());
+			feedforward(input, ws, [](size_t) {});
+		}
+
+		// beforeLayer(i) is called before the i-th layer reads its weights
+		template <typename BeforeLayer>
+		void feedforward(const Layer::ConstRef& input, workspace& ws, const BeforeLayer& beforeLayer) const
+		{
+			const auto cols = input.cols();
 			for (size_t i = 1; i < m_layers.size(); ++i)
 			{
-				auto& l = m_layers[i];
-				in = l.computeWeightedSumExplicit(in);
-				in = l.computeActivationsExplicit(in);
-				activations.push_back(in);
-				activationDerivatives.push_back(l.computeActivationDerivativesExplicit(in));
+				beforeLayer(i);
+				const auto layerInput = i == 1 ? input : Layer::ConstRef(ws.activations(i - 1, cols));
+				auto activations = ws.activations(i, cols);
+				if (i == m_layers.size() - 1 && fusedOutput())
+					m_layers[i].computeLogits(layerInput, activations, ws.packing(), ws.packingSize());
+				else if (m_layers[i].type() == LayerType::kSoftmax)
+					m_layers[i].computeForward(layerInput, activations, ws.packing(), ws.packingSize());
+				else
+					m_layers[i].computeForward(layerInput, activations, ws.derivatives(i, cols), ws.packing(), ws.packingSize());
+			}
+		}
+
+		// inference only: no derivatives, activations ping-pong between the two buffers of the workspace.
+		// The network isn't modified, so any number of threads can run it at once with their own workspaces.
+		// With labels the cost of the batch is added to cost, fused into the softmax of a cross-entropy output
+		inference_workspace::MatrixMap infer(const Layer::ConstRef& input, inference_workspace& ws, const uint8_t* labels = nullptr, real* cost = nullptr) const
+		{
+			const auto cols = input.cols();
+			const size_t last = m_layers.size() - 1;
+			for (size_t i = 1; i <= last; ++i)
+			{
+				const auto layerInput = i == 1 ? input : Layer::ConstRef(ws.buffer(i % 2, m_layers[i - 1].UnitsInLayer(), cols));
+				auto output = ws.buffer((i - 1) % 2, m_layers[i].UnitsInLayer(), cols);
+				if (i == last && labels && fusedOutput())
+				{
+					m_layers[i].computeLogits(layerInput, output, ws.packing(), ws.packingSize(), true);
+					*cost += softmax_cross_entropy(output, labels, nullptr);
+					return output;
+				}
+				m_layers[i].computeForward(layerInput, output, ws.packing(), ws.packingSize(), true);
 			}
+			// layer i wrote to buffer (i - 1) % 2
+			auto output = ws.buffer((last - 1) % 2, m_layers.back().UnitsInLayer(), cols);
+			if (labels)
+				*cost += m_cost(output, labels);
+			return output;
+		}
+
+		// same as above with a workspace of its own
+		Layer::MatrixType infer(const Layer::ConstRef& input) const
+		{
+			inference_workspace ws(m_layers, uint32_t(input.cols()));
+			return infer(input, ws);
 		}
 
 		// singlethread version
 		void backprop(const std::vector<uint8_t>& label_batch)
 		{
-			// make one-hot label out of single uint8_t
+			checkOutputLayer();
 			auto& outputLayer = m_layers.back();
-			MatrixType labelOneHot = MatrixType::Zero(outputLayer.UnitsInLayer(), outputLayer.getActivations().cols());
-			for (int i = 0; i < labelOneHot.cols(); ++i)
-				labelOneHot(label_batch[i], i) = real(1.0);
-			// compute delta
-			MatrixType delta = m_cost_derivative(outputLayer.getActivations(), labelOneHot).array() * outputLayer.getActivationDerivatives().array();
-			if (outputLayer.getNablaB().cols() != delta.cols())
-				outputLayer.getNablaB() = MatrixType::Zero(delta.rows(), delta.cols());
-			outputLayer.getNablaB().noalias() += delta;
-			outputLayer.getNablaW().noalias() += delta * m_layers[m_layers.size() - 2].getActivations().transpose();
-
-			for (size_t i = m_layers.size() - 2; i > 0; --i)
+			// compute delta, softmax outputs take the cost derivative as is
+			MatrixType delta(outputLayer.getActivations().rows(), outputLayer.getActivations().cols());
+			m_cost_derivative(outputLayer.getActivations(), label_batch.data(), delta);
+			if (outputLayer.type() != LayerType::kSoftmax)
+				delta.array() *= outputLayer.getActivationDerivatives().array();
+			std::vector<real, Eigen::aligned_allocator<real>> packing;
+			for (size_t i = m_layers.size() - 1; i > 0; --i)
 			{
-				const auto& nextLayer = m_layers[i + 1];
 				auto& layer = m_layers[i];
-				const auto& prevLayer = m_layers[i - 1];
-				delta = nextLayer.getWeights().transpose() * delta;
-				delta = delta.array() * layer.getActivationDerivatives().array();
-				// resize nabla-b to match the batch size
-				if (layer.getNablaB().cols() != delta.cols())
-					layer.getNablaB() = MatrixType::Zero(delta.rows(), delta.cols());
-				layer.getNablaB() += delta;
-				layer.getNablaW() += delta * prevLayer.getActivations().transpose();
+				if (i < m_layers.size() - 1)
+				{
+					MatrixType previous(layer.UnitsInLayer(), delta.cols());
+					m_layers[i + 1].computeInputGradient(delta, previous, packing.data(), packing.size(), m_layers[i + 1].getActivationDerivatives().data());
+					// pooling layers pass the error on as it is
+					if (isPooling(layer.type()))
+						delta = previous;
+					else
+						delta = previous.array() * layer.getActivationDerivatives().array();
+				}
+				packing.resize(layer.scratchSize(uint32_t(delta.cols()), true));
+				for (MatrixType::Index k = 0; k < delta.cols(); ++k)
+					layer.accumulateBiasGradient(delta.col(k), layer.getNablaB());
+				layer.computeWeightGradient(layerInput(i), delta, layer.getNablaW(), packing.data(), packing.size());
 			}
 		}
 
-		// multithread version
-		void backprop(const std::vector<uint8_t>& label_batch,
-			const std::vector<Layer::MatrixType>& activations,
-			const std::vector<Layer::MatrixType>& activationDerivatives,
-			std::vector<Layer::MatrixType>& nabla_w,
-			std::vector<Layer::MatrixType>& nabla_b)
+		// multithread version, allocation-free: leaves the gradients summed over the batch in the workspace
+		void backprop(const uint8_t* labels, const Layer::ConstRef& input, workspace& ws) const
 		{
-			// make one-hot label out of single uint8_t
-			auto& outputLayer = m_layers.back();
-			MatrixType labelOneHot = MatrixType::Zero(outputLayer.UnitsInLayer(), activations.back().cols());
-			for (int i = 0; i < labelOneHot.cols(); ++i)
-				labelOneHot(label_batch[i], i) = real(1.0);
-			// compute delta
-			MatrixType delta = m_cost_derivative(activations.back(), labelOneHot).array() * activationDerivatives.back().array();
-			nabla_b.push_back(delta);
-			nabla_w.push_back(delta * activations[activations.size() - 2].transpose());
+			backprop(labels, input, ws, [](size_t) {});
+		}
 
-			for (size_t i = m_layers.size() - 2; i > 0; --i)
+		// layerDone(i) is called as soon as the gradients of the i-th layer are final and its weights aren't read anymore
+		template <typename LayerDone>
+		void backprop(const uint8_t* labels, const Layer::ConstRef& input, workspace& ws, const LayerDone& layerDone) const
+		{
+			checkOutputLayer();
+			const auto cols = input.cols();
+			const size_t last = m_layers.size() - 1;
+			size_t current = 0;
 			{
-				const auto& nextLayer = m_layers[i + 1];
-				auto& layer = m_layers[i];
-				const auto& prevLayer = m_layers[i - 1];
-				delta = nextLayer.getWeights().transpose() * delta;
-				delta = delta.array() * activationDerivatives[i].array();
-				nabla_b.push_back(delta);
-				nabla_w.push_back(delta * activations[i - 1].transpose());
+				// the error is computed one column at a time and summed into the bias gradient while the column is in cache
+				auto delta = ws.delta(current, m_layers[last].UnitsInLayer(), cols);
+				auto activations = ws.activations(last, cols);
+				const auto derivatives = ws.derivatives(last, cols);
+				auto nablaB = ws.nablaB(last);
+				nablaB.setZero();
+				for (MatrixType::Index k = 0; k < cols; ++k)
+				{
+					auto output = activations.col(k);
+					auto column = delta.col(k);
+					Eigen::Ref<MatrixType> gradient(column);
+					if (fusedOutput())
+						softmax_cross_entropy(output, labels + k, &gradient);
+					else
+					{
+						m_cost_derivative(output, labels + k, gradient);
+						if (m_layers[last].type() != LayerType::kSoftmax)
+							column.array() *= derivatives.col(k).array();
+					}
+					m_layers[last].accumulateBiasGradient(column, nablaB);
+				}
+			}
+
+			for (size_t i = last; i > 0; --i)
+			{
+				const auto delta = ws.delta(current, m_layers[i].UnitsInLayer(), cols);
+				auto nablaW = ws.nablaW(i);
+				nablaW.setZero();
+				m_layers[i].computeWeightGradient(i == 1 ? input : Layer::ConstRef(ws.activations(i - 1, cols)), delta, nablaW, ws.packing(), ws.packingSize());
+				if (i > 1)
+				{
+					auto previous = ws.delta(1 - current, m_layers[i - 1].UnitsInLayer(), cols);
+					m_layers[i].computeInputGradient(delta, previous, ws.packing(), ws.packingSize(), ws.derivatives(i, cols).data());
+					// the same fusion of the derivatives and the bias gradient as for the output, pooling layers have neither
+					const auto derivatives = ws.derivatives(i - 1, cols);
+					auto nablaB = ws.nablaB(i - 1);
+					nablaB.setZero();
+					if (!isPooling(m_layers[i - 1].type()))
+						for (MatrixType::Index k = 0; k < cols; ++k)
+						{
+							backend().multiply(size_t(previous.rows()), derivatives.col(k).data(), previous.col(k).data());
+							m_layers[i - 1].accumulateBiasGradient(previous.col(k), nablaB);
+						}
+					current = 1 - current;
+				}
+				layerDone(i);
 			}
 		}
 
 		void derive_backprop(uint8_t image_label, Layer::MatrixType& image_grad)
 		{
-			// make one-hot label out of single uint8_t
-			auto& outputLayer = m_layers.back();
-			MatrixType labelOneHot = MatrixType::Zero(outputLayer.UnitsInLayer(), 1);
-			labelOneHot(image_label , 0) = real(1.0);
 			// compute delta
 			MatrixType input = MatrixType::Zero(28 * 28, 1);
 			for (int i = 0; i < 10; ++i)
 			{
-				MatrixType output = feedforward(input);
-				MatrixType delta = labelOneHot - output;
+				// truth - output
+				MatrixType delta = -feedforward(input);
+				delta(image_label, 0) += real(1.0);
 
 				for (size_t i = m_layers.size() - 1; i > 0; --i)
 				{
 					auto& prevLayer = m_layers[i - 1];
 					auto& layer = m_layers[i];
-					if (i != 0)
+					if (layer.type() != LayerType::kSoftmax && !isPooling(layer.type()))
 						delta.array() *= layer.getActivationDerivatives().array();
-					delta = layer.getWeights().transpose() * delta;
+					if (layer.type() == LayerType::kConv || isPooling(layer.type()))
+					{
+						std::vector<real, Eigen::aligned_allocator<real>> packing(layer.scratchSize(1, true));
+						MatrixType previous(layer.UnitsInPreviousLayer(), 1);
+						layer.computeInputGradient(delta, previous, packing.data(), packing.size(), layer.getActivationDerivatives().data());
+						delta = previous;
+					}
+					else
+						delta = layer.getWeights().transpose() * delta;
 				}
 				input *= 0.9f;
 				input += delta;
@@ -167,138 +329,516 @@ namespace nn
 			for (size_t i = m_layers.size() - 1; i > 0; --i)
 			{
 				auto& layer = m_layers[i];
-				// regularization
-				if (lambda != real(0.0))
-					layer.getWeights() *= (1.0 - eta * lambda / real(batch_size));
-				layer.getWeights() -= (eta / real(batch_size)) * layer.getNablaW();
-				for (int i = 0; i < layer.getNablaB().cols(); ++i)
-					layer.getBias() -= (eta / real(batch_size)) * layer.getNablaB().col(i);
+				updateLayer(layer, layer.getNablaW(), layer.getNablaB(), eta, lambda, batch_size);
 				layer.getNablaW().setConstant(0.0);
 				layer.getNablaB().setConstant(0.0);
 			}
 		}
 
-		// multithread version
-		void update_weights(real eta, real lambda, uint32_t batch_size,
-			const std::vector<Layer::MatrixType>& nabla_w,
-			const std::vector<Layer::MatrixType>& nabla_b)
+		// multithread version, applies the gradients left in the workspace
+		void update_weights(real eta, real lambda, uint32_t batch_size, const workspace& ws)
 		{
 			for (size_t i = m_layers.size() - 1; i > 0; --i)
-			{
-				auto& layer = m_layers[i];
-				// regularization
-				if (lambda != real(0.0))
-					layer.getWeights() *= (1.0 - eta * lambda / real(batch_size));
-				layer.getWeights() -= (eta / real(batch_size)) * nabla_w[nabla_w.size() - i];
-				for (int k = 0; k < nabla_b[nabla_b.size() - i].cols(); ++k)
-					layer.getBias() -= (eta / real(batch_size)) * nabla_b[nabla_b.size() - i].col(k);
-			}
+				updateLayer(m_layers[i], ws.nablaW(i), ws.nablaB(i), eta, lambda, batch_size);
 		}
 
-		void sgd(uint32_t img_width, uint32_t img_height,
-			uint32_t batches, uint32_t batch_size,
+		// order is an optional permutation of the training set, without it batches are views into decoded datasets
+		void sgd(uint32_t batches, uint32_t batch_size,
 			real eta, real lambda,
-			const std::vector<MatrixType>& training_set,
-			const std::vector<uint8_t>& training_labels)
+			const dataset& training_set,
+			const std::vector<uint32_t>& order = {})
 		{
-			MatrixType image_batch = MatrixType::Zero(img_width * img_height, batch_size);
+			checkOutputLayer();
+			const storage_refresh refresh{ *this };
+			workspace ws(m_layers, batch_size);
+			MatrixType image_batch(training_set.sampleSize(), batch_size);
 			std::vector<uint8_t> label_batch(batch_size);
 			for (size_t k = 0u; k < batches; k++)
 			{
+				no_malloc_scope no_malloc;
 				const size_t batch_start = k * batch_size;
-				const size_t batch_end = (k + 1) * batch_size;
-
-				for (size_t i = batch_start; i < batch_end; ++i)
+				if (order.empty())
 				{
-					image_batch.col(i - batch_start) = training_set[i];
-					label_batch[i - batch_start] = training_labels[i];
+					const auto batch = training_set.batch(batch_start, batch_size, image_batch);
+					feedforward(batch, ws);
+					backprop(training_set.labels() + batch_start, batch, ws);
 				}
-				feedforward(image_batch);
-				backprop(label_batch);
-				update_weights(eta, lambda, batch_size);
+				else
+				{
+					training_set.gather(order.data() + batch_start, batch_size, image_batch, label_batch.data());
+					feedforward(image_batch, ws);
+					backprop(label_batch.data(), image_batch, ws);
+				}
+				update_weights(eta, lambda, batch_size, ws);
 			}
 		}
 
-		void psgd(uint32_t img_width, uint32_t img_height,
-			uint32_t batches, uint32_t batch_size,
+		// batches are distributed dynamically over the thread pool
+		psgd_results psgd(uint32_t batches, uint32_t batch_size,
 			real eta, real lambda,
-			const std::vector<MatrixType>& training_set,
-			const std::vector<uint8_t>& training_labels,
-			bool useLock)
+			const dataset& training_set,
+			UpdateType updateType,
+			const std::vector<uint32_t>& order = {})
 		{
-			std::mutex weights_mutex;
-			const auto worker_count = std::thread::hardware_concurrency();
-			auto sgd_thread_func = [&](uint32_t threadNo)
+			checkOutputLayer();
+			const storage_refresh refresh{ *this };
+			if (updateType == UpdateType::kSynchronous)
 			{
-				MatrixType image_batch = MatrixType::Zero(img_width * img_height, batch_size);
+				synchronous_state state(*this, training_set.sampleSize(), batch_size);
+				for (size_t k = 0u; k < batches; k++)
+				{
+					const size_t batch_start = k * batch_size;
+					synchronousStep(state, eta, lambda, [&](size_t shard_start, size_t shard_size, MatrixType& scratch, uint8_t* labels)
+					{
+						if (!order.empty())
+						{
+							training_set.gather(order.data() + batch_start + shard_start, shard_size, scratch, labels);
+							return Layer::ConstRef(scratch);
+						}
+						std::copy(training_set.labels() + batch_start + shard_start, training_set.labels() + batch_start + shard_start + shard_size, labels);
+						return Layer::ConstRef(training_set.batch(batch_start + shard_start, shard_size, scratch));
+					});
+				}
+				return psgd_results{ batches, 0 };
+			}
+			if (updateType == UpdateType::kWavefront)
+			{
+				wavefront_state state(*this, batch_size);
+				MatrixType image_batch(training_set.sampleSize(), batch_size);
 				std::vector<uint8_t> label_batch(batch_size);
-				const auto batches_per_thread = batches / worker_count;
-				const auto batches_start = threadNo * batches_per_thread;
-				const auto batches_end = std::min(batches_start + batches_per_thread, batches);
-				for (size_t k = batches_start; k < batches_end; k++)
+				for (size_t k = 0u; k < batches; k++)
 				{
 					const size_t batch_start = k * batch_size;
-					const size_t batch_end = (k + 1) * batch_size;
-
-					for (size_t i = batch_start; i < batch_end; ++i)
+					if (order.empty())
+						wavefrontStep(state, training_set.batch(batch_start, batch_size, image_batch), training_set.labels() + batch_start, eta, lambda);
+					else
 					{
-						image_batch.col(i - batch_start) = training_set[i];
-						label_batch[i - batch_start] = training_labels[i];
+						training_set.gather(order.data() + batch_start, batch_size, image_batch, label_batch.data());
+						wavefrontStep(state, image_batch, label_batch.data(), eta, lambda);
 					}
-					std::vector<MatrixType> activations, activationDerivatives, nablaW, nablaB;
-					feedforward(image_batch, activations, activationDerivatives);
-					backprop(label_batch, activations, activationDerivatives, nablaW, nablaB);
-					if (useLock)
+				}
+				state.waitAll();
+				return psgd_results{ batches, 0 };
+			}
+
+			asynchronous_state state;
+			std::atomic<size_t> stale(0);
+			auto& pool = threadPool();
+			std::vector<workspace> workspaces(pool.size(), workspace(m_layers, batch_size));
+			std::vector<MatrixType> image_batches(pool.size(), MatrixType(training_set.sampleSize(), batch_size));
+			std::vector<std::vector<uint8_t>> label_batches(pool.size(), std::vector<uint8_t>(batch_size));
+			pool.parallel_for(0, batches, 1, [&](size_t batches_start, size_t batches_end, uint32_t worker)
+			{
+				auto& ws = workspaces[worker];
+				auto& image_batch = image_batches[worker];
+				auto& label_batch = label_batches[worker];
+				for (size_t k = batches_start; k < batches_end; k++)
+				{
+					no_malloc_scope no_malloc;
+					const size_t batch_start = k * batch_size;
+					const size_t version = state.updates.load(std::memory_order_relaxed);
+					if (order.empty())
 					{
-						std::lock_guard<std::mutex> lock(weights_mutex);
-						update_weights(eta, lambda, batch_size, nablaW, nablaB);
+						const auto batch = training_set.batch(batch_start, batch_size, image_batch);
+						feedforward(batch, ws);
+						backprop(training_set.labels() + batch_start, batch, ws);
 					}
 					else
 					{
-						update_weights(eta, lambda, batch_size, nablaW, nablaB);
+						training_set.gather(order.data() + batch_start, batch_size, image_batch, label_batch.data());
+						feedforward(image_batch, ws);
+						backprop(label_batch.data(), image_batch, ws);
 					}
+					stale += applyAsynchronous(updateType, state, version, worker, eta, lambda, batch_size, ws);
 				}
-			};
-
-			std::vector<std::thread> workers;
+			});
+			return psgd_results{ batches, stale };
+		}
 
-			for (uint32_t i = 0u; i < worker_count; ++i)
-				workers.push_back(std::thread(sgd_thread_func, i));
-			for (uint32_t i = 0u; i < worker_count; ++i)
-				workers[i].join();	
+		// consumes batches from a pipeline which assembles and shuffles them in the background
+		void sgd(batch_pipeline& pipeline, uint32_t batches, real eta, real lambda)
+		{
+			checkOutputLayer();
+			const storage_refresh refresh{ *this };
+			workspace ws(m_layers, pipeline.batchSize());
+			for (uint32_t k = 0u; k < batches; k++)
+			{
+				const auto& batch = pipeline.acquire();
+				no_malloc_scope no_malloc;
+				feedforward(batch.samples(), ws);
+				backprop(batch.labels.data(), batch.samples(), ws);
+				pipeline.release(batch);
+				update_weights(eta, lambda, pipeline.batchSize(), ws);
+			}
 		}
 
+		psgd_results psgd(batch_pipeline& pipeline, uint32_t batches, real eta, real lambda, UpdateType updateType)
+		{
+			checkOutputLayer();
+			const storage_refresh refresh{ *this };
+			if (updateType == UpdateType::kSynchronous)
+			{
+				synchronous_state state(*this, 0, pipeline.batchSize());
+				for (uint32_t k = 0u; k < batches; k++)
+				{
+					const auto& batch = pipeline.acquire();
+					const auto samples = batch.samples();
+					synchronousStep(state, eta, lambda, [&](size_t shard_start, size_t shard_size, MatrixType&, uint8_t* labels)
+					{
+						std::copy(batch.labels.begin() + shard_start, batch.labels.begin() + shard_start + shard_size, labels);
+						return Layer::ConstRef(samples.middleCols(shard_start, shard_size));
+					});
+					pipeline.release(batch);
+				}
+				return psgd_results{ batches, 0 };
+			}
+			if (updateType == UpdateType::kWavefront)
+			{
+				wavefront_state state(*this, pipeline.batchSize());
+				for (uint32_t k = 0u; k < batches; k++)
+				{
+					const auto& batch = pipeline.acquire();
+					wavefrontStep(state, batch.samples(), batch.labels.data(), eta, lambda);
+					pipeline.release(batch);
+				}
+				state.waitAll();
+				return psgd_results{ batches, 0 };
+			}
 
-		evaluate_results evaluate(const std::vector<MatrixType>& inputs, const std::vector<uint8_t>& labels, size_t count = 0)
+			asynchronous_state state;
+			std::atomic<size_t> stale(0);
+			auto& pool = threadPool();
+			std::vector<workspace> workspaces(pool.size(), workspace(m_layers, pipeline.batchSize()));
+			pool.parallel_for(0, batches, 1, [&](size_t batches_start, size_t batches_end, uint32_t worker)
+			{
+				auto& ws = workspaces[worker];
+				for (size_t k = batches_start; k < batches_end; k++)
+				{
+					const auto& batch = pipeline.acquire();
+					no_malloc_scope no_malloc;
+					const size_t version = state.updates.load(std::memory_order_relaxed);
+					feedforward(batch.samples(), ws);
+					backprop(batch.labels.data(), batch.samples(), ws);
+					pipeline.release(batch);
+					stale += applyAsynchronous(updateType, state, version, worker, eta, lambda, pipeline.batchSize(), ws);
+				}
+			});
+			return psgd_results{ batches, stale };
+		}
+
+		// batches of samples are split between the workers of the thread pool, every batch is one product per layer
+		evaluate_results evaluate(const dataset& inputs, size_t count = 0, uint32_t batch_size = 256)
 		{
-			if (inputs.size() != labels.size())
-				throw std::logic_error("Inputs and labels should be of the same size");
+			struct partial_results
+			{
+				size_t correct = 0;
+				real cost = 0.0;
+				std::vector<size_t> errors;
+				MatrixType samples;
+				MatrixType output;
+				inference_workspace ws;
+			};
+			auto& pool = threadPool();
+			const auto range = count != 0 ? count : inputs.size();
+			batch_size = uint32_t(std::max<size_t>(std::min<size_t>(batch_size, range), 1));
+			std::vector<partial_results> partials(pool.size());
+			for (auto& partial : partials)
+				partial.ws = inference_workspace(m_layers, batch_size);
+			pool.parallel_for(0, (range + batch_size - 1) / batch_size, 1, [&](size_t batches_begin, size_t batches_end, uint32_t worker)
+			{
+				auto& partial = partials[worker];
+				for (size_t k = batches_begin; k < batches_end; ++k)
+				{
+					const size_t batch_start = k * batch_size;
+					const size_t samples = std::min<size_t>(batch_size, range - batch_start);
+					partial.output = infer(inputs.batch(batch_start, samples, partial.samples), partial.ws, inputs.labels() + batch_start, &partial.cost);
+					for (size_t i = 0; i < samples; ++i)
+					{
+						const uint8_t label = inputs.label(batch_start + i);
+						MatrixType::Index idx = 0;
+						partial.output.col(i).maxCoeff(&idx);
+						if (idx == label)
+							partial.correct++;
+						else
+							partial.errors.push_back(batch_start + i);
+					}
+				}
+			});
 
 			size_t correct = 0;
 			real cost = 0.0;
-			std::vector<uint8_t> outputs;
 			std::vector<size_t> errors;
-			const auto range = count != 0 ? count : inputs.size();
-			for (size_t i = 0; i < range; ++i)
-			{
-				const auto output = feedforward(inputs[i]);
-				uint8_t idx = 0;
-				output.col(0).maxCoeff(&idx);
-				outputs.push_back(idx);
-				const auto& outputLayer = m_layers.back();
-				MatrixType labelOneHot = MatrixType::Zero(outputLayer.UnitsInLayer(), 1);
-				labelOneHot(labels[i], 0) = real(1.0);
-				cost += m_cost(output, labelOneHot);
-				correct += idx == labels[i];
-				if (idx != labels[i])
-					errors.push_back(i);
+			for (const auto& partial : partials)
+			{
+				correct += partial.correct;
+				cost += partial.cost;
+				errors.insert(errors.end(), partial.errors.begin(), partial.errors.end());
 			}
-
+			std::sort(errors.begin(), errors.end());
 			return evaluate_results{ real(correct) / real(range), cost / real(range), errors };
 		}
+	private:
+		// takes the 16 bit copies of the weights again when a training call returns, same sizes don't allocate
+		struct storage_refresh
+		{
+			network& net;
+			~storage_refresh()
+			{
+				for (auto& l : net.m_layers)
+					l.setWeightStorage(l.weightStorage());
+			}
+		};
+
+		// decay (regularization) and gradient step of the weights in a single pass, then the bias
+		void updateLayer(Layer& layer, const Layer::ConstRef& nablaW, const Layer::ConstRef& nablaB, real eta, real lambda, uint32_t batch_size)
+		{
+			const real decay = real(1.0) - eta * lambda / real(batch_size);
+			const real rate = eta / real(batch_size);
+			const auto& ops = backend();
+			ops.axpby(size_t(nablaW.size()), -rate, nablaW.data(), decay, layer.getWeights().data());
+			ops.axpby(size_t(nablaB.size()), -rate, nablaB.data(), real(1.0), layer.getBias().data());
+		}
+
+		// hogwild updates are split into blocks aligned to this many bytes, a multiple of the cache line
+		static const uintptr_t kHogwildBlockBytes = 4096;
+		// blocks are owned through flags picked by their address, blocks 4 MB apart share one
+		static const size_t kHogwildOwners = 1024;
+
+		// shared by the workers of a kLocked or kHogwild psgd
+		struct asynchronous_state
+		{
+			std::mutex weights_mutex;
+			// number of updates applied so far, used to detect stale ones
+			std::atomic<size_t> updates{ 0 };
+			std::atomic<bool> owned[kHogwildOwners] = {};
+		};
+
+		// applies the gradients of one batch in the kLocked or kHogwild way, returns 1 if other
+		// updates were applied since version was read from updates before computing the gradients
+		size_t applyAsynchronous(UpdateType updateType, asynchronous_state& state, size_t version, uint32_t worker,
+			real eta, real lambda, uint32_t batch_size, const workspace& ws)
+		{
+			if (updateType == UpdateType::kLocked)
+			{
+				std::lock_guard<std::mutex> lock(state.weights_mutex);
+				update_weights(eta, lambda, batch_size, ws);
+				return state.updates.fetch_add(1, std::memory_order_relaxed) != version;
+			}
+
+			const bool stale = state.updates.fetch_add(1, std::memory_order_relaxed) != version;
+			const real decay = lambda != real(0.0) ? real(1.0) - eta * lambda / real(batch_size) : real(1.0);
+			const real rate = eta / real(batch_size);
+			for (size_t i = m_layers.size() - 1; i > 0; --i)
+			{
+				auto& layer = m_layers[i];
+				hogwildUpdate(state, layer.getWeights().data(), ws.nablaW(i).data(), size_t(layer.getWeights().size()), decay, rate, worker);
+				hogwildUpdate(state, layer.getBias().data(), ws.nablaB(i).data(), size_t(layer.getBias().size()), real(1.0), rate, worker);
+			}
+			return stale;
+		}
+
+		// parameters = parameters * decay - rate * gradients without a global lock. Blocks are aligned in memory
+		// so no two blocks share a cache line, every worker starts at a different block so concurrent workers
+		// rarely meet, and a block is written by its owner only, so writers never lose each other's updates
+		// and each block is one vectorized axpby. The forward and backward passes of the other workers still
+		// read the parameters with plain loads while they are written: those races are by design, Hogwild
+		// takes the parameters as they are at any moment
+		void hogwildUpdate(asynchronous_state& state, real* parameters, const real* gradients, size_t size, real decay, real rate, uint32_t worker)
+		{
+			if (size == 0)
+				return;
+			const auto& ops = backend();
+			const uintptr_t base = uintptr_t(parameters);
+			const uintptr_t first = base / kHogwildBlockBytes;
+			const uintptr_t last = (base + size * sizeof(real) - 1) / kHogwildBlockBytes;
+			const size_t blocks = size_t(last - first + 1);
+			const size_t start = blocks * worker / std::max(threadPool().size(), 1u);
+			for (size_t j = 0; j < blocks; ++j)
+			{
+				const uintptr_t block = first + (start + j) % blocks;
+				const size_t begin = block == first ? 0 : size_t(block * kHogwildBlockBytes - base) / sizeof(real);
+				const size_t end = block == last ? size : size_t((block + 1) * kHogwildBlockBytes - base) / sizeof(real);
+				auto& owner = state.owned[block % kHogwildOwners];
+				while (owner.exchange(true, std::memory_order_acquire))
+					std::this_thread::yield();
+				ops.axpby(end - begin, -rate, gradients + begin, decay, parameters + begin);
+				owner.store(false, std::memory_order_release);
+			}
+		}
+
+		// every shard has its own workspace, the gradients of all layers are one flat range in each of them,
+		// so the reduction and the update work on contiguous ranges regardless of the layer boundaries
+		struct synchronous_state
+		{
+			struct segment
+			{
+				size_t offset;
+				size_t size;
+				size_t layer;
+				bool bias;
+			};
+
+			// sampleSize is the size of the scratch shards are assembled in, 0 if they are views
+			synchronous_state(network& net, uint32_t sampleSize, uint32_t batch_size) :
+				batchSize(batch_size),
+				shards(std::min(net.threadPool().size(), batch_size)),
+				workspaces(shards, workspace(net.m_layers, (batch_size + shards - 1) / shards))
+			{
+				for (uint32_t s = 0; s < shards; ++s)
+				{
+					samples.push_back(MatrixType(sampleSize, shardSize(s)));
+					labels.push_back(std::vector<uint8_t>(shardSize(s)));
+				}
+				auto& ws = workspaces.front();
+				for (size_t i = 1; i < net.m_layers.size(); ++i)
+				{
+					segments.push_back(segment{ size_t(ws.nablaW(i).data() - ws.gradients()), size_t(ws.nablaW(i).size()), i, false });
+					segments.push_back(segment{ size_t(ws.nablaB(i).data() - ws.gradients()), size_t(ws.nablaB(i).size()), i, true });
+				}
+			}
+
+			size_t shardStart(size_t s) const { return batchSize * s / shards; }
+			size_t shardSize(size_t s) const { return shardStart(s + 1) - shardStart(s); }
+
+			uint32_t batchSize;
+			uint32_t shards;
+			std::vector<segment> segments;
+			std::vector<workspace> workspaces;
+			std::vector<MatrixType> samples;
+			std::vector<std::vector<uint8_t>> labels;
+		};
+
+		// one global batch: shards are computed in parallel, then every range of the gradients is
+		// reduced pairwise over the shards in a fixed order and applied, so results only depend on the pool size.
+		// shard(start, size, scratch, labels) returns the samples of the shard and fills its labels
+		template <typename Shard>
+		void synchronousStep(synchronous_state& state, real eta, real lambda, const Shard& shard)
+		{
+			static const size_t kReduceGrain = 4096;
+			auto& pool = threadPool();
+			pool.parallel_for(0, state.shards, 1, [&](size_t shards_begin, size_t shards_end, uint32_t)
+			{
+				for (size_t s = shards_begin; s < shards_end; ++s)
+				{
+					no_malloc_scope no_malloc;
+					auto& ws = state.workspaces[s];
+					auto& labels = state.labels[s];
+					const auto samples = shard(state.shardStart(s), state.shardSize(s), state.samples[s], labels.data());
+					feedforward(samples, ws);
+					backprop(labels.data(), samples, ws);
+				}
+			});
+
+			const real decay = real(1.0) - eta * lambda / real(state.batchSize);
+			const real rate = eta / real(state.batchSize);
+			pool.parallel_for(0, state.workspaces.front().gradientSize(), kReduceGrain, [&](size_t begin, size_t end, uint32_t)
+			{
+				no_malloc_scope no_malloc;
+				for (size_t stride = 1; stride < state.shards; stride *= 2)
+					for (size_t s = 0; s + stride < state.shards; s += 2 * stride)
+						backend().axpby(end - begin, real(1.0), state.workspaces[s + stride].gradients() + begin, real(1.0), state.workspaces[s].gradients() + begin);
+				const real* gradients = state.workspaces.front().gradients();
+				for (const auto& segment : state.segments)
+				{
+					const size_t first = std::max(begin, segment.offset);
+					const size_t last = std::min(end, segment.offset + segment.size);
+					if (first >= last)
+						continue;
+					auto& l = m_layers[segment.layer];
+					real* parameters = (segment.bias ? l.getBias().data() : l.getWeights().data()) + first - segment.offset;
+					backend().axpby(last - first, -rate, gradients + first, segment.bias ? real(1.0) : decay, parameters);
+				}
+			});
+		}
+
+		// the error of a pooling output would be scattered to its argmax positions as if they were derivatives
+		void checkOutputLayer() const
+		{
+			if (!m_layers.empty() && isPooling(m_layers.back().type()))
+				throw std::logic_error("Pooling layers can't be the output layer");
+		}
+
+		// the output layer is a softmax trained with cross-entropy, computed by softmax_cross_entropy from the logits
+		bool fusedOutput() const
+		{
+			return m_costType == CostType::kCrossEntropy && m_layers.back().type() == LayerType::kSoftmax;
+		}
+
+		// completion of the layer updates of the wavefront mode. A pool worker calling psgd applies
+		// the updates itself, blocking it on a task queued behind its own work could deadlock
+		struct wavefront_state
+		{
+			wavefront_state(network& net, uint32_t batch_size) :
+				ws(net.m_layers, batch_size),
+				pending(net.m_layers.size(), false),
+				overlap(net.threadPool().currentWorker() == net.threadPool().size())
+			{
+			}
+
+			// blocks until the update of the i-th layer is applied
+			void wait(size_t i)
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				done.wait(lock, [&] { return !pending[i]; });
+			}
+			void waitAll()
+			{
+				for (size_t i = 1; i < pending.size(); ++i)
+					wait(i);
+			}
+
+			workspace ws;
+			std::vector<bool> pending;
+			bool overlap;
+			std::mutex mutex;
+			std::condition_variable done;
+		};
+
+		// one batch of the wavefront mode: the forward pass of every layer waits for the update of the previous
+		// batch, backprop hands every layer to the pool as soon as it is done with it and goes on with the next one
+		void wavefrontStep(wavefront_state& state, const Layer::ConstRef& samples, const uint8_t* labels, real eta, real lambda)
+		{
+			no_malloc_scope no_malloc;
+			const auto batch_size = uint32_t(samples.cols());
+			feedforward(samples, state.ws, [&](size_t i) { state.wait(i); });
+			backprop(labels, samples, state.ws, [&](size_t i)
+			{
+				if (!state.overlap)
+				{
+					updateLayer(m_layers[i], state.ws.nablaW(i), state.ws.nablaB(i), eta, lambda, batch_size);
+					return;
+				}
+				{
+					std::lock_guard<std::mutex> lock(state.mutex);
+					state.pending[i] = true;
+				}
+				threadPool().submit([this, &state, i, eta, lambda, batch_size]
+				{
+					{
+						no_malloc_scope no_malloc;
+						updateLayer(m_layers[i], state.ws.nablaW(i), state.ws.nablaB(i), eta, lambda, batch_size);
+					}
+					std::lock_guard<std::mutex> lock(state.mutex);
+					state.pending[i] = false;
+					state.done.notify_all();
+				});
+			});
+		}
+
+		// input of the i-th layer, for the first hidden layer it is the batch passed to feedforward
+		Layer::ConstRef layerInput(size_t i) const
+		{
+			if (i == 1)
+				return m_input;
+			return m_layers[i - 1].getActivations();
+		}
+
+		mutable std::shared_ptr<thread_pool> m_pool;
+		MatrixType m_input;
 	public:
-		CostFunction m_cost;
-		CostDerivativeFunction m_cost_derivative;
+		CostType m_costType = CostType::kCrossEntropy;
+		CostFunction m_cost = cost<CostType::kCrossEntropy>;
+		CostDerivativeFunction m_cost_derivative = cost_derivative<CostType::kCrossEntropy>;
 		std::vector<Layer> m_layers;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,213 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "settings.hpp"
+#include "dataset.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// minibatch assembled by batch_pipeline, samples either point into a decoded dataset or into storage
+	struct minibatch
+	{
+		using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
+
+		dataset::ConstBatch samples() const { return dataset::ConstBatch(data, rows, cols); }
+
+		MatrixType storage;
+		const real* data = nullptr;
+		MatrixType::Index rows = 0;
+		MatrixType::Index cols = 0;
+		std::vector<uint8_t> labels;
+		size_t epoch = 0;
+		size_t sequence = 0;
+	};
+
+	// produces minibatches on dedicated threads into a bounded ring of preallocated batches.
+	// Every epoch visits the dataset in a new random order (unless shuffling is off), batches
+	// are handed out in production order so results don't depend on the number of producers
+	class batch_pipeline
+	{
+	public:
+		using MatrixType = minibatch::MatrixType;
+		// applied to the samples of each batch on the producer thread
+		using Augmentation = std::function<void(MatrixType& samples, std::mt19937& rng)>;
+
+		batch_pipeline(const dataset& data, uint32_t batchSize,
+			uint32_t producers = 1, uint32_t depth = 4,
+			bool shuffle = true, uint32_t seed = 0,
+			Augmentation augmentation = nullptr) :
+			m_data(data),
+			m_batchSize(batchSize),
+			m_batchesPerEpoch(uint32_t(data.size() / batchSize)),
+			m_shuffle(shuffle),
+			m_seed(seed),
+			m_augmentation(augmentation),
+			m_slots(std::max(depth, producers))
+		{
+			if (m_batchesPerEpoch == 0)
+				throw std::logic_error("Dataset is smaller than a batch");
+			for (size_t i = 0; i < m_slots.size(); ++i)
+			{
+				m_slots[i].storage.resize(data.sampleSize(), batchSize);
+				m_slots[i].labels.resize(batchSize);
+				m_free.push_back(i);
+			}
+			for (uint32_t i = 0; i < producers; ++i)
+				m_producers.push_back(std::thread(&batch_pipeline::produce, this));
+		}
+
+		~batch_pipeline()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_freed.notify_all();
+			for (auto& producer : m_producers)
+				producer.join();
+		}
+
+		batch_pipeline(const batch_pipeline&) = delete;
+		batch_pipeline& operator=(const batch_pipeline&) = delete;
+
+		uint32_t batchSize() const { return m_batchSize; }
+		uint32_t batchesPerEpoch() const { return m_batchesPerEpoch; }
+
+		// blocks until the next batch is ready, it stays valid until it is released
+		const minibatch& acquire()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			const size_t sequence = m_nextConsumed++;
+			std::vector<size_t>::iterator ready;
+			m_produced.wait(lock, [&]
+			{
+				ready = std::find_if(m_ready.begin(), m_ready.end(), [&](size_t slot) { return m_slots[slot].sequence == sequence; });
+				return ready != m_ready.end() || !m_error.empty();
+			});
+			if (ready == m_ready.end())
+				throw std::runtime_error(m_error);
+			const size_t slot = *ready;
+			m_ready.erase(ready);
+			return m_slots[slot];
+		}
+
+		void release(const minibatch& batch)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_free.push_back(size_t(&batch - m_slots.data()));
+			}
+			m_freed.notify_one();
+		}
+	private:
+		void produce()
+		{
+			try
+			{
+				while (true)
+				{
+					size_t slot, sequence;
+					std::shared_ptr<const std::vector<uint32_t>> order;
+					{
+						std::unique_lock<std::mutex> lock(m_mutex);
+						m_freed.wait(lock, [&] { return m_stop || !m_free.empty(); });
+						if (m_stop)
+							return;
+						slot = m_free.back();
+						m_free.pop_back();
+						sequence = m_nextProduced++;
+						const size_t epoch = sequence / m_batchesPerEpoch;
+						if (m_shuffle && (!m_order || m_orderEpoch != epoch))
+						{
+							// the first producer to reach an epoch shuffles it, batches of the
+							// previous epoch still being assembled hold on to the old order
+							auto next = std::make_shared<std::vector<uint32_t>>(m_data.size());
+							std::iota(next->begin(), next->end(), 0);
+							std::mt19937 rng(m_seed + uint32_t(epoch));
+							std::shuffle(next->begin(), next->end(), rng);
+							m_order = next;
+							m_orderEpoch = epoch;
+						}
+						order = m_order;
+					}
+
+					auto& batch = m_slots[slot];
+					batch.epoch = sequence / m_batchesPerEpoch;
+					batch.sequence = sequence;
+					const size_t start = (sequence % m_batchesPerEpoch) * m_batchSize;
+					if (order)
+					{
+						m_data.gather(order->data() + start, m_batchSize, batch.storage, batch.labels.data());
+						batch.data = batch.storage.data();
+					}
+					else
+					{
+						batch.data = m_data.batch(start, m_batchSize, batch.storage).data();
+						std::copy(m_data.labels() + start, m_data.labels() + start + m_batchSize, batch.labels.begin());
+					}
+					// samples() maps the batch by its shape, which is unset the first time a slot is filled
+					batch.rows = m_data.sampleSize();
+					batch.cols = m_batchSize;
+					if (m_augmentation)
+					{
+						if (batch.data != batch.storage.data())
+							batch.storage = batch.samples();
+						std::seed_seq seeds{ m_seed, uint32_t(sequence) };
+						std::mt19937 rng(seeds);
+						m_augmentation(batch.storage, rng);
+						batch.data = batch.storage.data();
+					}
+
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						m_ready.push_back(slot);
+					}
+					m_produced.notify_all();
+				}
+			}
+			catch (const std::exception& e)
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_error = e.what();
+				}
+				m_produced.notify_all();
+			}
+		}
+
+		dataset m_data;
+		uint32_t m_batchSize;
+		uint32_t m_batchesPerEpoch;
+		bool m_shuffle;
+		uint32_t m_seed;
+		Augmentation m_augmentation;
+
+		std::vector<minibatch> m_slots;
+		std::vector<size_t> m_free;
+		std::vector<size_t> m_ready;
+		size_t m_nextProduced = 0;
+		size_t m_nextConsumed = 0;
+		std::shared_ptr<const std::vector<uint32_t>> m_order;
+		size_t m_orderEpoch = 0;
+
+		std::vector<std::thread> m_producers;
+		std::mutex m_mutex;
+		std::condition_variable m_freed;
+		std::condition_variable m_produced;
+		bool m_stop = false;
+		std::string m_error;
+	};
+#endif
+}
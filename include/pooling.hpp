@@ -0,0 +1,137 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <stdexcept>
+#include "settings.hpp"
+#include "im2col.hpp"
+#include "kernels.hpp"
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// pooling of images of channels x height x width over kernelSize x kernelSize windows stride apart,
+	// channel by channel, so the geometry has one filter per channel. Windows reaching into the padding
+	// take the pixels inside the image only. The rows of a window are reduced first, a whole image row at
+	// a time by the dispatched kernels, then the columns of every window out of that row
+	namespace
+	{
+		// first and one past the last of the window rows or columns inside size pixels, o being the output row or column
+		void poolingRange(const conv_geometry& g, size_t o, size_t size, size_t& begin, size_t& end)
+		{
+			const size_t start = o * g.stride;
+			begin = start >= g.padding ? start - g.padding : 0;
+			end = std::min(size, start + g.kernelSize - g.padding);
+		}
+	}
+
+	// throws unless g pools every channel with windows which all see the image
+	void checkPooling(const conv_geometry& g)
+	{
+		if (!g.valid() || g.filters != g.channels || g.padding >= g.kernelSize)
+			throw std::logic_error("Pooling takes one filter per channel and less padding than the window");
+	}
+
+	// reals of scratch the pooling of an image takes, the reduced window rows and where their maxima are
+	size_t poolingScratchSize(const conv_geometry& g)
+	{
+		return 2 * size_t(g.width);
+	}
+
+	// output = the maximum of every window. positions, if not null, takes the index of each maximum in the
+	// image as a real, the backward pass adds the error there
+	void maxPool(const conv_geometry& g, const real* image, real* output, real* positions, real* scratch)
+	{
+		const size_t oh = g.outputHeight(), ow = g.outputWidth();
+		real* rowMax = scratch;
+		real* rowPositions = scratch + g.width;
+		for (uint32_t c = 0; c < g.channels; ++c)
+			for (size_t oy = 0; oy < oh; ++oy)
+			{
+				size_t top, bottom;
+				poolingRange(g, oy, g.height, top, bottom);
+				// the first row of the windows starts the maxima, so every position is set whatever the values
+				const size_t start = (size_t(c) * g.height + top) * g.width;
+				std::copy(image + start, image + start + g.width, rowMax);
+				for (size_t x = 0; x < g.width; ++x)
+					rowPositions[x] = real(start + x);
+				for (size_t y = top + 1; y < bottom; ++y)
+				{
+					const size_t first = (size_t(c) * g.height + y) * g.width;
+					maxUpdate(g.width, image + first, real(first), rowMax, rowPositions);
+				}
+				const size_t o = (size_t(c) * oh + oy) * ow;
+				for (size_t ox = 0; ox < ow; ++ox)
+				{
+					size_t left, right;
+					poolingRange(g, ox, g.width, left, right);
+					size_t best = left;
+					for (size_t x = left + 1; x < right; ++x)
+						if (rowMax[x] > rowMax[best])
+							best = x;
+					output[o + ox] = rowMax[best];
+					if (positions)
+						positions[o + ox] = rowPositions[best];
+				}
+			}
+	}
+
+	// previous += the error of every output at the position of its maximum
+	void maxPoolBackward(const conv_geometry& g, const real* delta, const real* positions, real* previous)
+	{
+		const size_t outputs = g.outputSize();
+		for (size_t o = 0; o < outputs; ++o)
+			previous[size_t(positions[o])] += delta[o];
+	}
+
+	// output = the mean of every window over its pixels inside the image
+	void avgPool(const conv_geometry& g, const real* image, real* output, real* scratch)
+	{
+		const size_t oh = g.outputHeight(), ow = g.outputWidth();
+		real* rowSum = scratch;
+		for (uint32_t c = 0; c < g.channels; ++c)
+			for (size_t oy = 0; oy < oh; ++oy)
+			{
+				size_t top, bottom;
+				poolingRange(g, oy, g.height, top, bottom);
+				std::fill(rowSum, rowSum + g.width, real(0.0));
+				for (size_t y = top; y < bottom; ++y)
+					axpy(g.width, real(1.0), image + (size_t(c) * g.height + y) * g.width, rowSum);
+				real* out = output + (size_t(c) * oh + oy) * ow;
+				for (size_t ox = 0; ox < ow; ++ox)
+				{
+					size_t left, right;
+					poolingRange(g, ox, g.width, left, right);
+					real sum = real(0.0);
+					for (size_t x = left; x < right; ++x)
+						sum += rowSum[x];
+					out[ox] = sum / real((bottom - top) * (right - left));
+				}
+			}
+	}
+
+	// previous += the error of every output spread evenly over its window
+	void avgPoolBackward(const conv_geometry& g, const real* delta, real* previous)
+	{
+		const size_t oh = g.outputHeight(), ow = g.outputWidth();
+		for (uint32_t c = 0; c < g.channels; ++c)
+			for (size_t oy = 0; oy < oh; ++oy)
+			{
+				size_t top, bottom;
+				poolingRange(g, oy, g.height, top, bottom);
+				for (size_t ox = 0; ox < ow; ++ox)
+				{
+					size_t left, right;
+					poolingRange(g, ox, g.width, left, right);
+					const real share = delta[(size_t(c) * oh + oy) * ow + ox] / real((bottom - top) * (right - left));
+					for (size_t y = top; y < bottom; ++y)
+					{
+						real* row = previous + (size_t(c) * g.height + y) * g.width;
+						for (size_t x = left; x < right; ++x)
+							row[x] += share;
+					}
+				}
+			}
+	}
+#endif
+}
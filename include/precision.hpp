@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace nn
+{
+	// how matrices are kept in memory. Arithmetic is always done in real, 16 bit storage halves the
+	// bytes a product reads at the cost of precision
+	enum class StorageType
+	{
+		kFloat,
+		kHalf,    // IEEE binary16: 5 exponent and 10 mantissa bits, up to 65504
+		kBfloat16 // the upper half of a float: 8 exponent and 7 mantissa bits, the range of a float
+	};
+
+	// bytes of one element
+	size_t storageBytes(StorageType type) { return type == StorageType::kFloat ? sizeof(float) : sizeof(uint16_t); }
+
+	// the scalar conversions round to nearest even and keep infinities and NaNs, the vector kernels do the same
+
+	uint16_t floatToHalf(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		const uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+		const uint32_t magnitude = bits & 0x7fffffff;
+		// NaNs stay quiet NaNs with the upper bits of their payload
+		if (magnitude > 0x7f800000)
+			return uint16_t(sign | 0x7e00 | ((magnitude >> 13) & 0x3ff));
+		// from 65520 up everything rounds to infinity
+		if (magnitude >= 0x477ff000)
+			return uint16_t(sign | 0x7c00);
+		// below 2^-14 the result is subnormal, a multiple of 2^-24
+		if (magnitude < 0x38800000)
+		{
+			if (magnitude <= 0x33000000)
+				return sign;
+			const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+			const uint32_t shift = 126 - (magnitude >> 23);
+			const uint32_t remainder = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+			uint32_t result = mantissa >> shift;
+			if (remainder > halfway || (remainder == halfway && (result & 1)))
+				++result;
+			return uint16_t(sign | result);
+		}
+		// rebias the exponent and round the 13 dropped bits, a carry moves into the exponent
+		const uint32_t rebiased = magnitude - ((127 - 15) << 23);
+		return uint16_t(sign | ((rebiased + 0x0fff + ((rebiased >> 13) & 1)) >> 13));
+	}
+
+	float halfToFloat(uint16_t value)
+	{
+		const uint32_t sign = uint32_t(value & 0x8000) << 16;
+		uint32_t exponent = (value >> 10) & 0x1f;
+		uint32_t mantissa = value & 0x3ff;
+		uint32_t bits;
+		// NaNs come back quiet, as F16C returns them
+		if (exponent == 0x1f)
+			bits = sign | 0x7f800000 | (mantissa << 13) | (mantissa != 0 ? 0x400000 : 0);
+		else if (exponent != 0)
+			bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+		else if (mantissa == 0)
+			bits = sign;
+		else
+		{
+			// subnormals are normal floats
+			exponent = 127 - 14;
+			while ((mantissa & 0x400) == 0)
+			{
+				mantissa <<= 1;
+				--exponent;
+			}
+			bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+		}
+		float result;
+		memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+
+	uint16_t floatToBfloat16(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		if ((bits & 0x7fffffff) > 0x7f800000)
+			return uint16_t((bits >> 16) | 0x40);
+		return uint16_t((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+	}
+
+	float bfloat16ToFloat(uint16_t value)
+	{
+		const uint32_t bits = uint32_t(value) << 16;
+		float result;
+		memcpy(&result, &bits, sizeof(result));
+		return result;
+	}
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <cmath>
+#include <algorithm>
+#include "settings.hpp"
+#include "kernels.hpp"
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// kernels of rank 1, a vertical times a horizontal 1D kernel like Gaussian and box filters, convolve
+	// as two 1D passes in O(kh + kw) per pixel instead of O(kh * kw)
+
+	// splits the rows x cols kernel, row after row, into vertical[y] * horizontal[x] if it has rank 1 up to
+	// rounding. The row and the column through the largest entry span the kernel if any two do
+	bool separateKernel(const real* kernel, size_t rows, size_t cols, real* vertical, real* horizontal)
+	{
+		const size_t pivot = size_t(std::max_element(kernel, kernel + rows * cols, [](real a, real b) { return std::abs(a) < std::abs(b); }) - kernel);
+		const real p = kernel[pivot];
+		if (p == real(0.0))
+			return false;
+		const size_t py = pivot / cols, px = pivot % cols;
+		for (size_t x = 0; x < cols; ++x)
+			horizontal[x] = kernel[py * cols + x];
+		for (size_t y = 0; y < rows; ++y)
+			vertical[y] = kernel[y * cols + px] / p;
+		const real tolerance = real(1e-5) * std::abs(p);
+		for (size_t y = 0; y < rows; ++y)
+			for (size_t x = 0; x < cols; ++x)
+				if (std::abs(kernel[y * cols + x] - vertical[y] * horizontal[x]) > tolerance)
+					return false;
+		return true;
+	}
+
+	// out[x] += sum of kernel[t] * in[x + t - padding] for the ow outputs of a row of width inputs with padding zeros
+	// around it. The outputs whose taps are all inside the row go through the dispatched 1D correlation
+	void correlateRow(const real* in, size_t width, const real* kernel, size_t taps, size_t padding, real* out, size_t ow)
+	{
+		const size_t end = width + padding >= taps ? std::min(ow, width + padding - taps + 1) : 0;
+		const size_t begin = std::min(padding, end);
+		if (begin < end)
+			correlate(end - begin, taps, kernel, in + begin - padding, out + begin);
+		auto edge = [&](size_t x)
+		{
+			real sum = real(0.0);
+			for (size_t t = 0; t < taps; ++t)
+				if (x + t >= padding && x + t - padding < width)
+					sum += kernel[t] * in[x + t - padding];
+			out[x] += sum;
+		};
+		for (size_t x = 0; x < begin; ++x)
+			edge(x);
+		for (size_t x = end; x < ow; ++x)
+			edge(x);
+	}
+
+	// reals of scratch separableConvolve() takes, a row of the image after the vertical pass
+	size_t separableScratchSize(size_t width)
+	{
+		return width;
+	}
+
+	// output += the stride 1 convolution of the height x width image, row after row, with vertical * horizontal
+	// surrounded by paddingY rows and paddingX columns of zeros. output takes (height + 2 paddingY - verticalTaps + 1)
+	// x (width + 2 paddingX - horizontalTaps + 1). Every output row is the sum of the image rows it sees, weighted
+	// by the vertical taps, correlated with the horizontal taps
+	void separableConvolve(const real* image, size_t height, size_t width, const real* vertical, size_t verticalTaps, size_t paddingY,
+		const real* horizontal, size_t horizontalTaps, size_t paddingX, real* output, real* scratch)
+	{
+		const size_t oh = height + 2 * paddingY - verticalTaps + 1, ow = width + 2 * paddingX - horizontalTaps + 1;
+		for (size_t oy = 0; oy < oh; ++oy)
+		{
+			std::fill(scratch, scratch + width, real(0.0));
+			for (size_t t = 0; t < verticalTaps; ++t)
+			{
+				const size_t y = oy + t;
+				if (y >= paddingY && y - paddingY < height)
+					axpy(width, vertical[t], image + (y - paddingY) * width, scratch);
+			}
+			correlateRow(scratch, width, horizontal, horizontalTaps, paddingX, output + oy * ow, ow);
+		}
+	}
+#endif
+}
@@ -0,0 +1,309 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "cpu_features.hpp"
+
+namespace nn
+{
+	// cache blocking of sgemm: a depth x cols panel of op(b) is packed once per kc x nc block and
+	// streamed from L2/L3, mc x kc blocks of op(a) are packed to stay in L2
+	struct sgemm_blocking
+	{
+		size_t mc = 128;
+		size_t kc = 256;
+		size_t nc = 2048;
+	};
+
+	// register tile of a micro kernel: c[0:mr, 0:nr] = alpha * a * b + beta * c over depth, a is packed in
+	// panels of mr rows and b in panels of nr columns, one panel column (row) per depth step. c isn't read
+	// when beta is zero
+	using SgemmKernel = void(*)(size_t depth, const float* a, const float* b, float* c, size_t ldc, float alpha, float beta);
+
+	struct sgemm_kernel
+	{
+		const char* name;
+		size_t mr;
+		size_t nr;
+		SgemmKernel run;
+	};
+
+	namespace
+	{
+		const size_t kSgemmMaxTile = 32 * 8;
+
+		// portable tile, left for the compiler to vectorize
+		void sgemmKernelGeneric(size_t depth, const float* a, const float* b, float* c, size_t ldc, float alpha, float beta)
+		{
+			float acc[4][8] = {};
+			for (size_t p = 0; p < depth; ++p, a += 8, b += 4)
+				for (int j = 0; j < 4; ++j)
+					for (int i = 0; i < 8; ++i)
+						acc[j][i] += a[i] * b[j];
+			for (int j = 0; j < 4; ++j)
+				for (int i = 0; i < 8; ++i)
+					c[i + j * ldc] = alpha * acc[j][i] + (beta != 0.0f ? beta * c[i + j * ldc] : 0.0f);
+		}
+
+#if NN_X86
+		// 16 x 6 tile: 12 accumulators, two loads of a and six broadcasts of b per step
+		NN_TARGET_AVX2 void sgemmKernelAvx2(size_t depth, const float* a, const float* b, float* c, size_t ldc, float alpha, float beta)
+		{
+			__m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c02 = _mm256_setzero_ps();
+			__m256 c03 = _mm256_setzero_ps(), c04 = _mm256_setzero_ps(), c05 = _mm256_setzero_ps();
+			__m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps(), c12 = _mm256_setzero_ps();
+			__m256 c13 = _mm256_setzero_ps(), c14 = _mm256_setzero_ps(), c15 = _mm256_setzero_ps();
+			for (size_t p = 0; p < depth; ++p, a += 16, b += 6)
+			{
+				const __m256 a0 = _mm256_loadu_ps(a);
+				const __m256 a1 = _mm256_loadu_ps(a + 8);
+				__m256 bj = _mm256_broadcast_ss(b);
+				c00 = _mm256_fmadd_ps(a0, bj, c00);
+				c10 = _mm256_fmadd_ps(a1, bj, c10);
+				bj = _mm256_broadcast_ss(b + 1);
+				c01 = _mm256_fmadd_ps(a0, bj, c01);
+				c11 = _mm256_fmadd_ps(a1, bj, c11);
+				bj = _mm256_broadcast_ss(b + 2);
+				c02 = _mm256_fmadd_ps(a0, bj, c02);
+				c12 = _mm256_fmadd_ps(a1, bj, c12);
+				bj = _mm256_broadcast_ss(b + 3);
+				c03 = _mm256_fmadd_ps(a0, bj, c03);
+				c13 = _mm256_fmadd_ps(a1, bj, c13);
+				bj = _mm256_broadcast_ss(b + 4);
+				c04 = _mm256_fmadd_ps(a0, bj, c04);
+				c14 = _mm256_fmadd_ps(a1, bj, c14);
+				bj = _mm256_broadcast_ss(b + 5);
+				c05 = _mm256_fmadd_ps(a0, bj, c05);
+				c15 = _mm256_fmadd_ps(a1, bj, c15);
+			}
+			const __m256 scale = _mm256_set1_ps(alpha), scaleC = _mm256_set1_ps(beta);
+			const __m256 acc[2][6] = { { c00, c01, c02, c03, c04, c05 }, { c10, c11, c12, c13, c14, c15 } };
+			for (int j = 0; j < 6; ++j)
+				for (int i = 0; i < 2; ++i)
+				{
+					float* dst = c + j * ldc + 8 * i;
+					if (beta == 0.0f)
+						_mm256_storeu_ps(dst, _mm256_mul_ps(acc[i][j], scale));
+					else if (beta == 1.0f)
+						_mm256_storeu_ps(dst, _mm256_fmadd_ps(acc[i][j], scale, _mm256_loadu_ps(dst)));
+					else
+						_mm256_storeu_ps(dst, _mm256_fmadd_ps(acc[i][j], scale, _mm256_mul_ps(_mm256_loadu_ps(dst), scaleC)));
+				}
+		}
+
+		// 32 x 8 tile: 16 accumulators, two loads of a and eight broadcasts of b per step
+		NN_TARGET_AVX512 void sgemmKernelAvx512(size_t depth, const float* a, const float* b, float* c, size_t ldc, float alpha, float beta)
+		{
+			__m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps(), c02 = _mm512_setzero_ps(), c03 = _mm512_setzero_ps();
+			__m512 c04 = _mm512_setzero_ps(), c05 = _mm512_setzero_ps(), c06 = _mm512_setzero_ps(), c07 = _mm512_setzero_ps();
+			__m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps(), c12 = _mm512_setzero_ps(), c13 = _mm512_setzero_ps();
+			__m512 c14 = _mm512_setzero_ps(), c15 = _mm512_setzero_ps(), c16 = _mm512_setzero_ps(), c17 = _mm512_setzero_ps();
+			for (size_t p = 0; p < depth; ++p, a += 32, b += 8)
+			{
+				const __m512 a0 = _mm512_loadu_ps(a);
+				const __m512 a1 = _mm512_loadu_ps(a + 16);
+				__m512 bj = _mm512_set1_ps(b[0]);
+				c00 = _mm512_fmadd_ps(a0, bj, c00);
+				c10 = _mm512_fmadd_ps(a1, bj, c10);
+				bj = _mm512_set1_ps(b[1]);
+				c01 = _mm512_fmadd_ps(a0, bj, c01);
+				c11 = _mm512_fmadd_ps(a1, bj, c11);
+				bj = _mm512_set1_ps(b[2]);
+				c02 = _mm512_fmadd_ps(a0, bj, c02);
+				c12 = _mm512_fmadd_ps(a1, bj, c12);
+				bj = _mm512_set1_ps(b[3]);
+				c03 = _mm512_fmadd_ps(a0, bj, c03);
+				c13 = _mm512_fmadd_ps(a1, bj, c13);
+				bj = _mm512_set1_ps(b[4]);
+				c04 = _mm512_fmadd_ps(a0, bj, c04);
+				c14 = _mm512_fmadd_ps(a1, bj, c14);
+				bj = _mm512_set1_ps(b[5]);
+				c05 = _mm512_fmadd_ps(a0, bj, c05);
+				c15 = _mm512_fmadd_ps(a1, bj, c15);
+				bj = _mm512_set1_ps(b[6]);
+				c06 = _mm512_fmadd_ps(a0, bj, c06);
+				c16 = _mm512_fmadd_ps(a1, bj, c16);
+				bj = _mm512_set1_ps(b[7]);
+				c07 = _mm512_fmadd_ps(a0, bj, c07);
+				c17 = _mm512_fmadd_ps(a1, bj, c17);
+			}
+			const __m512 scale = _mm512_set1_ps(alpha), scaleC = _mm512_set1_ps(beta);
+			const __m512 acc[2][8] = { { c00, c01, c02, c03, c04, c05, c06, c07 }, { c10, c11, c12, c13, c14, c15, c16, c17 } };
+			for (int j = 0; j < 8; ++j)
+				for (int i = 0; i < 2; ++i)
+				{
+					float* dst = c + j * ldc + 16 * i;
+					if (beta == 0.0f)
+						_mm512_storeu_ps(dst, _mm512_mul_ps(acc[i][j], scale));
+					else if (beta == 1.0f)
+						_mm512_storeu_ps(dst, _mm512_fmadd_ps(acc[i][j], scale, _mm512_loadu_ps(dst)));
+					else
+						_mm512_storeu_ps(dst, _mm512_fmadd_ps(acc[i][j], scale, _mm512_mul_ps(_mm512_loadu_ps(dst), scaleC)));
+				}
+		}
+#endif
+
+		size_t sgemmRoundUp(size_t size, size_t multiple) { return (size + multiple - 1) / multiple * multiple; }
+		// keeps both packed blocks 64 byte aligned if the buffer is
+		size_t sgemmAligned(size_t size) { return (size + 15) & ~size_t(15); }
+
+		// c = beta * c over a rows x cols block, zeroes it when beta is zero
+		void sgemmScale(size_t rows, size_t cols, float beta, float* c, size_t ldc)
+		{
+			if (beta == 1.0f)
+				return;
+			for (size_t j = 0; j < cols; ++j)
+				for (size_t i = 0; i < rows; ++i)
+					c[i + j * ldc] = beta != 0.0f ? beta * c[i + j * ldc] : 0.0f;
+		}
+
+		// rows x depth block of op(a) in panels of mr rows, zero padded to whole panels. a points at the
+		// first element of the block, element (i, p) is a[i + p * lda], or a[p + i * lda] if transposed.
+		// Sources are read along their contiguous dimension
+		void sgemmPackA(const float* a, size_t lda, bool transpose, size_t rows, size_t depth, size_t mr, float* packed)
+		{
+			for (size_t i0 = 0; i0 < rows; i0 += mr, packed += mr * depth)
+			{
+				const size_t height = std::min(mr, rows - i0);
+				if (height < mr)
+					std::fill(packed, packed + mr * depth, 0.0f);
+				if (!transpose)
+				{
+					for (size_t p = 0; p < depth; ++p)
+						std::copy(a + i0 + p * lda, a + i0 + p * lda + height, packed + p * mr);
+				}
+				else
+				{
+					for (size_t i = 0; i < height; ++i)
+					{
+						const float* src = a + (i0 + i) * lda;
+						for (size_t p = 0; p < depth; ++p)
+							packed[p * mr + i] = src[p];
+					}
+				}
+			}
+		}
+
+		// depth x cols block of op(b) in panels of nr columns, the same way
+		void sgemmPackB(const float* b, size_t ldb, bool transpose, size_t depth, size_t cols, size_t nr, float* packed)
+		{
+			for (size_t j0 = 0; j0 < cols; j0 += nr, packed += nr * depth)
+			{
+				const size_t width = std::min(nr, cols - j0);
+				if (width < nr)
+					std::fill(packed, packed + nr * depth, 0.0f);
+				if (transpose)
+				{
+					for (size_t p = 0; p < depth; ++p)
+						std::copy(b + j0 + p * ldb, b + j0 + p * ldb + width, packed + p * nr);
+				}
+				else
+				{
+					for (size_t j = 0; j < width; ++j)
+					{
+						const float* src = b + (j0 + j) * ldb;
+						for (size_t p = 0; p < depth; ++p)
+							packed[p * nr + j] = src[p];
+					}
+				}
+			}
+		}
+	}
+
+	// kernels this CPU can run, the portable one first
+	std::vector<sgemm_kernel> sgemmKernels()
+	{
+		std::vector<sgemm_kernel> kernels{ sgemm_kernel{ "generic", 8, 4, sgemmKernelGeneric } };
+#if NN_X86
+		if (cpuFeatures().avx2)
+			kernels.push_back(sgemm_kernel{ "avx2", 16, 6, sgemmKernelAvx2 });
+		if (cpuFeatures().avx512f)
+			kernels.push_back(sgemm_kernel{ "avx512", 32, 8, sgemmKernelAvx512 });
+#endif
+		return kernels;
+	}
+
+	// the widest kernel this CPU can run, chosen on the first call
+	const sgemm_kernel& sgemmKernel()
+	{
+		static const sgemm_kernel kernel = sgemmKernels().back();
+		return kernel;
+	}
+
+	// number of floats the packing buffer of a rows x depth by depth x cols product takes
+	size_t sgemmPackingSize(size_t rows, size_t cols, size_t depth,
+		const sgemm_kernel& kernel = sgemmKernel(), const sgemm_blocking& blocking = sgemm_blocking())
+	{
+		const size_t mc = std::min(sgemmRoundUp(rows, kernel.mr), sgemmRoundUp(std::max<size_t>(blocking.mc, 1), kernel.mr));
+		const size_t nc = std::min(sgemmRoundUp(cols, kernel.nr), sgemmRoundUp(std::max<size_t>(blocking.nc, 1), kernel.nr));
+		const size_t kc = std::min(depth, std::max<size_t>(blocking.kc, 1));
+		return sgemmAligned(mc * kc) + sgemmAligned(kc * nc);
+	}
+
+	// c = alpha * op(a) * op(b) + beta * c over column-major storage with leading dimensions, op transposes
+	// when the flag is set. c isn't read when beta is zero, the first block of the depth overwrites it then.
+	// Single threaded and allocation-free, packing has to hold sgemmPackingSize() floats
+	void sgemm(size_t rows, size_t cols, size_t depth, float alpha,
+		const float* a, size_t lda, bool transposeA,
+		const float* b, size_t ldb, bool transposeB,
+		float beta, float* c, size_t ldc,
+		float* packing, size_t packingSize,
+		const sgemm_kernel& kernel = sgemmKernel(), const sgemm_blocking& blocking = sgemm_blocking())
+	{
+		if (rows == 0 || cols == 0)
+			return;
+		if (depth == 0)
+		{
+			sgemmScale(rows, cols, beta, c, ldc);
+			return;
+		}
+		if (sgemmPackingSize(rows, cols, depth, kernel, blocking) > packingSize)
+			throw std::logic_error("Matrix product packing buffer is too small");
+		const size_t mr = kernel.mr;
+		const size_t nr = kernel.nr;
+		const size_t blockRows = sgemmRoundUp(std::max<size_t>(blocking.mc, 1), mr);
+		const size_t blockCols = sgemmRoundUp(std::max<size_t>(blocking.nc, 1), nr);
+		const size_t blockDepth = std::max<size_t>(blocking.kc, 1);
+		float* packedA = packing;
+		float* packedB = packing + sgemmAligned(std::min(sgemmRoundUp(rows, mr), blockRows) * std::min(depth, blockDepth));
+		float tile[kSgemmMaxTile];
+
+		for (size_t jc = 0; jc < cols; jc += blockCols)
+		{
+			const size_t nc = std::min(blockCols, cols - jc);
+			for (size_t pc = 0; pc < depth; pc += blockDepth)
+			{
+				const size_t kc = std::min(blockDepth, depth - pc);
+				// later blocks of the depth add to what the first one left
+				const float blockBeta = pc == 0 ? beta : 1.0f;
+				sgemmPackB(b + (transposeB ? jc + pc * ldb : pc + jc * ldb), ldb, transposeB, kc, nc, nr, packedB);
+				for (size_t ic = 0; ic < rows; ic += blockRows)
+				{
+					const size_t mc = std::min(blockRows, rows - ic);
+					sgemmPackA(a + (transposeA ? pc + ic * lda : ic + pc * lda), lda, transposeA, mc, kc, mr, packedA);
+					for (size_t jr = 0; jr < nc; jr += nr)
+						for (size_t ir = 0; ir < mc; ir += mr)
+						{
+							const float* panelA = packedA + ir * kc;
+							const float* panelB = packedB + jr * kc;
+							float* dst = c + (ic + ir) + (jc + jr) * ldc;
+							if (ir + mr <= mc && jr + nr <= nc)
+							{
+								kernel.run(kc, panelA, panelB, dst, ldc, alpha, blockBeta);
+								continue;
+							}
+							// partial tiles go through a scratch tile
+							kernel.run(kc, panelA, panelB, tile, mr, alpha, 0.0f);
+							const size_t height = std::min(mr, mc - ir);
+							const size_t width = std::min(nr, nc - jr);
+							sgemmScale(height, width, blockBeta, dst, ldc);
+							for (size_t j = 0; j < width; ++j)
+								for (size_t i = 0; i < height; ++i)
+									dst[i + j * ldc] += tile[i + j * mr];
+						}
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <stdint.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace nn
+{
+	// persistent pool of worker threads, each with its own task deque. Workers take tasks
+	// from the back of their own deque, then from the queue of tasks submitted by other threads
+	// and steal from the front of the other deques when idle. Submissions from outside the
+	// pool run in FIFO order, so concurrent callers can't starve each other
+	class thread_pool
+	{
+	public:
+		using Task = std::function<void()>;
+		// [begin, end) chunk of a parallel_for range and the index of the worker running it
+		using RangeTask = std::function<void(size_t begin, size_t end, uint32_t worker)>;
+
+		explicit thread_pool(uint32_t workers = std::thread::hardware_concurrency(), bool pinThreads = false) :
+			m_queues(std::max(workers, 1u))
+		{
+			for (uint32_t i = 0; i < m_queues.size(); ++i)
+				m_queues[i].reset(new queue());
+			for (uint32_t i = 0; i < m_queues.size(); ++i)
+			{
+				m_threads.push_back(std::thread(&thread_pool::work, this, i));
+				if (pinThreads)
+					pin(m_threads.back(), i);
+			}
+		}
+
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_sleepMutex);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+			for (auto& thread : m_threads)
+				thread.join();
+		}
+
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+
+		// number of workers, worker indices passed to tasks are below this
+		uint32_t size() const { return uint32_t(m_queues.size()); }
+
+		// index of the calling thread if it is a worker of this pool, size() otherwise
+		uint32_t currentWorker() const { return t_pool == this ? t_worker : size(); }
+
+		// task must not throw, parallel_for forwards exceptions of its chunks to the caller
+		void submit(Task task)
+		{
+			const uint32_t worker = currentWorker();
+			// workers keep their own tasks local
+			auto& q = worker < size() ? *m_queues[worker] : m_injected;
+			{
+				std::lock_guard<std::mutex> lock(q.mutex);
+				q.tasks.push_back(std::move(task));
+			}
+			m_pending++;
+			{
+				std::lock_guard<std::mutex> lock(m_sleepMutex);
+			}
+			m_wake.notify_one();
+		}
+
+		// splits [begin, end) into chunks of grain items and blocks until all of them ran.
+		// A worker calling it executes tasks while waiting, so nested calls don't deadlock
+		void parallel_for(size_t begin, size_t end, size_t grain, const RangeTask& func)
+		{
+			if (begin >= end)
+				return;
+			grain = std::max<size_t>(grain, 1);
+			struct group
+			{
+				std::atomic<size_t> left;
+				std::mutex mutex;
+				std::condition_variable done;
+				std::exception_ptr error;
+			} g;
+			g.left = (end - begin + grain - 1) / grain;
+			for (size_t chunk = begin; chunk < end; chunk += grain)
+			{
+				const size_t chunkEnd = std::min(chunk + grain, end);
+				submit([this, &g, &func, chunk, chunkEnd]
+				{
+					try
+					{
+						func(chunk, chunkEnd, t_worker);
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(g.mutex);
+						g.error = std::current_exception();
+					}
+					std::lock_guard<std::mutex> lock(g.mutex);
+					if (--g.left == 0)
+						g.done.notify_all();
+				});
+			}
+
+			const uint32_t worker = currentWorker();
+			if (worker < size())
+			{
+				while (g.left)
+					if (!runOne(worker))
+						std::this_thread::yield();
+			}
+			std::unique_lock<std::mutex> lock(g.mutex);
+			g.done.wait(lock, [&] { return g.left == 0; });
+			if (g.error)
+				std::rethrow_exception(g.error);
+		}
+	private:
+		struct queue
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		static void pin(std::thread& thread, uint32_t index)
+		{
+			const uint32_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+#ifdef _WIN32
+			SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << (index % cores));
+#else
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(index % cores, &set);
+			pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+		}
+
+		bool take(uint32_t worker, Task& task)
+		{
+			{
+				auto& own = *m_queues[worker];
+				std::lock_guard<std::mutex> lock(own.mutex);
+				if (!own.tasks.empty())
+				{
+					task = std::move(own.tasks.back());
+					own.tasks.pop_back();
+					m_pending--;
+					return true;
+				}
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_injected.mutex);
+				if (!m_injected.tasks.empty())
+				{
+					task = std::move(m_injected.tasks.front());
+					m_injected.tasks.pop_front();
+					m_pending--;
+					return true;
+				}
+			}
+			for (uint32_t i = 1; i < size(); ++i)
+			{
+				auto& victim = *m_queues[(worker + i) % size()];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.tasks.empty())
+				{
+					task = std::move(victim.tasks.front());
+					victim.tasks.pop_front();
+					m_pending--;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool runOne(uint32_t worker)
+		{
+			Task task;
+			if (!take(worker, task))
+				return false;
+			task();
+			return true;
+		}
+
+		void work(uint32_t worker)
+		{
+			t_pool = this;
+			t_worker = worker;
+			while (true)
+			{
+				if (runOne(worker))
+					continue;
+				std::unique_lock<std::mutex> lock(m_sleepMutex);
+				m_wake.wait(lock, [&] { return m_stop || m_pending > 0; });
+				if (m_stop)
+					return;
+			}
+		}
+
+		std::vector<std::unique_ptr<queue>> m_queues;
+		std::vector<std::thread> m_threads;
+		queue m_injected;
+		std::atomic<int64_t> m_pending{ 0 };
+		std::mutex m_sleepMutex;
+		std::condition_variable m_wake;
+		bool m_stop = false;
+
+		static thread_local thread_pool* t_pool;
+		static thread_local uint32_t t_worker;
+	};
+
+	thread_local thread_pool* thread_pool::t_pool = nullptr;
+	thread_local uint32_t thread_pool::t_worker = 0;
+}
@@ -24,6 +24,12 @@ namespace nn
 			static std::normal_distribution<real> nd(real(0.0), real(1.0));
 			return nd(rng);
 		}
+		// with a caller-owned generator, used to initialize weights in parallel
+		real operator()(std::mt19937& rng) const
+		{
+			std::normal_distribution<real> nd(real(0.0), real(1.0));
+			return nd(rng);
+		}
 	};
 
 	template<>
@@ -37,6 +43,11 @@ namespace nn
 			static std::normal_distribution<real> nd(real(0.0), real(1.0 / sqrt(m_n)));
 			return nd(rng);
 		}
+		real operator()(std::mt19937& rng) const
+		{
+			std::normal_distribution<real> nd(real(0.0), real(1.0 / sqrt(m_n)));
+			return nd(rng);
+		}
 	};
 
 	template<>
@@ -48,10 +59,19 @@ namespace nn
 			static std::uniform_real_distribution<real> nd(real(0.0), real(1.0));
 			return nd(rng);
 		}
+		real operator()(std::mt19937& rng) const
+		{
+			std::uniform_real_distribution<real> nd(real(0.0), real(1.0));
+			return nd(rng);
+		}
 	};
 
 	template<>
-	struct weight_initalization<WeightInitializationType::kZeros> { real operator()(real) const { return real(0.0); } };
+	struct weight_initalization<WeightInitializationType::kZeros>
+	{
+		real operator()(real) const { return real(0.0); }
+		real operator()(std::mt19937&) const { return real(0.0); }
+	};
 	template<>
 	struct weight_initalization<WeightInitializationType::kSequentialDebug>
 	{
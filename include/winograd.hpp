@@ -0,0 +1,237 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <stdexcept>
+#include "settings.hpp"
+#include "im2col.hpp"
+#include "gemm.hpp"
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// Winograd F(m x m, 3 x 3) for 3 x 3 stride 1 convolutions: every m x m output tile is computed from an
+	// (m + 2) x (m + 2) input tile with (m + 2)^2 multiplications per channel and filter instead of 9 m^2,
+	// 2.25x fewer for m = 2 and 4x fewer for m = 4. The transforms of Lavin and Gray, "Fast Algorithms for
+	// Convolutional Neural Networks": Y = A^T [(G g G^T) . (B^T d B)] A, summed over the channels by a
+	// product per element of the transformed tiles. F(4x4) loses a few bits to its larger transforms
+	namespace
+	{
+		// the 1D transforms of F(m, 3) on elements stride apart, the 2D ones apply them to the columns and then to the rows
+		template <uint32_t m> struct winograd_transforms;
+		template <>
+		struct winograd_transforms<2>
+		{
+			// B^T d, 4 inputs to 4
+			static void input(const real* d, size_t ds, real* v, size_t vs)
+			{
+				v[0] = d[0] - d[2 * ds];
+				v[vs] = d[ds] + d[2 * ds];
+				v[2 * vs] = d[2 * ds] - d[ds];
+				v[3 * vs] = d[ds] - d[3 * ds];
+			}
+			// G g, 3 taps to 4
+			static void filter(const real* g, size_t gs, real* u, size_t us)
+			{
+				const real half = real(0.5);
+				u[0] = g[0];
+				u[us] = half * (g[0] + g[gs] + g[2 * gs]);
+				u[2 * us] = half * (g[0] - g[gs] + g[2 * gs]);
+				u[3 * us] = g[2 * gs];
+			}
+			// A^T p, 4 products to 2 outputs
+			static void output(const real* p, size_t ps, real* y, size_t ys)
+			{
+				y[0] = p[0] + p[ps] + p[2 * ps];
+				y[ys] = p[ps] - p[2 * ps] - p[3 * ps];
+			}
+		};
+		template <>
+		struct winograd_transforms<4>
+		{
+			// B^T d, 6 inputs to 6
+			static void input(const real* d, size_t ds, real* v, size_t vs)
+			{
+				const real d0 = d[0], d1 = d[ds], d2 = d[2 * ds], d3 = d[3 * ds], d4 = d[4 * ds], d5 = d[5 * ds];
+				v[0] = real(4.0) * d0 - real(5.0) * d2 + d4;
+				v[vs] = d3 + d4 - real(4.0) * (d1 + d2);
+				v[2 * vs] = d4 - d3 + real(4.0) * (d1 - d2);
+				v[3 * vs] = d4 - d2 + real(2.0) * (d3 - d1);
+				v[4 * vs] = d4 - d2 + real(2.0) * (d1 - d3);
+				v[5 * vs] = real(4.0) * d1 - real(5.0) * d3 + d5;
+			}
+			// G g, 3 taps to 6
+			static void filter(const real* g, size_t gs, real* u, size_t us)
+			{
+				const real g0 = g[0], g1 = g[gs], g2 = g[2 * gs];
+				u[0] = g0 / real(4.0);
+				u[us] = -(g0 + g1 + g2) / real(6.0);
+				u[2 * us] = -(g0 - g1 + g2) / real(6.0);
+				u[3 * us] = g0 / real(24.0) + g1 / real(12.0) + g2 / real(6.0);
+				u[4 * us] = g0 / real(24.0) - g1 / real(12.0) + g2 / real(6.0);
+				u[5 * us] = g2;
+			}
+			// A^T p, 6 products to 4 outputs
+			static void output(const real* p, size_t ps, real* y, size_t ys)
+			{
+				const real p0 = p[0], p1 = p[ps], p2 = p[2 * ps], p3 = p[3 * ps], p4 = p[4 * ps], p5 = p[5 * ps];
+				y[0] = p0 + p1 + p2 + p3 + p4;
+				y[ys] = p1 - p2 + real(2.0) * (p3 - p4);
+				y[2 * ys] = p1 + p2 + real(4.0) * (p3 + p4);
+				y[3 * ys] = p1 - p2 + real(8.0) * (p3 - p4) + p5;
+			}
+		};
+
+		// tiles transformed together, their transforms take about half of a 256 KB cache
+		size_t winogradBlockTiles(const conv_geometry& g, uint32_t m)
+		{
+			const size_t alpha = m + 2;
+			const size_t tiles = size_t((g.outputHeight() + m - 1) / m) * ((g.outputWidth() + m - 1) / m);
+			return std::max<size_t>(1, std::min(tiles, size_t(32768) / (alpha * alpha * (g.channels + g.filters))));
+		}
+
+		void checkWinograd(const conv_geometry& g, uint32_t m)
+		{
+			if ((m != 2 && m != 4) || g.kernelSize != 3 || g.stride != 1)
+				throw std::logic_error("Winograd convolution takes 3x3 kernels with stride 1 and 2x2 or 4x4 tiles");
+		}
+
+		template <uint32_t m>
+		void winogradTransformFilters(const conv_geometry& g, const real* weights, size_t ldw, real* transformed)
+		{
+			const uint32_t alpha = m + 2;
+			const size_t block = size_t(g.filters) * g.channels;
+			for (uint32_t f = 0; f < g.filters; ++f)
+				for (uint32_t c = 0; c < g.channels; ++c)
+				{
+					// G k G^T, the columns of the 3 x 3 kernel and then the rows of the alpha x 3 result
+					real gk[alpha * 3];
+					const real* kernel = weights + f + size_t(c) * 9 * ldw;
+					for (uint32_t j = 0; j < 3; ++j)
+						winograd_transforms<m>::filter(kernel + j * ldw, 3 * ldw, gk + j, 3);
+					for (uint32_t i = 0; i < alpha; ++i)
+						winograd_transforms<m>::filter(gk + i * 3, 1, transformed + (i * alpha * block + c * g.filters + f), block);
+				}
+		}
+
+		template <uint32_t m>
+		void winogradConvolve(const conv_geometry& g, const real* transformed, const real* image, real* output, real* scratch, size_t scratchSize)
+		{
+			const uint32_t alpha = m + 2;
+			const size_t oh = g.outputHeight(), ow = g.outputWidth();
+			const size_t tilesX = (ow + m - 1) / m, tiles = ((oh + m - 1) / m) * tilesX;
+			const size_t blockTiles = winogradBlockTiles(g, m);
+			const size_t filterBlock = size_t(g.filters) * g.channels;
+			// transformed input tiles, channels x tiles per element, then the products, filters x tiles per element
+			real* v = scratch;
+			real* products = v + gemm_blocking::aligned(alpha * alpha * g.channels * blockTiles);
+			real* packing = products + gemm_blocking::aligned(alpha * alpha * g.filters * blockTiles);
+			const size_t packingSize = scratchSize - size_t(packing - scratch);
+
+			for (size_t first = 0; first < tiles; first += blockTiles)
+			{
+				const size_t count = std::min(blockTiles, tiles - first);
+				for (size_t t = 0; t < count; ++t)
+				{
+					const size_t y0 = (first + t) / tilesX * m, x0 = (first + t) % tilesX * m;
+					// the input tile starts padding pixels above and left of the output tile, tiles inside the image
+					// are transformed in place, the others from a copy with zeros outside the image
+					const bool inside = y0 >= g.padding && x0 >= g.padding && y0 + alpha <= g.height + g.padding && x0 + alpha <= g.width + g.padding;
+					for (uint32_t c = 0; c < g.channels; ++c)
+					{
+						real d[alpha * alpha], bd[alpha * alpha];
+						const real* tile = d;
+						size_t stride = alpha;
+						if (inside)
+						{
+							tile = image + (size_t(c) * g.height + y0 - g.padding) * g.width + x0 - g.padding;
+							stride = g.width;
+						}
+						else
+							for (uint32_t i = 0; i < alpha; ++i)
+							{
+								const size_t y = y0 + i;
+								const bool rowInside = y >= g.padding && y - g.padding < g.height;
+								const real* row = image + (size_t(c) * g.height + (rowInside ? y - g.padding : 0)) * g.width;
+								for (uint32_t j = 0; j < alpha; ++j)
+								{
+									const size_t x = x0 + j;
+									d[i * alpha + j] = rowInside && x >= g.padding && x - g.padding < g.width ? row[x - g.padding] : real(0.0);
+								}
+							}
+						// B^T d B straight into the element rows of v
+						for (uint32_t j = 0; j < alpha; ++j)
+							winograd_transforms<m>::input(tile + j, stride, bd + j, alpha);
+						for (uint32_t i = 0; i < alpha; ++i)
+							winograd_transforms<m>::input(bd + i * alpha, 1, v + ((i * alpha * blockTiles + t) * g.channels + c), blockTiles * g.channels);
+					}
+				}
+
+				for (uint32_t e = 0; e < alpha * alpha; ++e)
+				{
+					const real* u = transformed + e * filterBlock;
+					const real* ve = v + e * blockTiles * g.channels;
+					real* pe = products + e * blockTiles * g.filters;
+					backend().gemm(g.filters, count, g.channels, real(1.0), u, g.filters, false, ve, g.channels, false, real(0.0), pe, g.filters, packing, packingSize);
+				}
+
+				for (size_t t = 0; t < count; ++t)
+				{
+					const size_t y0 = (first + t) / tilesX * m, x0 = (first + t) % tilesX * m;
+					const size_t rows = std::min<size_t>(m, oh - y0), cols = std::min<size_t>(m, ow - x0);
+					for (uint32_t f = 0; f < g.filters; ++f)
+					{
+						// A^T p A from the element rows of the products
+						real ap[m * alpha], y[m * m];
+						for (uint32_t j = 0; j < alpha; ++j)
+							winograd_transforms<m>::output(products + ((j * blockTiles + t) * g.filters + f), alpha * blockTiles * g.filters, ap + j, alpha);
+						for (uint32_t i = 0; i < m; ++i)
+							winograd_transforms<m>::output(ap + i * alpha, 1, y + i * m, 1);
+						real* out = output + f * oh * ow + y0 * ow + x0;
+						for (size_t i = 0; i < rows; ++i)
+							for (size_t j = 0; j < cols; ++j)
+								out[i * ow + j] += y[i * m + j];
+					}
+				}
+			}
+		}
+	}
+
+	// reals the filters of g take transformed for F(m x m, 3 x 3)
+	size_t winogradFilterSize(const conv_geometry& g, uint32_t m)
+	{
+		return size_t(m + 2) * (m + 2) * g.filters * g.channels;
+	}
+
+	// reals of scratch winogradConvolve takes per image
+	size_t winogradScratchSize(const conv_geometry& g, uint32_t m)
+	{
+		const size_t alpha = m + 2, blockTiles = winogradBlockTiles(g, m);
+		return gemm_blocking::aligned(alpha * alpha * g.channels * blockTiles) + gemm_blocking::aligned(alpha * alpha * g.filters * blockTiles) +
+			gemmPackingSize(g.filters, blockTiles, g.channels);
+	}
+
+	// transforms the filters x patchSize weights with leading dimension ldw once, for any number of images
+	// convolved with them until they change
+	void winogradTransformFilters(const conv_geometry& g, uint32_t m, const real* weights, size_t ldw, real* transformed)
+	{
+		checkWinograd(g, m);
+		if (m == 2)
+			winogradTransformFilters<2>(g, weights, ldw, transformed);
+		else
+			winogradTransformFilters<4>(g, weights, ldw, transformed);
+	}
+
+	// output += the convolution of one image with the transformed filters, output is filters x outputHeight x outputWidth
+	void winogradConvolve(const conv_geometry& g, uint32_t m, const real* transformed, const real* image, real* output, real* scratch, size_t scratchSize)
+	{
+		checkWinograd(g, m);
+		if (scratchSize < winogradScratchSize(g, m))
+			throw std::logic_error("Winograd scratch buffer is too small");
+		if (m == 2)
+			winogradConvolve<2>(g, transformed, image, output, scratch, scratchSize);
+		else
+			winogradConvolve<4>(g, transformed, image, output, scratch, scratchSize);
+	}
+#endif
+}
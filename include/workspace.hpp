@@ -0,0 +1,175 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "settings.hpp"
+#include "layer.hpp"
+#include "gemm.hpp"
+#if USE_EIGEN == 1
+#include <Eigen/Dense>
+#endif
+
+namespace nn
+{
+#if USE_EIGEN == 1
+	// buffers of one training step planned from the layer list and the batch size and carved out
+	// of one arena, so running the step doesn't touch the heap. Batches up to the planned size fit.
+	// The gradients of all layers are contiguous, the weights of every layer followed by its bias
+	class workspace
+	{
+	public:
+		using MatrixType = layer::MatrixType;
+		using MatrixMap = Eigen::Map<MatrixType>;
+		using ConstMatrixMap = Eigen::Map<const MatrixType>;
+		using Index = MatrixType::Index;
+
+		workspace() {}
+		workspace(const std::vector<layer>& layers, uint32_t batchSize) :
+			m_batchSize(batchSize),
+			m_layers(layers.size())
+		{
+			size_t maxUnits = 0;
+			for (size_t i = 1; i < layers.size(); ++i)
+			{
+				auto& l = m_layers[i];
+				l.units = layers[i].UnitsInLayer();
+				l.weightRows = layers[i].weightRows();
+				l.weightCols = layers[i].weightCols();
+				l.biasRows = layers[i].biasRows();
+				l.nablaW = m_gradientSize;
+				l.nablaB = l.nablaW + size_t(l.weightRows) * l.weightCols;
+				m_gradientSize = l.nablaB + l.biasRows;
+				maxUnits = std::max<size_t>(maxUnits, l.units);
+				// forward, weight gradient and delta products of the layer
+				m_packingSize = std::max(m_packingSize, layers[i].scratchSize(batchSize, true));
+			}
+
+			size_t size = gemm_blocking::aligned(m_gradientSize);
+			for (size_t i = 1; i < layers.size(); ++i)
+			{
+				auto& l = m_layers[i];
+				l.activations = size;
+				size += gemm_blocking::aligned(size_t(l.units) * batchSize);
+				l.derivatives = size;
+				// softmax layers have none
+				if (layers[i].type() != LayerType::kSoftmax)
+					size += gemm_blocking::aligned(size_t(l.units) * batchSize);
+			}
+			for (auto& delta : m_delta)
+			{
+				delta = size;
+				size += gemm_blocking::aligned(maxUnits * batchSize);
+			}
+			m_packing = size;
+			m_arena.resize(size + m_packingSize);
+		}
+
+		uint32_t batchSize() const { return m_batchSize; }
+
+		// outputs of the i-th layer for a batch of cols samples
+		MatrixMap activations(size_t i, Index cols) { return MatrixMap(at(m_layers[i].activations), m_layers[i].units, cols); }
+		ConstMatrixMap activations(size_t i, Index cols) const { return ConstMatrixMap(at(m_layers[i].activations), m_layers[i].units, cols); }
+		// derivatives of the activations of the i-th layer, softmax layers have none
+		MatrixMap derivatives(size_t i, Index cols) { return MatrixMap(at(m_layers[i].derivatives), m_layers[i].units, cols); }
+		// two buffers the error is passed back and forth between
+		MatrixMap delta(size_t k, Index rows, Index cols) { return MatrixMap(at(m_delta[k]), rows, cols); }
+
+		MatrixMap nablaW(size_t i) { return MatrixMap(at(m_layers[i].nablaW), m_layers[i].weightRows, m_layers[i].weightCols); }
+		ConstMatrixMap nablaW(size_t i) const { return ConstMatrixMap(at(m_layers[i].nablaW), m_layers[i].weightRows, m_layers[i].weightCols); }
+		MatrixMap nablaB(size_t i) { return MatrixMap(at(m_layers[i].nablaB), m_layers[i].biasRows, 1); }
+		ConstMatrixMap nablaB(size_t i) const { return ConstMatrixMap(at(m_layers[i].nablaB), m_layers[i].biasRows, 1); }
+		// all gradients as one range
+		real* gradients() { return at(0); }
+		const real* gradients() const { return at(0); }
+		size_t gradientSize() const { return m_gradientSize; }
+
+		real* packing() { return at(m_packing); }
+		size_t packingSize() const { return m_packingSize; }
+	private:
+		struct layer_buffers
+		{
+			uint32_t units = 0;
+			uint32_t weightRows = 0;
+			uint32_t weightCols = 0;
+			uint32_t biasRows = 0;
+			size_t activations = 0;
+			size_t derivatives = 0;
+			size_t nablaW = 0;
+			size_t nablaB = 0;
+		};
+
+		real* at(size_t offset) { return m_arena.data() + offset; }
+		const real* at(size_t offset) const { return m_arena.data() + offset; }
+
+		uint32_t m_batchSize = 0;
+		std::vector<layer_buffers> m_layers;
+		size_t m_delta[2];
+		size_t m_gradientSize = 0;
+		size_t m_packing = 0;
+		size_t m_packingSize = 0;
+		std::vector<real, Eigen::aligned_allocator<real>> m_arena;
+	};
+
+	// buffers of an inference pass: activations ping-pong between two buffers sized for the
+	// widest layer, nothing is kept per layer and no derivatives are computed
+	class inference_workspace
+	{
+	public:
+		using MatrixType = layer::MatrixType;
+		using MatrixMap = Eigen::Map<MatrixType>;
+		using Index = MatrixType::Index;
+
+		inference_workspace() {}
+		inference_workspace(const std::vector<layer>& layers, uint32_t batchSize) :
+			m_batchSize(batchSize)
+		{
+			size_t maxUnits = 0;
+			for (size_t i = 1; i < layers.size(); ++i)
+			{
+				maxUnits = std::max<size_t>(maxUnits, layers[i].UnitsInLayer());
+				m_packingSize = std::max(m_packingSize, layers[i].scratchSize(batchSize, false));
+			}
+			m_bufferSize = gemm_blocking::aligned(maxUnits * batchSize);
+			m_arena.resize(2 * m_bufferSize + m_packingSize);
+		}
+
+		uint32_t batchSize() const { return m_batchSize; }
+
+		MatrixMap buffer(size_t k, Index rows, Index cols) { return MatrixMap(m_arena.data() + k * m_bufferSize, rows, cols); }
+		real* packing() { return m_arena.data() + 2 * m_bufferSize; }
+		size_t packingSize() const { return m_packingSize; }
+	private:
+		uint32_t m_batchSize = 0;
+		size_t m_bufferSize = 0;
+		size_t m_packingSize = 0;
+		std::vector<real, Eigen::aligned_allocator<real>> m_arena;
+	};
+
+	// marks a training step which must not allocate. The count of scopes alive is kept per thread, and
+	// if EIGEN_RUNTIME_NO_MALLOC is defined Eigen asserts on every allocation while the count of the
+	// thread which opened or closed the latest scope is non zero. The Eigen flag is process wide, so with
+	// several threads training an allocation may go unnoticed, and code which runs outside the scopes
+	// while they are open (the evaluator) must not be built with it, see tests/no_malloc.cpp
+	class no_malloc_scope
+	{
+	public:
+		no_malloc_scope() { ++depth(); update(); }
+		~no_malloc_scope() { --depth(); update(); }
+
+		no_malloc_scope(const no_malloc_scope&) = delete;
+		no_malloc_scope& operator=(const no_malloc_scope&) = delete;
+	private:
+		static int& depth()
+		{
+			static thread_local int value = 0;
+			return value;
+		}
+
+		static void update()
+		{
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+			Eigen::internal::set_is_malloc_allowed(depth() == 0);
+#endif
+		}
+	};
+#endif
+}
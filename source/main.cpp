@@ -9,6 +9,9 @@
 #include "mnist.hpp"
 #include "timing.hpp"
 #include "network.hpp"
+#include "evaluator.hpp"
+#include "gemm_benchmark.hpp"
+#include "conv_benchmark.hpp"
 #include "convolution.hpp"
 #if USE_PYTHON == 1
 #ifdef _DEBUG
@@ -72,18 +75,28 @@ namespace
 int main()
 {
 	using namespace nn;
+	const bool benchmark_gemm = false;
+	if (benchmark_gemm)
+	{
+		benchmarkGemm(std::cout);
+		return 0;
+	}
+	const bool benchmark_conv = false;
+	if (benchmark_conv)
+	{
+		benchmarkConvolution(std::cout);
+		return 0;
+	}
+	std::cout << "Kernels: " << kernelReport() << std::endl;
+
 	const uint32_t epochs = 300;
 	const uint32_t dataset_size = 60000;
 	const uint32_t training_set_size = 55000;
-	std::vector<MatrixType> training_set, validation_set;
-	std::vector<uint8_t> training_labels, validation_labels;
+	dataset training_set, validation_set;
 	{
-		const auto images = loadMNISTImages("externals/mnist/train-images.idx3-ubyte", LoadSettings(kNormalize | kVectorize), dataset_size);
-		const auto labels = loadMNISTLabels("externals/mnist/train-labels.idx1-ubyte", dataset_size);
-		training_set = std::vector<MatrixType>(images.cbegin(), images.cbegin() + training_set_size);
-		validation_set = std::vector<MatrixType>(images.cbegin() + training_set_size, images.cend());
-		training_labels = std::vector<uint8_t>(labels.cbegin(), labels.cbegin() + training_set_size);
-		validation_labels = std::vector<uint8_t>(labels.cbegin() + training_set_size, labels.cend());
+		const auto samples = loadMNIST("externals/mnist/train-images.idx3-ubyte", "externals/mnist/train-labels.idx1-ubyte", LoadSettings(kNormalize | kVectorize), dataset_size);
+		training_set = samples.subset(0, training_set_size);
+		validation_set = samples.subset(training_set_size, samples.size());
 	}
 
 	network original_net;
@@ -98,24 +111,32 @@ int main()
 		network net = original_net;
 		// SGD
 		timing timer;
-		const uint32_t batches = uint32_t(training_set.size() / batch_size);
+		batch_pipeline pipeline(training_set, batch_size, 2, 16);
 		evaluate_results result;
+		// validation of an epoch runs in the background while the next one trains
+		async_evaluator evaluator(validation_set);
 		for (size_t epoch = 0u; epoch < epochs; ++epoch)
 		{
-			net.psgd(28, 28, batches, batch_size, eta, lambda, training_set, training_labels, false);
-			result = net.evaluate(validation_set, validation_labels);
-			graph_epoch.push_back(epoch);
-			graph_acc.push_back(result.accuracy);
-			std::cout << "acc: " << result.accuracy * 100.0f << "%, cost = " << result.cost << " (" << timer.seconds() << " seconds passed)" << std::endl;
+			net.psgd(pipeline, pipeline.batchesPerEpoch(), eta, lambda, UpdateType::kHogwild);
 			std::cout << "Epoch " << epoch << " (" << timer.seconds() << " seconds passed)" << std::endl;
+			evaluator.evaluate(net, [&, epoch](const evaluate_results& epochResult)
+			{
+				result = epochResult;
+				graph_epoch.push_back(epoch);
+				graph_acc.push_back(result.accuracy);
+				std::cout << "acc: " << result.accuracy * 100.0f << "%, cost = " << result.cost << " (epoch " << epoch << ", " << timer.seconds() << " seconds passed)" << std::endl;
+			});
 		}
+		evaluator.wait();
 
 		const bool dump_error_images = false;
 		if (dump_error_images)
 		{
+			MatrixType sample;
 			for (auto i : result.errors)
 			{
-				std::vector<float> img(validation_set[i].data(), validation_set[i].data() + 28 * 28);
+				const auto image = validation_set.batch(i, 1, sample);
+				std::vector<float> img(image.data(), image.data() + 28 * 28);
 #if USE_PYTHON == 1
 				plot_image(img, "error" + to_string(i) + ".png");
 #endif
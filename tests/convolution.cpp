@@ -0,0 +1,250 @@
+// checks the fast convolution algorithms against the direct loops, returns non zero when any of them
+// differs by more than its tolerance relative to the largest output
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "thread_pool.hpp"
+#include "conv_engine.hpp"
+#include "convolution.hpp"
+
+using namespace nn;
+
+namespace
+{
+	using MatrixType = Eigen::Matrix<real, Eigen::Dynamic, Eigen::Dynamic>;
+
+	// Winograd F(4,3) loses the most to its transforms, the FFT to the sums over large kernels
+	const real kTolerance = real(1e-4);
+
+	const char* algorithmName(ConvolutionAlgorithm algorithm)
+	{
+		switch (algorithm)
+		{
+		case ConvolutionAlgorithm::kAuto: return "auto";
+		case ConvolutionAlgorithm::kDirect: return "direct";
+		case ConvolutionAlgorithm::kIm2col: return "im2col";
+		case ConvolutionAlgorithm::kWinograd2x2: return "winograd 2x2";
+		case ConvolutionAlgorithm::kWinograd4x4: return "winograd 4x4";
+		case ConvolutionAlgorithm::kFft: return "fft";
+		default: return "?";
+		}
+	}
+
+	bool report(const std::string& name, const std::string& algorithm, const MatrixType& result, const MatrixType& reference)
+	{
+		const real scale = std::max(real(1.0), reference.cwiseAbs().maxCoeff());
+		const real error = (result - reference).cwiseAbs().maxCoeff() / scale;
+		const bool passed = result.rows() == reference.rows() && result.cols() == reference.cols() && error <= kTolerance;
+		std::cout << std::setw(52) << name << std::setw(24) << algorithm << std::setw(12) << std::scientific << std::setprecision(1) << error <<
+			(passed ? "" : "  FAILED") << std::endl;
+		return passed;
+	}
+
+	// one image through the engine the layers use, as they run it
+	MatrixType engineConvolve(const conv_geometry& g, ConvolutionAlgorithm algorithm, const MatrixType& weights, const MatrixType& image)
+	{
+		std::vector<real, Eigen::aligned_allocator<real>> scratch(convolutionScratchSize(g, algorithm));
+		const size_t filterSize = convolutionFilterSize(g, algorithm);
+		const size_t offset = filterSize ? gemm_blocking::aligned(filterSize) : 0;
+		MatrixType result = MatrixType::Zero(g.outputSize(), 1);
+		transformFilters(g, algorithm, weights.data(), size_t(weights.outerStride()), scratch.data());
+		convolveTransformed(g, algorithm, weights.data(), size_t(weights.outerStride()), scratch.data(), image.data(), result.data(),
+			scratch.data() + offset, scratch.size() - offset);
+		return result;
+	}
+
+	// layer shapes of 3x3 kernels, with tiles crossing the bottom and right edges and the automatic selection
+	bool checkEngine()
+	{
+		bool passed = true;
+		const conv_geometry shapes[] = {
+			conv_geometry(1, 8, 8, 2, 3, 1, 1), conv_geometry(3, 9, 7, 4, 3, 1, 0), conv_geometry(2, 3, 3, 3, 3, 1, 0),
+			conv_geometry(5, 13, 11, 70, 3, 1, 2), conv_geometry(16, 28, 28, 32, 3, 1, 1), conv_geometry(64, 50, 50, 8, 3, 1, 1) };
+		for (const auto& g : shapes)
+		{
+			const MatrixType weights = MatrixType::Random(g.filters, g.patchSize());
+			const MatrixType image = MatrixType::Random(g.inputSize(), 1);
+			const MatrixType reference = engineConvolve(g, ConvolutionAlgorithm::kDirect, weights, image);
+			const std::string name = std::to_string(g.channels) + "x" + std::to_string(g.height) + "x" + std::to_string(g.width) + " " +
+				std::to_string(g.filters) + "@3x3 pad " + std::to_string(g.padding);
+			for (auto algorithm : { ConvolutionAlgorithm::kWinograd2x2, ConvolutionAlgorithm::kWinograd4x4 })
+				passed &= report(name, algorithmName(algorithm), engineConvolve(g, algorithm, weights, image), reference);
+			const ConvolutionAlgorithm selected = selectConvolutionAlgorithm(g);
+			passed &= report(name, std::string("auto, ") + algorithmName(selected), engineConvolve(g, selected, weights, image), reference);
+		}
+		return passed;
+	}
+
+	// FFT overlap-add on odd kernels, valid and zero padded. Images larger than one FFT tile are split into
+	// blocks whose last ones cross the bottom and right edges, small ones are transformed whole
+	bool checkFft()
+	{
+		bool passed = true;
+		const conv_geometry images[] = {
+			conv_geometry(1, 8, 8, 1, 3), conv_geometry(3, 20, 17, 4, 5), conv_geometry(1, 130, 70, 2, 3), conv_geometry(2, 75, 131, 3, 7),
+			conv_geometry(1, 200, 150, 1, 13), conv_geometry(2, 90, 61, 2, 15), conv_geometry(1, 300, 250, 1, 31) };
+		for (const auto& image : images)
+			for (bool zeroPad : { false, true })
+			{
+				const conv_geometry g(image.channels, image.height, image.width, image.filters, image.kernelSize, 1, zeroPad ? image.kernelSize / 2 : 0);
+				const MatrixType weights = MatrixType::Random(g.filters, g.patchSize());
+				const MatrixType input = MatrixType::Random(g.inputSize(), 1);
+				const std::string name = std::to_string(g.channels) + "x" + std::to_string(g.height) + "x" + std::to_string(g.width) + " " +
+					std::to_string(g.filters) + "@" + std::to_string(g.kernelSize) + "x" + std::to_string(g.kernelSize) + " pad " + std::to_string(g.padding);
+				passed &= report(name, algorithmName(ConvolutionAlgorithm::kFft), engineConvolve(g, ConvolutionAlgorithm::kFft, weights, input),
+					engineConvolve(g, ConvolutionAlgorithm::kDirect, weights, input));
+			}
+
+		for (bool zeroPad : { false, true })
+			for (uint32_t kernelSize : { 5, 13, 31 })
+			{
+				const MatrixType input = MatrixType::Random(257, 140);
+				const MatrixType kernel = MatrixType::Random(kernelSize, kernelSize);
+				const std::string name = "conv() 257x140 " + std::to_string(kernelSize) + "x" + std::to_string(kernelSize) + (zeroPad ? " zero padded" : " valid");
+				passed &= report(name, algorithmName(ConvolutionAlgorithm::kFft), conv(input, kernel, 1, zeroPad, false, ConvolutionAlgorithm::kFft),
+					conv(input, kernel, 1, zeroPad, false, ConvolutionAlgorithm::kDirect));
+			}
+		return passed;
+	}
+
+	// conv() on images against its reference loops, both padding modes. kAuto takes two 1D passes for kernels of rank 1
+	bool checkConv()
+	{
+		bool passed = true;
+		for (bool zeroPad : { false, true })
+			for (bool rankOne : { false, true })
+				for (auto size : { std::make_pair(16, 16), std::make_pair(37, 29), std::make_pair(130, 70) })
+				{
+					const MatrixType input = MatrixType::Random(size.first, size.second);
+					const MatrixType kernel = rankOne ? MatrixType(MatrixType::Random(3, 1) * MatrixType::Random(1, 3)) : MatrixType(MatrixType::Random(3, 3));
+					const MatrixType reference = conv(input, kernel, 1, zeroPad, false, ConvolutionAlgorithm::kDirect);
+					const std::string name = "conv() " + std::to_string(size.first) + "x" + std::to_string(size.second) + (rankOne ? " 3x3 rank 1" : " 3x3") +
+						(zeroPad ? " zero padded" : " valid");
+					for (auto algorithm : { ConvolutionAlgorithm::kWinograd2x2, ConvolutionAlgorithm::kWinograd4x4, ConvolutionAlgorithm::kAuto })
+						passed &= report(name, algorithmName(algorithm), conv(input, kernel, 1, zeroPad, false, algorithm), reference);
+				}
+		return passed;
+	}
+
+	std::string shapeName(const conv_geometry& g)
+	{
+		return std::to_string(g.channels) + "x" + std::to_string(g.height) + "x" + std::to_string(g.width) + " " + std::to_string(g.filters) + "@" +
+			std::to_string(g.kernelSize) + "x" + std::to_string(g.kernelSize) + " stride " + std::to_string(g.stride) + " pad " + std::to_string(g.padding);
+	}
+
+	// convBatch() against the direct loops one image at a time, with several channels, fewer images than
+	// workers so the filters are split into groups, groups of unequal size and stride 2
+	bool checkBatch(thread_pool& pool)
+	{
+		struct batch_case
+		{
+			conv_geometry g;
+			size_t count;
+		};
+		const batch_case cases[] = {
+			{ conv_geometry(3, 12, 10, 8, 3, 1, 1), 1 }, { conv_geometry(3, 12, 10, 7, 3, 1, 1), 2 }, { conv_geometry(2, 9, 13, 3, 3, 1, 0), 9 },
+			{ conv_geometry(4, 16, 16, 16, 3, 1, 1), 3 }, { conv_geometry(2, 13, 11, 5, 3, 2, 1), 3 }, { conv_geometry(3, 9, 9, 6, 5, 2, 2), 1 },
+			{ conv_geometry(2, 20, 15, 4, 5, 1, 2), 2 } };
+		bool passed = true;
+		for (const auto& c : cases)
+		{
+			const conv_geometry& g = c.g;
+			// the kernels one after another, as convBatch takes them, are the columns of the transposed weights
+			const MatrixType weights = MatrixType::Random(g.filters, g.patchSize());
+			const MatrixType kernels = weights.transpose();
+			const MatrixType images = MatrixType::Random(g.inputSize(), c.count);
+			MatrixType reference(g.outputSize(), c.count);
+			for (size_t n = 0; n < c.count; ++n)
+				reference.col(n) = engineConvolve(g, ConvolutionAlgorithm::kDirect, weights, images.col(n));
+			const std::string name = "convBatch() " + std::to_string(c.count) + " x " + shapeName(g);
+			std::vector<ConvolutionAlgorithm> algorithms = { ConvolutionAlgorithm::kAuto, ConvolutionAlgorithm::kDirect, ConvolutionAlgorithm::kIm2col };
+			if (g.stride == 1)
+				algorithms.push_back(ConvolutionAlgorithm::kFft);
+			if (g.stride == 1 && g.kernelSize == 3)
+				algorithms.insert(algorithms.end(), { ConvolutionAlgorithm::kWinograd2x2, ConvolutionAlgorithm::kWinograd4x4 });
+			for (auto algorithm : algorithms)
+			{
+				MatrixType output(g.outputSize(), c.count);
+				convBatch(g, images.data(), c.count, kernels.data(), output.data(), pool, false, algorithm);
+				passed &= report(name, algorithmName(algorithm), output, reference);
+			}
+		}
+		return passed;
+	}
+
+	// convSeparable() against conv() of the outer product of its kernels, with non-square inputs and
+	// kernels, both padding modes
+	bool checkSeparable()
+	{
+		bool passed = true;
+		for (bool zeroPad : { false, true })
+			for (auto kernelSize : { std::make_pair(1, 5), std::make_pair(3, 3), std::make_pair(5, 3), std::make_pair(3, 7) })
+				for (auto size : { std::make_pair(16, 16), std::make_pair(37, 23), std::make_pair(19, 70) })
+				{
+					const MatrixType input = MatrixType::Random(size.first, size.second);
+					const MatrixType columnKernel = MatrixType::Random(kernelSize.first, 1), rowKernel = MatrixType::Random(kernelSize.second, 1);
+					const MatrixType kernel = columnKernel * rowKernel.transpose();
+					const std::string name = "convSeparable() " + std::to_string(size.first) + "x" + std::to_string(size.second) + " " +
+						std::to_string(kernelSize.first) + "x" + std::to_string(kernelSize.second) + (zeroPad ? " zero padded" : " valid");
+					passed &= report(name, "separable", convSeparable(input, columnKernel, rowKernel, zeroPad),
+						conv(input, kernel, 1, zeroPad, false, ConvolutionAlgorithm::kDirect));
+				}
+		return passed;
+	}
+
+	// convDepthwise() against the direct loops one channel at a time. Even channels get kernels of rank 1,
+	// which take the two 1D passes at stride 1, odd ones full kernels, which take the engine
+	bool checkDepthwise(thread_pool& pool)
+	{
+		struct depthwise_case
+		{
+			conv_geometry g;
+			size_t count;
+		};
+		const depthwise_case cases[] = {
+			{ conv_geometry(4, 12, 10, 4, 3, 1, 1), 1 }, { conv_geometry(3, 17, 9, 3, 5, 1, 2), 3 }, { conv_geometry(5, 9, 14, 5, 3, 1, 0), 2 },
+			{ conv_geometry(4, 12, 10, 4, 3, 2, 1), 1 }, { conv_geometry(3, 17, 9, 3, 5, 2, 2), 3 }, { conv_geometry(2, 40, 33, 2, 7, 1, 3), 2 } };
+		bool passed = true;
+		for (const auto& c : cases)
+		{
+			const conv_geometry& g = c.g;
+			const conv_geometry channel(1, g.height, g.width, 1, g.kernelSize, g.stride, g.padding);
+			const size_t taps = size_t(g.kernelSize) * g.kernelSize;
+			// one kernel per channel, a row of taps each
+			MatrixType kernels(g.channels, taps);
+			for (uint32_t ch = 0; ch < g.channels; ++ch)
+			{
+				const MatrixType k = ch % 2 == 0 ? MatrixType(MatrixType::Random(g.kernelSize, 1) * MatrixType::Random(1, g.kernelSize)) :
+					MatrixType(MatrixType::Random(g.kernelSize, g.kernelSize));
+				kernels.row(ch) = Eigen::Map<const Eigen::Matrix<real, 1, Eigen::Dynamic>>(k.data(), taps);
+			}
+			const MatrixType kernelRows = kernels.transpose();
+			const MatrixType images = MatrixType::Random(g.inputSize(), c.count);
+			MatrixType reference(g.outputSize(), c.count);
+			for (size_t n = 0; n < c.count; ++n)
+				for (uint32_t ch = 0; ch < g.channels; ++ch)
+					reference.col(n).segment(ch * channel.pixels(), channel.pixels()) = engineConvolve(channel, ConvolutionAlgorithm::kDirect, kernels.row(ch),
+						images.col(n).segment(ch * channel.inputSize(), channel.inputSize()));
+			MatrixType output(g.outputSize(), c.count);
+			convDepthwise(g, images.data(), c.count, kernelRows.data(), output.data(), pool);
+			passed &= report("convDepthwise() " + std::to_string(c.count) + " x " + shapeName(g), "depthwise", output, reference);
+		}
+		return passed;
+	}
+}
+
+int main()
+{
+	bool passed = true;
+	passed &= checkEngine();
+	passed &= checkConv();
+	passed &= checkFft();
+	thread_pool pool(4);
+	passed &= checkBatch(pool);
+	passed &= checkSeparable();
+	passed &= checkDepthwise(pool);
+	std::cout << (passed ? "passed" : "failed") << std::endl;
+	return passed ? 0 : 1;
+}
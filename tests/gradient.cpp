@@ -0,0 +1,124 @@
+// checks the gradients of backprop() against central differences of the cost through convolution,
+// max and average pooling with windows that overlap and cross the padding, a fully connected layer and
+// a softmax output trained with cross-entropy. Returns non zero on a failure
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include "network.hpp"
+
+using namespace nn;
+
+namespace
+{
+	using MatrixType = layer::MatrixType;
+
+	// relative error of the gradient of a layer, the differences of float costs are good to a few digits
+	const double kTolerance = 3e-2;
+	// the cost is a sum of a few terms of order 1, a smaller step loses more to its rounding than it saves
+	const real kStep = real(1e-3);
+	// parameters checked per layer, all of them for the small ones
+	const size_t kSamples = 64;
+
+	real batchCost(const network& net, const MatrixType& input, const std::vector<uint8_t>& labels)
+	{
+		inference_workspace ws(net.m_layers, uint32_t(input.cols()));
+		real cost = real(0.0);
+		net.infer(input, ws, labels.data(), &cost);
+		return cost;
+	}
+
+	// the norm of the difference of the computed and the numerical gradient over the larger norm of the two
+	double checkParameters(network& net, aligned_matrix& parameters, const layer::ConstRef& gradient, const MatrixType& input,
+		const std::vector<uint8_t>& labels, std::mt19937& rng)
+	{
+		std::vector<size_t> indices(size_t(parameters.size()));
+		for (size_t i = 0; i < indices.size(); ++i)
+			indices[i] = i;
+		std::shuffle(indices.begin(), indices.end(), rng);
+		indices.resize(std::min(indices.size(), kSamples));
+		double difference = 0.0, numericalNorm = 0.0, computedNorm = 0.0;
+		for (size_t i : indices)
+		{
+			real& p = parameters.data()[i];
+			const real old = p;
+			p = old + kStep;
+			const real plus = batchCost(net, input, labels);
+			p = old - kStep;
+			const real minus = batchCost(net, input, labels);
+			p = old;
+			const double numerical = (double(plus) - double(minus)) / (2.0 * kStep), computed = gradient.data()[i];
+			difference += (numerical - computed) * (numerical - computed);
+			numericalNorm += numerical * numerical;
+			computedNorm += computed * computed;
+		}
+		return std::sqrt(difference) / std::max(1e-12, std::sqrt(std::max(numericalNorm, computedNorm)));
+	}
+
+	// A step which moves the maximum of a window to another pixel puts a kink into the cost, the difference
+	// across it means nothing. So every filter passes one input channel through its center tap and the pixels
+	// of a channel are its levels shuffled: neighbours in a window differ by far more than a step of any
+	// weight moves them, while the maxima still fall anywhere, shared by overlapping windows or not
+	bool check(LayerType poolType, const conv_geometry& pooling, std::mt19937& rng)
+	{
+		const uint32_t batchSize = 4;
+		const conv_geometry convolution(2, pooling.height, pooling.width, pooling.channels, 3, 1, 1);
+		network net;
+		net.addLayer(LayerType::kInput, uint32_t(convolution.inputSize()), ActivationType::kNone, WeightInitializationType::kNone);
+		net.addLayer(convolution, ActivationType::kTanh, WeightInitializationType::kNone);
+		net.addLayer(poolType, pooling);
+		net.addLayer(LayerType::kFC, 16, ActivationType::kSigmoid, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kSoftmax, 5, ActivationType::kNone, WeightInitializationType::kNone);
+		net.initializeWeights(WeightInitializationType::kWeightedGaussian, 1);
+		net.setCostFunction(CostType::kCrossEntropy);
+		auto& filters = net.m_layers[1].getWeights();
+		filters.setZero();
+		for (uint32_t f = 0; f < convolution.filters; ++f)
+			filters(f, (f % convolution.channels) * 9 + 4) = real(0.5) + real(f) / convolution.filters;
+
+		const size_t pixels = size_t(convolution.height) * convolution.width;
+		std::vector<real> levels(pixels);
+		for (size_t i = 0; i < pixels; ++i)
+			levels[i] = real(2.0 * (i + 0.5) / pixels - 1.0);
+		MatrixType input(convolution.inputSize(), batchSize);
+		for (uint32_t n = 0; n < batchSize; ++n)
+			for (uint32_t c = 0; c < convolution.channels; ++c)
+			{
+				std::shuffle(levels.begin(), levels.end(), rng);
+				std::copy(levels.begin(), levels.end(), input.col(n).data() + c * pixels);
+			}
+		const std::vector<uint8_t> labels = { 0, 3, 1, 4 };
+		workspace ws(net.m_layers, batchSize);
+		net.feedforward(input, ws);
+		net.backprop(labels.data(), input, ws);
+
+		double worst = 0.0;
+		for (size_t i : { 1, 3, 4 })
+		{
+			worst = std::max(worst, checkParameters(net, net.m_layers[i].getWeights(), ws.nablaW(i), input, labels, rng));
+			worst = std::max(worst, checkParameters(net, net.m_layers[i].getBias(), ws.nablaB(i), input, labels, rng));
+		}
+		const bool passed = worst <= kTolerance;
+		const std::string name = std::string(poolType == LayerType::kMaxPool ? "max" : "average") + " pool " + std::to_string(pooling.kernelSize) + "x" +
+			std::to_string(pooling.kernelSize) + " stride " + std::to_string(pooling.stride) + " pad " + std::to_string(pooling.padding);
+		std::cout << std::setw(40) << std::left << name << std::right << std::scientific << std::setprecision(1) << worst << (passed ? "" : "  FAILED") << std::endl;
+		return passed;
+	}
+}
+
+int main()
+{
+	bool passed = true;
+	std::mt19937 rng(1);
+	// disjoint windows, overlapping ones crossing the padding, and overlapping ones which don't reach the last row and column
+	const conv_geometry poolings[] = { conv_geometry(3, 8, 8, 3, 2, 2, 0), conv_geometry(3, 9, 9, 3, 3, 2, 1), conv_geometry(3, 8, 10, 3, 3, 2, 0),
+		conv_geometry(3, 7, 7, 3, 3, 1, 1) };
+	for (auto poolType : { LayerType::kMaxPool, LayerType::kAvgPool })
+		for (const auto& pooling : poolings)
+			passed &= check(poolType, pooling, rng);
+	std::cout << (passed ? "passed" : "failed") << std::endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+// checks that gzip_reader decodes intact archives and throws on corrupted or truncated ones, single
+// member streams decoded in the background as well as BGZF archives decoded in parallel. Returns non
+// zero on a failure
+#include <stdint.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include "gzip.hpp"
+
+using namespace nn;
+
+namespace
+{
+	void put32(std::vector<uint8_t>& out, uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+			out.push_back(uint8_t(value >> (8 * i)));
+	}
+
+	// one member of stored deflate blocks, with the BGZF size field when bgzf is set
+	void appendMember(std::vector<uint8_t>& out, const uint8_t* data, size_t size, bool bgzf)
+	{
+		const size_t begin = out.size();
+		const uint8_t header[] = { 0x1F, 0x8B, 8, uint8_t(bgzf ? 0x04 : 0), 0, 0, 0, 0, 0, 0xFF };
+		out.insert(out.end(), header, header + sizeof(header));
+		if (bgzf)
+		{
+			const uint8_t extra[] = { 6, 0, 'B', 'C', 2, 0, 0, 0 };
+			out.insert(out.end(), extra, extra + sizeof(extra));
+		}
+		size_t offset = 0;
+		do
+		{
+			const size_t n = std::min<size_t>(size - offset, 0xFFFF);
+			out.push_back(offset + n == size ? 1 : 0);
+			out.push_back(uint8_t(n));
+			out.push_back(uint8_t(n >> 8));
+			out.push_back(uint8_t(~n));
+			out.push_back(uint8_t(~n >> 8));
+			out.insert(out.end(), data + offset, data + offset + n);
+			offset += n;
+		} while (offset < size);
+		put32(out, crc32(0, data, size));
+		put32(out, uint32_t(size));
+		if (bgzf)
+		{
+			const size_t blockSize = out.size() - begin - 1;
+			out[begin + 16] = uint8_t(blockSize);
+			out[begin + 17] = uint8_t(blockSize >> 8);
+		}
+	}
+
+	std::vector<uint8_t> compress(const std::vector<uint8_t>& data, size_t memberSize, bool bgzf)
+	{
+		std::vector<uint8_t> out;
+		for (size_t offset = 0; offset < data.size(); offset += memberSize)
+			appendMember(out, data.data() + offset, std::min(memberSize, data.size() - offset), bgzf);
+		return out;
+	}
+
+	// decodes the way idx_file does: the header on the calling thread, the rest in the background
+	bool decodes(const std::vector<uint8_t>& archive, const std::vector<uint8_t>& data, unsigned threads, std::string& error)
+	{
+		try
+		{
+			gzip_reader reader(archive.data(), archive.size());
+			reader.peek(16);
+			reader.start(data.size(), threads);
+			reader.wait(data.size());
+			return std::equal(data.begin(), data.end(), reader.data());
+		}
+		catch (const std::exception& e)
+		{
+			error = e.what();
+			return false;
+		}
+	}
+
+	size_t failures = 0;
+
+	void check(const std::string& name, const std::vector<uint8_t>& archive, const std::vector<uint8_t>& data, unsigned threads, bool intact)
+	{
+		std::string error;
+		const bool decoded = decodes(archive, data, threads, error);
+		const bool passed = decoded == intact;
+		failures += passed ? 0 : 1;
+		std::cout << std::setw(40) << std::left << name << (decoded ? "decoded" : error) << (passed ? "" : "  FAILED") << std::endl;
+	}
+}
+
+int main()
+{
+	std::vector<uint8_t> data(300000);
+	for (size_t i = 0; i < data.size(); ++i)
+		data[i] = uint8_t(i * 7 + i / 251);
+
+	struct layout
+	{
+		const char* name;
+		size_t memberSize;
+		bool bgzf;
+		unsigned threads;
+	};
+	const layout layouts[] = {
+		{ "single member", data.size(), false, 1 },
+		{ "multi-member", 70000, false, 1 },
+		{ "bgzf, sequential", 50000, true, 1 },
+		{ "bgzf, parallel", 50000, true, 3 } };
+	for (const auto& l : layouts)
+	{
+		const std::vector<uint8_t> archive = compress(data, l.memberSize, l.bgzf);
+		check(std::string(l.name) + ", intact", archive, data, l.threads, true);
+
+		// a flipped byte of the data, of the CRC and of the size in the trailer of the first member
+		std::vector<uint8_t> first;
+		appendMember(first, data.data(), l.memberSize, l.bgzf);
+		const size_t trailer = first.size() - 8;
+		for (auto corrupted : { std::make_pair("data", size_t(1000)), std::make_pair("crc", trailer), std::make_pair("size", trailer + 4) })
+		{
+			std::vector<uint8_t> damaged = archive;
+			damaged[corrupted.second] ^= 0x10;
+			check(std::string(l.name) + ", corrupted " + corrupted.first, damaged, data, l.threads, false);
+		}
+		check(std::string(l.name) + ", truncated", std::vector<uint8_t>(archive.begin(), archive.end() - 100), data, l.threads, false);
+	}
+	std::cout << (failures == 0 ? "passed" : "failed") << std::endl;
+	return failures == 0 ? 0 : 1;
+}
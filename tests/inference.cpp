@@ -0,0 +1,95 @@
+// checks infer() against the single threaded feedforward(): the outputs, and the costs of labelled
+// batches, for a softmax output fused with cross-entropy and for outputs which aren't fused, with an
+// odd and an even number of layers. Returns non zero on a failure
+#include <math.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "network.hpp"
+
+using namespace nn;
+
+namespace
+{
+	const real kTolerance = real(1e-5);
+
+	real relativeError(real result, real reference) { return std::abs(result - reference) / std::max(real(1.0), std::abs(reference)); }
+
+	// the cost infer() adds for a batch, from the outputs of feedforward()
+	real referenceCost(const network& net, CostType costType, const layer::MatrixType& output, const uint8_t* labels)
+	{
+		if (costType == CostType::kQuadratic)
+			return cost<CostType::kQuadratic>(output, labels);
+		if (net.m_layers.back().type() != LayerType::kSoftmax)
+			return cost<CostType::kCrossEntropy>(output, labels);
+		real c = real(0.0);
+		for (layer::MatrixType::Index i = 0; i < output.cols(); ++i)
+			c -= log(output(labels[i], i));
+		return c;
+	}
+
+	bool check(const std::string& name, network net, CostType costType)
+	{
+		const uint32_t batchSize = 12;
+		net.initializeWeights(WeightInitializationType::kWeightedGaussian, 1);
+		net.setCostFunction(costType);
+		const layer::MatrixType input = layer::MatrixType::Random(net.m_layers.front().UnitsInLayer(), batchSize);
+		std::vector<uint8_t> labels(batchSize);
+		for (uint32_t i = 0; i < batchSize; ++i)
+			labels[i] = uint8_t(i % net.m_layers.back().UnitsInLayer());
+
+		const layer::MatrixType reference = net.feedforward(input);
+		const layer::MatrixType output = net.infer(input);
+		inference_workspace ws(net.m_layers, batchSize);
+		real cost = real(0.0);
+		net.infer(input, ws, labels.data(), &cost);
+
+		const real outputError = output.rows() == reference.rows() && output.cols() == reference.cols() ?
+			(output - reference).cwiseAbs().maxCoeff() / std::max(real(1.0), reference.cwiseAbs().maxCoeff()) : real(INFINITY);
+		const real costError = relativeError(cost, referenceCost(net, costType, reference, labels.data()));
+		const bool passed = outputError <= kTolerance && costError <= kTolerance;
+		std::cout << std::setw(40) << std::left << name << std::right << std::scientific << std::setprecision(1) << std::setw(10) << outputError <<
+			std::setw(10) << costError << (passed ? "" : "  FAILED") << std::endl;
+		return passed;
+	}
+
+	network fc(uint32_t hidden, LayerType outputType, ActivationType outputActivation)
+	{
+		network net;
+		net.addLayer(LayerType::kInput, 40, ActivationType::kNone, WeightInitializationType::kNone);
+		for (uint32_t i = 0; i < hidden; ++i)
+			net.addLayer(LayerType::kFC, 24, ActivationType::kSigmoid, WeightInitializationType::kNone);
+		net.addLayer(outputType, 10, outputActivation, WeightInitializationType::kNone);
+		return net;
+	}
+
+	network convolutional()
+	{
+		network net;
+		net.addLayer(LayerType::kInput, 2 * 8 * 8, ActivationType::kNone, WeightInitializationType::kNone);
+		net.addLayer(conv_geometry(2, 8, 8, 4, 3, 1, 1), ActivationType::kRelu, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kMaxPool, conv_geometry(4, 8, 8, 4, 2, 2, 0));
+		net.addLayer(LayerType::kFC, 32, ActivationType::kSigmoid, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kSoftmax, 10, ActivationType::kNone, WeightInitializationType::kNone);
+		return net;
+	}
+}
+
+int main()
+{
+	bool passed = true;
+	for (uint32_t hidden : { 0, 1, 2 })
+	{
+		const std::string layers = std::to_string(hidden) + " hidden, ";
+		passed &= check(layers + "softmax, cross-entropy", fc(hidden, LayerType::kSoftmax, ActivationType::kNone), CostType::kCrossEntropy);
+		passed &= check(layers + "softmax, quadratic", fc(hidden, LayerType::kSoftmax, ActivationType::kNone), CostType::kQuadratic);
+		passed &= check(layers + "sigmoid, quadratic", fc(hidden, LayerType::kFC, ActivationType::kSigmoid), CostType::kQuadratic);
+		passed &= check(layers + "sigmoid, cross-entropy", fc(hidden, LayerType::kFC, ActivationType::kSigmoid), CostType::kCrossEntropy);
+	}
+	passed &= check("conv, pool, softmax, cross-entropy", convolutional(), CostType::kCrossEntropy);
+	passed &= check("conv, pool, softmax, quadratic", convolutional(), CostType::kQuadratic);
+	std::cout << (passed ? "passed" : "failed") << std::endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+// checks that training steps don't allocate: Eigen throws on any allocation while it is disallowed.
+// First single threaded steps on a workspace with allocations disallowed throughout, then sgd, psgd
+// and the pipeline, where only the no_malloc_scope of the training loops disallows them. The Eigen
+// flag is process wide and the last scope to close on any thread allows allocations again, so on
+// several threads an allocation can go unnoticed, but one that throws is real
+#include <stdexcept>
+#define EIGEN_RUNTIME_NO_MALLOC
+#define eigen_assert(x) do { if (!(x)) throw std::logic_error(#x); } while (false)
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <functional>
+#include "network.hpp"
+
+using namespace nn;
+
+namespace
+{
+	network makeNetwork(CostType costType)
+	{
+		network net;
+		net.addLayer(LayerType::kInput, 2 * 8 * 8, ActivationType::kNone, WeightInitializationType::kNone);
+		net.addLayer(conv_geometry(2, 8, 8, 4, 3, 1, 1), ActivationType::kRelu, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kMaxPool, conv_geometry(4, 8, 8, 4, 2, 2, 0));
+		net.addLayer(LayerType::kFC, 32, ActivationType::kSigmoid, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kSoftmax, 10, ActivationType::kNone, WeightInitializationType::kNone);
+		net.initializeWeights(WeightInitializationType::kWeightedGaussian, 1);
+		net.setCostFunction(costType);
+		return net;
+	}
+
+	// one warm-up step may fill caches, the steps after it must not allocate
+	bool check(const char* name, CostType costType)
+	{
+		const uint32_t batchSize = 16;
+		network net = makeNetwork(costType);
+		workspace ws(net.m_layers, batchSize);
+		const layer::MatrixType input = layer::MatrixType::Random(2 * 8 * 8, batchSize);
+		std::vector<uint8_t> labels(batchSize);
+		for (uint32_t i = 0; i < batchSize; ++i)
+			labels[i] = uint8_t(i % 10);
+
+		auto step = [&]()
+		{
+			net.feedforward(input, ws);
+			net.backprop(labels.data(), input, ws);
+			net.update_weights(real(0.1), real(0.01), batchSize, ws);
+		};
+
+		step();
+		bool passed = true;
+		Eigen::internal::set_is_malloc_allowed(false);
+		try
+		{
+			for (int i = 0; i < 3; ++i)
+				step();
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << name << ": allocation in a training step: " << e.what() << std::endl;
+			passed = false;
+		}
+		Eigen::internal::set_is_malloc_allowed(true);
+		std::cout << name << (passed ? " passed" : " failed") << std::endl;
+		return passed;
+	}
+
+	const char* updateName(UpdateType updateType)
+	{
+		switch (updateType)
+		{
+		case UpdateType::kLocked: return "locked";
+		case UpdateType::kHogwild: return "hogwild";
+		case UpdateType::kSynchronous: return "synchronous";
+		case UpdateType::kWavefront: return "wavefront";
+		default: return "?";
+		}
+	}
+
+	// every training loop of the network on two workers, from a decoded dataset in order and shuffled
+	// and from a pipeline. The workspaces are allocated before the loops open their scopes
+	bool checkTraining()
+	{
+		const uint32_t batchSize = 16, samples = 8 * batchSize;
+		dataset::MatrixType inputs = dataset::MatrixType::Random(2 * 8 * 8, samples);
+		std::vector<uint8_t> labels(samples);
+		std::vector<uint32_t> order(samples);
+		for (uint32_t i = 0; i < samples; ++i)
+		{
+			labels[i] = uint8_t(i % 10);
+			order[i] = (i * 7) % samples;
+		}
+		const dataset data(std::move(inputs), std::move(labels));
+		const auto pool = std::make_shared<thread_pool>(2);
+
+		bool passed = true;
+		auto run = [&](const std::string& name, const std::function<void(network&)>& train)
+		{
+			network net = makeNetwork(CostType::kCrossEntropy);
+			net.setThreadPool(pool);
+			try
+			{
+				train(net);
+			}
+			catch (const std::exception& e)
+			{
+				std::cout << name << ": allocation in a training step: " << e.what() << std::endl;
+				passed = false;
+				return;
+			}
+			std::cout << name << " passed" << std::endl;
+		};
+
+		const uint32_t batches = samples / batchSize;
+		run("sgd", [&](network& net) { net.sgd(batches, batchSize, real(0.1), real(0.01), data); });
+		run("sgd, shuffled", [&](network& net) { net.sgd(batches, batchSize, real(0.1), real(0.01), data, order); });
+		run("sgd, pipeline", [&](network& net)
+		{
+			batch_pipeline pipeline(data, batchSize);
+			net.sgd(pipeline, batches, real(0.1), real(0.01));
+		});
+		for (auto updateType : { UpdateType::kLocked, UpdateType::kHogwild, UpdateType::kSynchronous, UpdateType::kWavefront })
+		{
+			const std::string name = std::string("psgd ") + updateName(updateType);
+			run(name, [&](network& net) { net.psgd(batches, batchSize, real(0.1), real(0.01), data, updateType); });
+			run(name + ", shuffled", [&](network& net) { net.psgd(batches, batchSize, real(0.1), real(0.01), data, updateType, order); });
+			run(name + ", pipeline", [&](network& net)
+			{
+				batch_pipeline pipeline(data, batchSize);
+				net.psgd(pipeline, batches, real(0.1), real(0.01), updateType);
+			});
+		}
+		return passed;
+	}
+}
+
+int main()
+{
+	bool passed = true;
+	passed &= check("cross-entropy", CostType::kCrossEntropy);
+	passed &= check("quadratic", CostType::kQuadratic);
+	passed &= checkTraining();
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+// checks the 16 bit conversions: the scalar ones against known results for ties, subnormals, overflow and
+// NaNs, the vector kernels of every instruction set this CPU runs against the scalar ones bit for bit, and
+// that snapshots of a network with 16 bit weights copy the weights as they are. Returns non zero on a failure
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <cmath>
+#include "kernels.hpp"
+#include "network.hpp"
+
+using namespace nn;
+
+namespace
+{
+	float fromBits(uint32_t bits)
+	{
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	uint32_t toBits(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	bool isSubnormal(float value) { return (toBits(value) & 0x7f800000) == 0 && (toBits(value) & 0x7fffff) != 0; }
+
+	size_t failures = 0;
+
+	void expect(bool condition, const char* what, uint32_t input, uint32_t result)
+	{
+		if (condition)
+			return;
+		if (++failures <= 20)
+			std::cout << what << ": 0x" << std::hex << input << " gave 0x" << result << std::dec << std::endl;
+	}
+
+	struct conversion_case
+	{
+		uint32_t input;
+		uint16_t expected;
+	};
+
+	void checkScalar()
+	{
+		const conversion_case half[] = {
+			{ 0x3f800000, 0x3c00 }, // 1
+			{ 0xbf800000, 0xbc00 }, // -1
+			{ 0x3f801000, 0x3c00 }, // 1 + 2^-11, a tie to the even 1
+			{ 0x3f803000, 0x3c02 }, // 1 + 3 * 2^-11, a tie to the even 1 + 2^-9
+			{ 0x3f801001, 0x3c01 }, // just above the tie
+			{ 0x477fe000, 0x7bff }, // 65504, the largest half
+			{ 0x477fefff, 0x7bff }, // just below 65520
+			{ 0x477ff000, 0x7c00 }, // 65520 overflows
+			{ 0x501502f9, 0x7c00 }, // 1e10
+			{ 0x7f800000, 0x7c00 }, // infinity
+			{ 0xff800000, 0xfc00 }, // -infinity
+			{ 0x38800000, 0x0400 }, // 2^-14, the smallest normal half
+			{ 0x387ff000, 0x0400 }, // rounds up from the subnormals to the smallest normal
+			{ 0x387fc000, 0x03ff }, // the largest subnormal half
+			{ 0x33800000, 0x0001 }, // 2^-24, the smallest subnormal half
+			{ 0x33000000, 0x0000 }, // 2^-25, a tie to the even 0
+			{ 0x33000001, 0x0001 }, // just above it
+			{ 0x33c00000, 0x0002 }, // 3 * 2^-25, a tie to the even 2^-23
+			{ 0xb3800000, 0x8001 }, // -2^-24
+			{ 0x00000001, 0x0000 }, // subnormal floats are far below the halves
+			{ 0x80000001, 0x8000 },
+			{ 0x00000000, 0x0000 },
+			{ 0x80000000, 0x8000 } };
+		for (const auto& c : half)
+			expect(floatToHalf(fromBits(c.input)) == c.expected, "floatToHalf", c.input, floatToHalf(fromBits(c.input)));
+
+		const conversion_case bfloat16[] = {
+			{ 0x3f800000, 0x3f80 }, // 1
+			{ 0x3f808000, 0x3f80 }, // a tie to the even 1
+			{ 0x3f818000, 0x3f82 }, // a tie to the even 1 + 2^-6
+			{ 0x3f808001, 0x3f81 }, // just above the tie
+			{ 0x7f7f0000, 0x7f7f }, // the largest bfloat16
+			{ 0x7f7f7fff, 0x7f7f }, // just below the tie
+			{ 0x7f7f8000, 0x7f80 }, // a tie to the even infinity
+			{ 0x7f7fffff, 0x7f80 }, // the largest float overflows
+			{ 0xff7fffff, 0xff80 },
+			{ 0x7f800000, 0x7f80 }, // infinity
+			{ 0x00008000, 0x0000 }, // subnormals: a tie to the even 0
+			{ 0x00018000, 0x0002 }, // a tie to the even 2^-148
+			{ 0x00010001, 0x0001 },
+			{ 0x807fffff, 0x8080 }, // the largest subnormal rounds up to the smallest normal
+			{ 0x80000000, 0x8000 } };
+		for (const auto& c : bfloat16)
+			expect(floatToBfloat16(fromBits(c.input)) == c.expected, "floatToBfloat16", c.input, floatToBfloat16(fromBits(c.input)));
+
+		// NaNs stay NaNs with their sign, signalling ones included, and don't round into infinity
+		for (uint32_t nan : { 0x7fc00000u, 0xffc00000u, 0x7f800001u, 0xff800001u, 0x7fa00000u, 0x7f800100u, 0x7fffffffu })
+		{
+			const uint16_t h = floatToHalf(fromBits(nan)), b = floatToBfloat16(fromBits(nan));
+			expect((h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0 && (h & 0x8000) == ((nan >> 16) & 0x8000), "floatToHalf NaN", nan, h);
+			expect((b & 0x7f80) == 0x7f80 && (b & 0x7f) != 0 && (b & 0x8000) == (nan >> 16 & 0x8000), "floatToBfloat16 NaN", nan, b);
+		}
+
+		// widening is exact, subnormal halves become normal floats and NaNs come back quiet
+		for (uint32_t h = 0; h < 0x10000; ++h)
+		{
+			const float value = halfToFloat(uint16_t(h));
+			const uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+			if (exponent == 0x1f && mantissa != 0)
+				expect(std::isnan(value) && (toBits(value) & 0x400000) != 0, "halfToFloat NaN", h, toBits(value));
+			else
+			{
+				const double magnitude = exponent == 0 ? std::ldexp(double(mantissa), -24) :
+					exponent == 0x1f ? INFINITY : std::ldexp(double(mantissa | 0x400), int(exponent) - 25);
+				expect(double(value) == ((h & 0x8000) ? -magnitude : magnitude), "halfToFloat", h, toBits(value));
+				// and rounds back to itself
+				expect(floatToHalf(value) == h, "floatToHalf round trip", h, floatToHalf(value));
+			}
+			expect(toBits(bfloat16ToFloat(uint16_t(h))) == h << 16, "bfloat16ToFloat", h, toBits(bfloat16ToFloat(uint16_t(h))));
+		}
+	}
+
+	// the AVX-512 BF16 instruction takes subnormal floats as zeros, the other kernels match the scalar rounding
+	bool flushesSubnormals(const kernel_table& table)
+	{
+		for (const auto& variant : kernelVariants())
+			if (variant.kernel == "storage" && variant.variant == "avx512bf16")
+				return table.floatToBfloat16 == kernels().floatToBfloat16;
+		return false;
+	}
+
+	void checkKernels(const kernel_table& table)
+	{
+		const size_t before = failures;
+		const bool flushes = flushesSubnormals(table);
+		std::vector<float> inputs;
+		for (uint32_t bits : { 0x3f801000u, 0x3f803000u, 0x477fefffu, 0x477ff000u, 0x7f7f8000u, 0x7f7fffffu, 0x387ff000u, 0x33000000u, 0x33000001u,
+			0x33c00000u, 0x00018000u, 0x807fffffu, 0x7fc00000u, 0xff800001u, 0x7f800000u, 0xff800000u, 0x00000000u, 0x80000000u })
+			inputs.push_back(fromBits(bits));
+		// random patterns cover every exponent, NaNs and subnormals included
+		std::mt19937 rng(1);
+		std::uniform_int_distribution<uint32_t> bits;
+		while (inputs.size() < 100000)
+			inputs.push_back(fromBits(bits(rng)));
+
+		// every length up to a few vectors for the tails, then everything at once
+		for (size_t begin = 0, size = 0; begin < inputs.size(); begin += size, size = size < 70 ? size + 1 : inputs.size())
+		{
+			const size_t n = std::min(size, inputs.size() - begin);
+			const float* in = inputs.data() + begin;
+			std::vector<uint16_t> half(n), bfloat16(n);
+			std::vector<float> halfBack(n), bfloat16Back(n);
+			table.floatToHalf(n, in, half.data());
+			table.floatToBfloat16(n, in, bfloat16.data());
+			table.halfToFloat(n, half.data(), halfBack.data());
+			table.bfloat16ToFloat(n, bfloat16.data(), bfloat16Back.data());
+			for (size_t i = 0; i < n; ++i)
+			{
+				const uint16_t expected = flushes && isSubnormal(in[i]) ? uint16_t((toBits(in[i]) >> 16) & 0x8000) : floatToBfloat16(in[i]);
+				expect(half[i] == floatToHalf(in[i]), table.name, toBits(in[i]), half[i]);
+				expect(bfloat16[i] == expected, table.name, toBits(in[i]), bfloat16[i]);
+				expect(toBits(halfBack[i]) == toBits(halfToFloat(half[i])), table.name, half[i], toBits(halfBack[i]));
+				expect(toBits(bfloat16Back[i]) == toBits(bfloat16ToFloat(bfloat16[i])), table.name, bfloat16[i], toBits(bfloat16Back[i]));
+			}
+		}
+
+		// every 16 bit pattern widened
+		std::vector<uint16_t> all(0x10000);
+		for (uint32_t h = 0; h < 0x10000; ++h)
+			all[h] = uint16_t(h);
+		std::vector<float> widened(all.size());
+		table.halfToFloat(all.size(), all.data(), widened.data());
+		for (uint32_t h = 0; h < 0x10000; ++h)
+			expect(toBits(widened[h]) == toBits(halfToFloat(uint16_t(h))), table.name, h, toBits(widened[h]));
+		table.bfloat16ToFloat(all.size(), all.data(), widened.data());
+		for (uint32_t h = 0; h < 0x10000; ++h)
+			expect(toBits(widened[h]) == h << 16, table.name, h, toBits(widened[h]));
+		std::cout << std::setw(10) << table.name << (flushes ? " (bfloat16 by avx512bf16)" : "") << (failures == before ? " passed" : " failed") << std::endl;
+	}
+
+	// a snapshot taken while the 16 bit copies are stale infers with the weights as they are
+	void checkSnapshot()
+	{
+		network net;
+		net.addLayer(LayerType::kInput, 64, ActivationType::kNone, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kFC, 32, ActivationType::kSigmoid, WeightInitializationType::kNone);
+		net.addLayer(LayerType::kSoftmax, 10, ActivationType::kNone, WeightInitializationType::kNone);
+		net.initializeWeights(WeightInitializationType::kWeightedGaussian, 1);
+		net.setWeightStorage(StorageType::kBfloat16);
+		// what training does between the refreshes of the copies
+		for (size_t i = 1; i < net.m_layers.size(); ++i)
+			net.m_layers[i].getWeights() *= real(-2.0);
+		const layer::MatrixType input = layer::MatrixType::Random(64, 8);
+		const layer::MatrixType fromSnapshot = net.snapshot().infer(input);
+		net.setWeightStorage(StorageType::kBfloat16);
+		const layer::MatrixType fromWeights = net.infer(input);
+		const bool passed = fromSnapshot == fromWeights;
+		failures += passed ? 0 : 1;
+		std::cout << "snapshot " << (passed ? "passed" : "failed") << std::endl;
+	}
+}
+
+int main()
+{
+	checkScalar();
+	std::cout << "scalar " << (failures == 0 ? "passed" : "failed") << std::endl;
+	for (auto isa : { IsaLevel::kGeneric, IsaLevel::kSse42, IsaLevel::kAvx2, IsaLevel::kAvx512 })
+		if (isaSupported(isa))
+			checkKernels(kernels(isa));
+	checkSnapshot();
+	return failures == 0 ? 0 : 1;
+}